@@ -2,8 +2,10 @@
 #include <array>
 #include <bitset>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include "../syscall.h"
+#include "../timepage.h"
 
 using namespace std;
 
@@ -22,8 +24,9 @@ const int kBarSpeed = kCanvasWidth / 2; // pixels/sec
 const int kBallSpeed = kBarSpeed;
 
 array<bitset<kNumBlocksX>, kNumBlocksY> blocks;
+uint8_t batch_buf[4096];
 
-void DrawBlocks(uint64_t layer_id) {
+void DrawBlocks(DrawBatch& batch) {
 	for (int by = 0; by < kNumBlocksY; ++by) {
 		const int y = 24 + kGapHeight + by * kBlockHeight;
 		const uint32_t color = 0xff << (by % 3) * 8;
@@ -32,23 +35,23 @@ void DrawBlocks(uint64_t layer_id) {
 			if (blocks[by][bx]) {
 				const int x = 4 + kGapWidth + bx * kBlockWidth;
 				const uint32_t c = color | (0xff << ((bx + by) % 3) * 8);
-				SyscallWinFillRectangle(layer_id, x, y, kBlockWidth, kBlockHeight, c);
+				DrawBatchFillRect(&batch, x, y, kBlockWidth, kBlockHeight, c);
 			}
 		}
 	}
 }
 
-void DrawBar(uint64_t layer_id, int bar_x) {
-	SyscallWinFillRectangle(layer_id,
+void DrawBar(DrawBatch& batch, int bar_x) {
+	DrawBatchFillRect(&batch,
 		4 + bar_x, 24 + kBarY,
 		kBarWidth, kBarHeight, 0xffffff);
 }
 
-void DrawBall(uint64_t layer_id, int x, int y) {
-	SyscallWinFillRectangle(layer_id,
+void DrawBall(DrawBatch& batch, int x, int y) {
+	DrawBatchFillRect(&batch,
 		4 + x - kBallRadius, 24 + y - kBallRadius,
 		2 * kBallRadius, 2 * kBallRadius, 0x007f00);
-	SyscallWinFillRectangle(layer_id,
+	DrawBatchFillRect(&batch,
 		4 + x - kBallRadius / 2, 24 + y - kBallRadius / 2,
 		kBallRadius, kBallRadius, 0x00ff00);
 }
@@ -82,27 +85,31 @@ extern "C" void main(int argc, char** argv) {
 	int ball_dir = 0; // degree
 	int ball_dx = 0, ball_dy = 0;
 
+	DrawBatch batch;
+	DrawBatchInit(&batch, layer_id, batch_buf, sizeof(batch_buf));
+	uint64_t draw_ns = 0;
+	int frames = 0;
+
 	for (;;) {
-		// 画面を一旦クリアし，各種オブジェクトを描画
-		SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-			4, 24, kCanvasWidth, kCanvasHeight, 0);
+		// 画面を一旦クリアし，各種オブジェクトを描画. 描画コマンドは1回のシステムコールで送る
+		const auto draw_start = TimePageNs();
+		DrawBatchFillRect(&batch, 4, 24, kCanvasWidth, kCanvasHeight, 0);
 
-		DrawBlocks(layer_id | LAYER_NO_REDRAW);
-		DrawBar(layer_id | LAYER_NO_REDRAW, bar_x);
+		DrawBlocks(batch);
+		DrawBar(batch, bar_x);
 		if (ball_y >= 0) {
-			DrawBall(layer_id | LAYER_NO_REDRAW, ball_x, ball_y);
+			DrawBall(batch, ball_x, ball_y);
 		}
-		SyscallWinRedraw(layer_id);
+		DrawBatchFlush(&batch);
+		draw_ns += TimePageNs() - draw_start;
+		++frames;
 
 		static unsigned long prev_timeout = 0;
 		if (prev_timeout == 0) {
-			const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
-			prev_timeout = timeout.value;
-		}
-		else {
-			prev_timeout += 1000 / kFrameRate;
-			SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+			prev_timeout = TimePageNs() / 1000000;
 		}
+		prev_timeout += 1000 / kFrameRate;
+		SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
 
 		AppEvent events[1];
 		for (;;) {
@@ -206,6 +213,7 @@ extern "C" void main(int argc, char** argv) {
 	}
 
 fin:
+	printf("%d frames, draw %lu us/frame\n", frames, draw_ns / frames / 1000);
 	SyscallCloseWindow(layer_id);
 	exit(0);
 }
\ No newline at end of file
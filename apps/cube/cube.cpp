@@ -1,9 +1,11 @@
 //立方体回転
 #include <array>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <cmath>
 #include "../syscall.h"
+#include "../timepage.h"
 
 using namespace std;
 
@@ -17,8 +19,8 @@ struct Vector2D {
 	T x, y;
 };
 
-void DrawObj(uint64_t layer_id);
-void DrawSurface(uint64_t layer_id, int sur);
+void DrawObj(DrawBatch& batch);
+void DrawSurface(DrawBatch& batch, int sur);
 bool Sleep(unsigned long ms);
 
 const int kScale = 50, kMargin = 10;
@@ -41,11 +43,17 @@ const array<uint32_t, kSurface.size()> kColor{
 array<Vector3D<double>, kCube.size()> vert;
 array<double, kSurface.size()> centerz4;
 array<Vector2D<int>, kCube.size()> scr;
+uint8_t batch_buf[16 * 1024];
 
 extern "C" void main(int argc, char** argv) {
 	auto [layer_id, err_openwin] = SyscallOpenWindow(kCanvasSize + 8, kCanvasSize + 28, 10, 10, "cube");
 	if (err_openwin) { exit(err_openwin); }
 
+	DrawBatch batch;
+	DrawBatchInit(&batch, layer_id, batch_buf, sizeof(batch_buf));
+	uint64_t draw_ns = 0;
+	int frames = 0;
+
 	int thx = 0, thy = 0, thz = 0;
 	const double to_rad = pi / 0x8000;
 	for (;;) {
@@ -74,21 +82,24 @@ extern "C" void main(int argc, char** argv) {
 			}
 		}
 
-		// 画面を一旦クリアし，立方体を描画
-		SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-			4, 24, kCanvasSize, kCanvasSize, 0);
-		DrawObj(layer_id | LAYER_NO_REDRAW);
-		SyscallWinRedraw(layer_id);
+		// 画面を一旦クリアし，立方体を描画. 描画コマンドは1回のシステムコールで送る
+		const auto draw_start = TimePageNs();
+		DrawBatchFillRect(&batch, 4, 24, kCanvasSize, kCanvasSize, 0);
+		DrawObj(batch);
+		DrawBatchFlush(&batch);
+		draw_ns += TimePageNs() - draw_start;
+		++frames;
 		if (Sleep(50)) {
 			break;
 		}
 	}
 
+	printf("%d frames, draw %lu us/frame\n", frames, draw_ns / frames / 1000);
 	SyscallCloseWindow(layer_id);
 	exit(0);
 }
 
-void DrawObj(uint64_t layer_id) {
+void DrawObj(DrawBatch& batch) {
 	// オブジェクト座標 vert を スクリーン座標 scr に変換（画面奥が Z+）
 	for (int i = 0; i < kCube.size(); i++) {
 		const double t = 6 * kScale / (vert[i].z + 8 * kScale);
@@ -110,11 +121,11 @@ void DrawObj(uint64_t layer_id) {
 		const auto e0x = v1.x - v0.x, e0y = v1.y - v0.y, // v0 --> v1
 			e1x = v2.x - v1.x, e1y = v2.y - v1.y; // v1 --> v2
 
-		if (e0x * e1y <= e0y * e1x) { DrawSurface(layer_id, sur); }
+		if (e0x * e1y <= e0y * e1x) { DrawSurface(batch, sur); }
 	}
 }
 
-void DrawSurface(uint64_t layer_id, int sur) {
+void DrawSurface(DrawBatch& batch, int sur) {
 	const auto& surface = kSurface[sur]; // 描画する面
 	int ymin = kCanvasSize, ymax = 0; // 画面の描画範囲 [ymin, ymax]
 	int y2x_up[kCanvasSize], y2x_down[kCanvasSize]; // Y, X 座標の組
@@ -146,20 +157,17 @@ void DrawSurface(uint64_t layer_id, int sur) {
 	for (int y = ymin; y <= ymax; ++y) {
 		int p0x = min(y2x_up[y], y2x_down[y]);
 		int p1x = max(y2x_up[y], y2x_down[y]);
-		SyscallWinFillRectangle(layer_id, 4 + p0x, 24 + y, p1x - p0x + 1, 1, kColor[sur]);
+		DrawBatchFillRect(&batch, 4 + p0x, 24 + y, p1x - p0x + 1, 1, kColor[sur]);
 	}
 }
 
 bool Sleep(unsigned long ms) {
 	static unsigned long prev_timeout = 0;
 	if (prev_timeout == 0) {
-		const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
-		prev_timeout = timeout.value;
-	}
-	else {
-		prev_timeout += ms;
-		SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+		prev_timeout = TimePageNs() / 1000000;
 	}
+	prev_timeout += ms;
+	SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
 
 	AppEvent events[1];
 	for (;;) {
@@ -5,6 +5,7 @@
 #include <fcntl.h>
 #include <tuple>
 #include "../syscall.h"
+#include "../winsurface.h"
 
 #define STBI_NO_THREAD_LOCALS
 #define STB_IMAGE_IMPLEMENTATION
@@ -84,15 +85,21 @@ extern "C" void main(int argc, char** argv) {
 	}
 	const uint64_t layer_id = window.value;
 
+	WinSurface surface;
+	if (auto [addr, err] = SyscallWinMapSurface(layer_id, &surface); err) {
+		fprintf(stderr, "%s\n", strerror(err));
+		exit(1);
+	}
+
 	for (int y = 0; y < height; ++y) {
+		uint32_t* row = SurfaceRow(&surface, 24 + y) + 4;
 		for (int x = 0; x < width; ++x) {
 			uint32_t c = get_color(&image_data[bytes_per_pixel * (y * width + x)]);
-			SyscallWinFillRectangle(layer_id | LAYER_NO_REDRAW,
-				4 + x, 24 + y, 1, 1, c);
+			row[x] = SurfaceColor(&surface, c);
 		}
 	}
 
-	SyscallWinRedraw(layer_id);
+	SyscallWinCommit(layer_id, 4, 24, width, height);
 	WaitEvent();
 
 	SyscallCloseWindow(layer_id);
@@ -6,6 +6,8 @@
 #include <cstdlib>
 
 #include "../syscall.h"
+#include "../timepage.h"
+#include "../winsurface.h"
 
 struct RGBColor {
 	double r, g, b;
@@ -118,31 +120,75 @@ void WaitEvent() {
 }
 
 constexpr int kWidth = 78 * 4, kHeight = 52 * 4;
+constexpr int kMaxThreads = 8;
 
-extern "C" void main(int argc, char** argv) {
-	auto [layer_id, err_openwin]
-		= SyscallOpenWindow(kWidth + 8, kHeight + 28, 10, 10, "mandel");
-	if (err_openwin) {
-		exit(err_openwin);
-	}
+struct DrawArea {
+	const WinSurface* surface;
+	int first_row, row_step;
+};
 
+// first_row 行目から row_step 行おきに描く
+void DrawRows(const DrawArea& area) {
 	// xmin: 実部の最小値, ymin: 虚部の最小値
 	const double xmin = -2.3, ymin = -1.3;
 	const double xstep = 0.0125, ystep = 0.0125;
 
-	for (int y = 0; y < kHeight; ++y) {
+	for (int y = area.first_row; y < kHeight; y += area.row_step) {
 		for (int x = 0; x < kWidth; ++x) {
 			// 漸化式の計算が収束するまでの再帰回数 depth (100 を上限とする) を得る
 			int depth = MandelConverge({ xmin + xstep * x, ymin + ystep * y });
 
-			SyscallWinFillRectangle(
-				layer_id | LAYER_NO_REDRAW,
-				4 + x, 24 + y, 1, 1,
-				WaveLenToColor(depth * 4 + kWaveLenMin)
-			);
+			SurfaceWrite(area.surface, 4 + x, 24 + y,
+				WaveLenToColor(depth * 4 + kWaveLenMin));
 		}
 	}
-	SyscallWinRedraw(layer_id);
+}
+
+void DrawThread(int tid, void* arg) {
+	DrawRows(*reinterpret_cast<DrawArea*>(arg));
+	SyscallThreadExit(0);
+}
+
+extern "C" void main(int argc, char** argv) {
+	// mandel [スレッド数]
+	int num_threads = argc >= 2 ? atoi(argv[1]) : 1;
+	num_threads = std::clamp(num_threads, 1, kMaxThreads);
+
+	auto [layer_id, err_openwin]
+		= SyscallOpenWindow(kWidth + 8, kHeight + 28, 10, 10, "mandel");
+	if (err_openwin) {
+		exit(err_openwin);
+	}
+
+	// 画素領域に直接描き, 最後に WinCommit で画面に出す
+	WinSurface surface;
+	if (auto [addr, err] = SyscallWinMapSurface(layer_id, &surface); err) {
+		fprintf(stderr, "WinMapSurface failed: %s\n", strerror(err));
+		exit(err);
+	}
+
+	const auto start_ns = TimePageNs();
+
+	DrawArea areas[kMaxThreads];
+	uint64_t tids[kMaxThreads] = {};
+	for (int i = 1; i < num_threads; ++i) {
+		areas[i] = { &surface, i, num_threads };
+		auto [tid, err] = SyscallThreadCreate(DrawThread, &areas[i], 0);
+		if (err) {
+			fprintf(stderr, "ThreadCreate failed: %s\n", strerror(err));
+			exit(err);
+		}
+		tids[i] = tid;
+	}
+	areas[0] = { &surface, 0, num_threads };
+	DrawRows(areas[0]);
+	for (int i = 1; i < num_threads; ++i) {
+		SyscallThreadJoin(tids[i]);
+	}
+
+	const auto elapsed_ns = TimePageNs() - start_ns;
+	SyscallWinCommit(layer_id, 0, 0, 0, 0);
+	printf("%d thread(s): %lu ms\n", num_threads, elapsed_ns / 1000000);
 
 	WaitEvent();
 	SyscallCloseWindow(layer_id);
@@ -0,0 +1,93 @@
+#include "../syscall.h"
+#include "../syscall_ring.h"
+#include "../timepage.h"
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * 同じ操作を1回ずつシステムコールで呼ぶ場合と,
+ * システムコールリングに積んで RingEnter でまとめて呼ぶ場合を比べる.
+ */
+SyscallRing ring;
+
+const int kWinSize = 128;
+const int kRectSize = 4;
+
+// i 番目の SQE を prep(i) で積み, SQ が一杯になるたびに RingEnter する
+template <class F>
+int RunRing(int count, F prep) {
+    int errors = 0;
+    SyscallRingCQE cqe;
+    for(int i = 0; i < count;) {
+        while(i < count && prep(i)) { ++i; }
+        if(auto [n, err] = SyscallRingEnter(); err) {
+            printf("SyscallRingEnter failed: %d\n", err);
+            exit(1);
+        }
+        while(SyscallRingReap(&ring, &cqe)) {
+            if(cqe.error) { ++errors; }
+        }
+    }
+    return errors;
+}
+
+void Report(const char *name, int count, uint64_t direct_ns, uint64_t ring_ns) {
+    printf("%s x %d: direct %lu ns/op, ring %lu ns/op\n", name, count,
+           direct_ns / count, ring_ns / count);
+}
+
+extern "C" void main(int argc, char **argv) {
+    const int count = argc > 1 ? atoi(argv[1]) : 10000;
+    if(count <= 0) {
+        printf("Usage: ringbench [count]\n");
+        exit(1);
+    }
+
+    if(auto [ret, err] = SyscallRingSetup(&ring); err) {
+        printf("SyscallRingSetup failed: %d\n", err);
+        exit(1);
+    }
+
+    // 何もしないシステムコール
+    auto t0 = TimePageNs();
+    for(int i = 0; i < count; ++i) { SyscallGetCurrentTick(); }
+    auto t1 = TimePageNs();
+    RunRing(count, [](int i) {
+        return SyscallRingPrep(&ring, SYS_GET_CURRENT_TICK, 0, 0, 0, 0, 0, 0, i);
+    });
+    auto t2 = TimePageNs();
+    Report("GetCurrentTick", count, t1 - t0, t2 - t1);
+
+    // ウィンドウに小さな矩形を敷き詰める
+    auto [layer_id, err_openwin] =
+        SyscallOpenWindow(kWinSize + 8, kWinSize + 28, 10, 10, "ringbench");
+    if(err_openwin) {
+        printf("SyscallOpenWindow failed: %d\n", err_openwin);
+        exit(1);
+    }
+    const uint64_t layer = layer_id | LAYER_NO_REDRAW;
+    const int cols = kWinSize / kRectSize;
+    auto rect_x = [cols](int i) { return 4 + (i % cols) * kRectSize; };
+    auto rect_y = [cols](int i) {
+        return 24 + (i / cols) % cols * kRectSize;
+    };
+
+    t0 = TimePageNs();
+    for(int i = 0; i < count; ++i) {
+        SyscallWinFillRectangle(layer, rect_x(i), rect_y(i), kRectSize,
+                                kRectSize, i * 0x010203);
+    }
+    t1 = TimePageNs();
+    const int errors = RunRing(count, [&](int i) {
+        return SyscallRingPrep(&ring, SYS_WIN_FILL_RECTANGLE, layer, rect_x(i),
+                               rect_y(i), kRectSize, kRectSize, i * 0x030201,
+                               i);
+    });
+    t2 = TimePageNs();
+    SyscallWinRedraw(layer_id);
+    Report("WinFillRectangle", count, t1 - t0, t2 - t1);
+
+    SyscallCloseWindow(layer_id);
+    SyscallRingSetup(nullptr);
+    exit(errors ? 1 : 0);
+}
@@ -0,0 +1,15 @@
+/*
+ * 全アプリで共有するランタイム. newlib, libc++ と syscall.o などを
+ * RUNTIME_BASE に置いた1つの ELF にまとめる.
+ * アプリはこの ELF のシンボルを --just-symbols で固定アドレスに解決してリンクし,
+ * カーネルはアプリを起動するときにこのイメージも写像する.
+ * 書き込むページ(newlib の errno や malloc の状態)はアプリごとにコピーされる.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+/* 単独で実行されたときのエントリポイント */
+void RuntimeMain(void) {
+    printf("shared runtime for apps (newlib, libc++)\n");
+    exit(0);
+}
@@ -0,0 +1,18 @@
+/*
+ * 共有ランタイムの識別子を入れる ELF ノート(名前 "laplus", 種類 1).
+ * ランタイムと, それに対してリンクしたアプリの両方に同じ値で入れる.
+ * カーネルは両者の値が異なればアプリを起動しない.
+ * RUNTIME_ID は Makefile.elfapp が与える.
+ */
+#include <stdint.h>
+
+struct RuntimeIdNote {
+    uint32_t namesz, descsz, type;
+    char name[8];
+    uint32_t desc[2]; // 8 バイトの識別子(下位, 上位)
+};
+
+__attribute__((section(".note.laplus.runtime"), aligned(4), used))
+static const struct RuntimeIdNote runtime_id_note = {
+    7, 8, 1, "laplus",
+    {(uint32_t)(RUNTIME_ID & 0xffffffffu), (uint32_t)(RUNTIME_ID >> 32)}};
@@ -0,0 +1,31 @@
+/*
+ * shmprod と shmcons が共有メモリ SHMBENCH_NAME に置くリングバッファ.
+ * 先頭ページにヘッダ, その後ろに SHMBENCH_RING_BYTES のデータ領域が続く.
+ * 書き手は produced, 読み手は consumed だけを進める.
+ * 相手が *_waiting を立てて眠っているときだけ SyscallShmNotify で起こす.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define SHMBENCH_NAME "shmbench"
+#define SHMBENCH_RING_BYTES (1024 * 1024)
+#define SHMBENCH_BYTES (4096 + SHMBENCH_RING_BYTES)
+
+struct ShmBenchHeader {
+    uint64_t produced; // 書き込んだ累計バイト数
+    uint64_t consumed; // 読んだ累計バイト数
+    uint32_t consumer_ready;
+    uint32_t consumer_waiting;
+    uint32_t producer_waiting;
+    uint32_t done; // 書き手がすべて書き終えた
+};
+
+static inline uint64_t *ShmBenchRing(struct ShmBenchHeader *h) {
+    return (uint64_t *)((uint8_t *)h + 4096);
+}
+
+/* データ領域の pos バイト目の 8 バイトに書く値 */
+static inline uint64_t ShmBenchWord(uint64_t pos) {
+    return pos * 0x9e3779b97f4a7c15ull;
+}
@@ -0,0 +1,84 @@
+#include "../shmbench.h"
+#include "../syscall.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+
+/*
+ * shmprod が共有メモリのリングバッファに書いたデータを読み, 内容を検査する.
+ * shmprod より先にバックグラウンドで起動しておく(shmcons &).
+ */
+int fd;
+
+// 共有メモリのドアベルが鳴るまで待つ. 終了を求められたら false
+bool WaitNotify() {
+    AppEvent event;
+    while(true) {
+        auto [n, err] = SyscallReadEvent(&event, 1);
+        if(err) {
+            printf("ReadEvent failed: %s\n", strerror(err));
+            return false;
+        }
+        if(n == 0) { continue; }
+        if(event.type == AppEvent::kQuit) { return false; }
+        if(event.type == AppEvent::kShmNotify && event.arg.shm.fd == fd) {
+            return true;
+        }
+    }
+}
+
+extern "C" void main(int argc, char **argv) {
+    auto [shm_fd, err_open] = SyscallShmOpen(SHMBENCH_NAME, SHMBENCH_BYTES,
+                                             O_CREAT);
+    if(err_open) {
+        printf("ShmOpen failed: %s\n", strerror(err_open));
+        exit(1);
+    }
+    fd = shm_fd;
+    auto [addr, err_map] = SyscallShmMap(fd, nullptr);
+    if(err_map) {
+        printf("ShmMap failed: %s\n", strerror(err_map));
+        exit(1);
+    }
+    auto header = reinterpret_cast<ShmBenchHeader *>(addr);
+    auto ring = ShmBenchRing(header);
+    const uint64_t ring_words = SHMBENCH_RING_BYTES / 8;
+
+    __atomic_store_n(&header->consumer_ready, 1, __ATOMIC_SEQ_CST);
+    SyscallShmNotify(fd, 0);
+
+    uint64_t consumed = __atomic_load_n(&header->consumed, __ATOMIC_ACQUIRE);
+    uint64_t errors = 0, waits = 0;
+    while(true) {
+        auto produced = __atomic_load_n(&header->produced, __ATOMIC_ACQUIRE);
+        if(produced == consumed) {
+            if(__atomic_load_n(&header->done, __ATOMIC_ACQUIRE)) { break; }
+
+            // 眠ることを知らせてから確かめ直すので, ドアベルを取りこぼさない
+            __atomic_store_n(&header->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+            produced = __atomic_load_n(&header->produced, __ATOMIC_SEQ_CST);
+            if(produced == consumed &&
+               !__atomic_load_n(&header->done, __ATOMIC_SEQ_CST)) {
+                ++waits;
+                if(!WaitNotify()) { exit(1); }
+            }
+            __atomic_store_n(&header->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        for(uint64_t pos = consumed; pos < produced; pos += 8) {
+            if(ring[pos / 8 % ring_words] != ShmBenchWord(pos)) { ++errors; }
+        }
+        consumed = produced;
+        __atomic_store_n(&header->consumed, consumed, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&header->producer_waiting, __ATOMIC_SEQ_CST)) {
+            SyscallShmNotify(fd, consumed);
+        }
+    }
+
+    printf("shmcons: %lu bytes, %lu bad words, %lu waits\n", consumed, errors,
+           waits);
+    exit(errors ? 1 : 0);
+}
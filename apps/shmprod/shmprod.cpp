@@ -0,0 +1,117 @@
+#include "../shmbench.h"
+#include "../syscall.h"
+#include "../timepage.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+
+/*
+ * 共有メモリのリングバッファに書き込み, shmcons が読み終えるまでの転送速度を測る.
+ *   shmcons &
+ *   shmprod [MiB] [chunk KiB]
+ */
+int fd;
+
+// 共有メモリのドアベルが鳴るまで待つ. 終了を求められたら false
+bool WaitNotify() {
+    AppEvent event;
+    while(true) {
+        auto [n, err] = SyscallReadEvent(&event, 1);
+        if(err) {
+            printf("ReadEvent failed: %s\n", strerror(err));
+            return false;
+        }
+        if(n == 0) { continue; }
+        if(event.type == AppEvent::kQuit) { return false; }
+        if(event.type == AppEvent::kShmNotify && event.arg.shm.fd == fd) {
+            return true;
+        }
+    }
+}
+
+extern "C" void main(int argc, char **argv) {
+    const uint64_t mib = argc > 1 ? atoi(argv[1]) : 64;
+    const uint64_t chunk = (argc > 2 ? atoi(argv[2]) : 64) * 1024;
+    if(mib == 0 || chunk == 0 || chunk > SHMBENCH_RING_BYTES) {
+        printf("Usage: shmprod [MiB] [chunk KiB(<= %d)]\n",
+               SHMBENCH_RING_BYTES / 1024);
+        exit(1);
+    }
+
+    auto [shm_fd, err_open] = SyscallShmOpen(SHMBENCH_NAME, SHMBENCH_BYTES,
+                                             O_CREAT);
+    if(err_open) {
+        printf("ShmOpen failed: %s\n", strerror(err_open));
+        exit(1);
+    }
+    fd = shm_fd;
+    auto [addr, err_map] = SyscallShmMap(fd, nullptr);
+    if(err_map) {
+        printf("ShmMap failed: %s\n", strerror(err_map));
+        exit(1);
+    }
+    auto header = reinterpret_cast<ShmBenchHeader *>(addr);
+    auto ring = ShmBenchRing(header);
+    const uint64_t ring_words = SHMBENCH_RING_BYTES / 8;
+
+    if(!__atomic_load_n(&header->consumer_ready, __ATOMIC_ACQUIRE)) {
+        printf("waiting for shmcons...\n");
+        while(!__atomic_load_n(&header->consumer_ready, __ATOMIC_ACQUIRE)) {
+            if(!WaitNotify()) { exit(1); }
+        }
+    }
+
+    // 相手が眠っているときだけ起こし, 満杯のときだけ自分が眠る
+    uint64_t notifies = 0, waits = 0;
+    auto wait_until = [&](auto cond) {
+        while(!cond()) {
+            __atomic_store_n(&header->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            if(!cond()) {
+                ++waits;
+                if(!WaitNotify()) { exit(1); }
+            }
+            __atomic_store_n(&header->producer_waiting, 0, __ATOMIC_SEQ_CST);
+        }
+    };
+    auto kick_consumer = [&](uint64_t value) {
+        if(__atomic_load_n(&header->consumer_waiting, __ATOMIC_SEQ_CST)) {
+            SyscallShmNotify(fd, value);
+            ++notifies;
+        }
+    };
+
+    const uint64_t total = mib << 20;
+    uint64_t produced = 0;
+    const auto start = TimePageNs();
+    while(produced < total) {
+        const uint64_t len =
+            chunk < total - produced ? chunk : total - produced;
+        wait_until([&] {
+            const auto consumed =
+                __atomic_load_n(&header->consumed, __ATOMIC_ACQUIRE);
+            return produced + len - consumed <= SHMBENCH_RING_BYTES;
+        });
+
+        for(uint64_t pos = produced; pos < produced + len; pos += 8) {
+            ring[pos / 8 % ring_words] = ShmBenchWord(pos);
+        }
+        produced += len;
+        __atomic_store_n(&header->produced, produced, __ATOMIC_SEQ_CST);
+        kick_consumer(produced);
+    }
+
+    __atomic_store_n(&header->done, 1, __ATOMIC_SEQ_CST);
+    kick_consumer(produced);
+    wait_until([&] {
+        return __atomic_load_n(&header->consumed, __ATOMIC_ACQUIRE) == total;
+    });
+    const auto elapsed_us = (TimePageNs() - start) / 1000 + 1;
+
+    printf("%lu MiB in %lu us: %lu MB/s\n", mib, elapsed_us,
+           total / elapsed_us);
+    printf("chunk %lu KiB, %lu notifies, %lu waits\n", chunk / 1024,
+           notifies, waits);
+    exit(0);
+}
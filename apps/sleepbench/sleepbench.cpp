@@ -0,0 +1,97 @@
+#include "../syscall.h"
+#include "../timepage.h"
+#include <cstdio>
+#include <cstdlib>
+
+/*
+ * 周期的に眠って起きたときの遅れ(ジッタ)を測る.
+ * SyscallSleepUntil で眠る方法と, 従来の SyscallCreateTimer + SyscallReadEvent
+ * で待つ方法を比べる. 後者はミリ秒単位でしか期限を指定できない.
+ */
+uint64_t Now() { return TimePageNs(); }
+
+const uint64_t kBucketLimits[] = {10'000, 50'000, 100'000, 500'000, 1'000'000};
+const int kNumBuckets = sizeof(kBucketLimits) / sizeof(kBucketLimits[0]) + 1;
+
+struct Stat {
+    uint64_t min = ~0ul, max = 0, total = 0;
+    int count = 0;
+    int buckets[kNumBuckets] = {};
+
+    void Add(uint64_t late) {
+        if(late < min) { min = late; }
+        if(late > max) { max = late; }
+        total += late;
+        ++count;
+
+        int i = 0;
+        while(i < kNumBuckets - 1 && late >= kBucketLimits[i]) { ++i; }
+        ++buckets[i];
+    }
+
+    void Print(const char *name) const {
+        printf("%s: min %lu us, avg %lu us, max %lu us\n", name, min / 1000,
+               total / count / 1000, max / 1000);
+        for(int i = 0; i < kNumBuckets; ++i) {
+            if(i < kNumBuckets - 1) {
+                printf("  < %4lu us: %d\n", kBucketLimits[i] / 1000, buckets[i]);
+            } else {
+                printf("  >=%4lu us: %d\n", kBucketLimits[i - 1] / 1000,
+                       buckets[i]);
+            }
+        }
+    }
+};
+
+void BenchSleepUntil(uint64_t period_ns, int count, Stat &stat) {
+    uint64_t deadline = Now();
+    for(int i = 0; i < count; ++i) {
+        deadline += period_ns;
+        if(auto [ret, err] = SyscallSleepUntil(deadline); err) {
+            printf("SyscallSleepUntil failed: %d\n", err);
+            exit(1);
+        }
+        stat.Add(Now() - deadline);
+    }
+}
+
+bool BenchTimerEvent(uint64_t period_ns, int count, Stat &stat) {
+    const uint64_t period_ms = period_ns < 1'000'000 ? 1 : period_ns / 1'000'000;
+    uint64_t deadline_ms = Now() / 1'000'000 + 1;
+    for(int i = 0; i < count; ++i) {
+        deadline_ms += period_ms;
+        if(auto [ret, err] = SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, deadline_ms);
+           err) {
+            printf("SyscallCreateTimer failed: %d\n", err);
+            exit(1);
+        }
+
+        AppEvent event;
+        while(true) {
+            SyscallReadEvent(&event, 1);
+            if(event.type == AppEvent::kTimerTimeout) { break; }
+            if(event.type == AppEvent::kQuit) { return false; }
+        }
+        stat.Add(Now() - deadline_ms * 1'000'000);
+    }
+    return true;
+}
+
+extern "C" void main(int argc, char **argv) {
+    const int period_us = argc > 1 ? atoi(argv[1]) : 1000;
+    const int count = argc > 2 ? atoi(argv[2]) : 1000;
+    if(period_us <= 0 || count <= 0) {
+        printf("Usage: sleepbench [period_us] [count]\n");
+        exit(1);
+    }
+    const uint64_t period_ns = period_us * 1000ul;
+
+    Stat sleep_stat;
+    BenchSleepUntil(period_ns, count, sleep_stat);
+    sleep_stat.Print("SleepUntil");
+
+    Stat timer_stat;
+    if(!BenchTimerEvent(period_ns, count, timer_stat)) { exit(1); }
+    timer_stat.Print("CreateTimer+ReadEvent");
+    exit(0);
+}
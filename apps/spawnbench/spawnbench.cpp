@@ -0,0 +1,73 @@
+#include "../syscall.h"
+#include "../timepage.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*
+ * Spawn から Wait が返るまでの時間を測る.
+ * 子には自分自身を "child" 引数付きで起動し, 何もせずに終わらせる.
+ * 1つずつ起動して待つ場合と, parallel 個まとめて起動してから待つ場合を比べる.
+ */
+uint64_t Now() { return TimePageNs(); }
+
+const char *kSelf = "spawnbench";
+const char *const kChildArgv[] = {"spawnbench", "child", nullptr};
+const int kMaxParallel = 32;
+
+uint64_t Spawn() {
+    auto [pid, err] = SyscallSpawn(kSelf, kChildArgv, nullptr);
+    if(err) {
+        printf("SyscallSpawn failed: %d\n", err);
+        exit(1);
+    }
+    return pid;
+}
+
+void Wait(uint64_t pid) {
+    if(auto [ec, err] = SyscallWait(pid); err || ec != 0) {
+        printf("SyscallWait failed: err %d, exit code %lu\n", err, ec);
+        exit(1);
+    }
+}
+
+extern "C" void main(int argc, char **argv) {
+    if(argc >= 2 && strcmp(argv[1], "child") == 0) { exit(0); }
+
+    const int count = argc >= 2 ? atoi(argv[1]) : 100;
+    int parallel = argc >= 3 ? atoi(argv[2]) : 8;
+    if(count <= 0 || parallel <= 0) {
+        printf("usage: spawnbench [count] [parallel]\n");
+        exit(1);
+    }
+    if(parallel > kMaxParallel) { parallel = kMaxParallel; }
+
+    // 1回目は ELF の読み込みとページテーブルの作成を含むので測定から外す
+    Wait(Spawn());
+
+    uint64_t min = ~0ul, max = 0, total = 0;
+    for(int i = 0; i < count; ++i) {
+        const uint64_t start = Now();
+        Wait(Spawn());
+        const uint64_t elapsed = Now() - start;
+        if(elapsed < min) { min = elapsed; }
+        if(elapsed > max) { max = elapsed; }
+        total += elapsed;
+    }
+    printf("serial: %d spawns, min %lu us, avg %lu us, max %lu us\n", count,
+           min / 1000, total / count / 1000, max / 1000);
+
+    uint64_t pids[kMaxParallel];
+    int done = 0;
+    const uint64_t start = Now();
+    while(done < count) {
+        const int n = count - done < parallel ? count - done : parallel;
+        for(int i = 0; i < n; ++i) { pids[i] = Spawn(); }
+        for(int i = 0; i < n; ++i) { Wait(pids[i]); }
+        done += n;
+    }
+    const uint64_t elapsed = Now() - start;
+    printf("parallel %d: %d spawns in %lu us, %lu us/spawn\n", parallel, count,
+           elapsed / 1000, elapsed / count / 1000);
+    exit(0);
+}
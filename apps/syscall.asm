@@ -37,3 +37,23 @@ define_syscall SocketAccept,     0x80000017
 define_syscall SocketConnect,    0x80000018
 define_syscall SocketRecv,       0x80000019
 define_syscall SocketSend,       0x8000001a
+define_syscall CancelTimer,      0x8000001b
+define_syscall GetTimeNs,        0x8000001c
+define_syscall FutexWait,        0x8000001d
+define_syscall FutexWake,        0x8000001e
+define_syscall ThreadCreate,     0x8000001f
+define_syscall ThreadExit,       0x80000020
+define_syscall ThreadJoin,       0x80000021
+define_syscall Sleep,            0x80000022
+define_syscall SleepUntil,       0x80000023
+define_syscall RingSetup,        0x80000024
+define_syscall RingEnter,        0x80000025
+define_syscall WinMapSurface,    0x80000026
+define_syscall WinCommit,        0x80000027
+define_syscall WinDrawBatch,     0x80000028
+define_syscall ShmOpen,          0x80000029
+define_syscall ShmMap,           0x8000002a
+define_syscall ShmUnmap,         0x8000002b
+define_syscall ShmNotify,        0x8000002c
+define_syscall Spawn,            0x8000002d
+define_syscall Wait,             0x8000002e
@@ -9,7 +9,10 @@ extern "C" {
 #endif
 
 #include "../kernel/app_event.hpp"
+#include "../kernel/draw_batch.hpp"
 #include "../kernel/logger.hpp"
+#include "../kernel/syscall_ring.hpp"
+#include "../kernel/window_surface.hpp"
 
 struct SyscallResult {
     uint64_t value;
@@ -39,6 +42,7 @@ struct SyscallResult SyscallReadEvent(struct AppEvent *events, size_t len);
 
 #define TIMER_ONESHOT_REL 1
 #define TIMER_ONESHOT_ABS 0
+/* 成功すると value にタイマーID(SyscallCancelTimer で取り消せる)が返る */
 struct SyscallResult SyscallCreateTimer(unsigned int type, int timer_value,
                                         unsigned long timeout_ms);
 
@@ -62,6 +66,171 @@ struct SyscallResult SyscallSocketConnect(int soc, struct sockaddr *addr,
                                           int addrlen);
 struct SyscallResult SyscallSocketRecv(int soc, char *buf, int n);
 struct SyscallResult SyscallSocketSend(int soc, char *buf, int n);
+struct SyscallResult SyscallCancelTimer(uint64_t timer_id);
+/* 起動からの経過時間(ナノ秒) */
+struct SyscallResult SyscallGetTimeNs();
+/* *addr が val のままなら SyscallFutexWake されるまで眠る. 値が異なれば EAGAIN */
+struct SyscallResult SyscallFutexWait(const volatile uint32_t *addr,
+                                      uint32_t val);
+/* addr で眠っているタスクを最大 n 個起こす. value に起こした数が返る */
+struct SyscallResult SyscallFutexWake(const volatile uint32_t *addr, int n);
+/*
+ * アプリと同じアドレス空間で f(tid, arg) を実行するスレッドを作る. value にスレッドIDが返る.
+ * stack_bytes が 0 なら 64KiB のスタックを使う.
+ * f から戻ってはならず, 最後に SyscallThreadExit を呼ぶ(スレッドでの SyscallExit も同じ).
+ */
+struct SyscallResult SyscallThreadCreate(void (*f)(int tid, void *arg),
+                                         void *arg, size_t stack_bytes);
+struct SyscallResult SyscallThreadExit(int exit_code);
+/* スレッドの終了を待つ. value に終了コードが返る */
+struct SyscallResult SyscallThreadJoin(uint64_t tid);
+/* ns ナノ秒のあいだ眠る. イベントが届いても期限までは戻らない */
+struct SyscallResult SyscallSleep(uint64_t ns);
+/* 起動からの経過時間(SyscallGetTimeNs)が abs_ns になるまで眠る */
+struct SyscallResult SyscallSleepUntil(uint64_t abs_ns);
+/* ring をこのスレッドのシステムコールリングとして登録する. NULL で解除 */
+struct SyscallResult SyscallRingSetup(struct SyscallRing *ring);
+/* リングに積んだ SQE を順に実行し, 結果を CQ に書く. value に処理した数が返る */
+struct SyscallResult SyscallRingEnter();
+/* ウィンドウの画素領域を写像し, *surface に情報を書く. value は先頭アドレス */
+struct SyscallResult SyscallWinMapSurface(uint64_t layer_id,
+                                          struct WinSurface *surface);
+/* 画素領域の (x, y, w, h) を画面に反映する. w か h が 0 以下ならウィンドウ全体 */
+struct SyscallResult SyscallWinCommit(uint64_t layer_id, int x, int y, int w,
+                                      int h);
+/*
+ * buf に並べた描画コマンド(kernel/draw_batch.hpp)を実行し, 描いた範囲を
+ * まとめて1回だけ画面に反映する. value に実行したコマンド数が返る.
+ */
+struct SyscallResult SyscallWinDrawBatch(uint64_t layer_id_flags,
+                                         const void *buf, size_t len);
+/*
+ * 名前付き共有メモリを開き, value にファイルディスクリプタが返る.
+ * flags に O_CREAT があり, 無ければ size バイトで作る. O_EXCL なら既にあると EEXIST.
+ * 名前は開いているアプリがいる間だけ残る.
+ */
+struct SyscallResult SyscallShmOpen(const char *name, size_t size, int flags);
+/* 共有メモリを写像し, value に先頭アドレス, *size(NULL 可)に大きさが返る */
+struct SyscallResult SyscallShmMap(int fd, size_t *size);
+struct SyscallResult SyscallShmUnmap(int fd);
+/*
+ * 同じ共有メモリを開いている他のアプリに AppEvent::kShmNotify を送る.
+ * value に送った数が返る.
+ */
+struct SyscallResult SyscallShmNotify(int fd, uint64_t value);
+/*
+ * path のアプリを新しいタスクとして起動し, value にその ID が返る.
+ * argv は NULL 終端(NULL なら path だけ), fds は子の 0, 1, 2 にする自分の
+ * ファイルディスクリプタ(NULL なら 0, 1, 2).
+ */
+struct SyscallResult SyscallSpawn(const char *path, const char *const *argv,
+                                  const int *fds);
+/* Spawn した子の終了を待ち, value に終了コードが返る. 子でなければ ECHILD */
+struct SyscallResult SyscallWait(uint64_t pid);
+
+/*
+ * 描画コマンドのエンコーダ. バッファが一杯になると LAYER_NO_REDRAW を付けて
+ * 自動で送り, DrawBatchFlush で残りを送って画面に反映する.
+ */
+struct DrawBatch {
+    uint64_t layer_id_flags;
+    uint8_t *buf;
+    size_t cap, len;
+};
+
+static inline void DrawBatchInit(struct DrawBatch *b, uint64_t layer_id_flags,
+                                 void *buf, size_t cap) {
+    b->layer_id_flags = layer_id_flags;
+    b->buf = (uint8_t *)buf;
+    b->cap = cap;
+    b->len = 0;
+}
+
+static inline struct SyscallResult DrawBatchFlush(struct DrawBatch *b) {
+    struct SyscallResult res =
+        SyscallWinDrawBatch(b->layer_id_flags, b->buf, b->len);
+    b->len = 0;
+    return res;
+}
+
+/* size バイトのコマンドを置く場所を返す. cap より大きければ NULL */
+static inline void *DrawBatchAlloc(struct DrawBatch *b, enum DrawCommandType type,
+                                   size_t size) {
+    size = (size + 3) & ~(size_t)3;
+    if(size > b->cap || size > 0xffff) { return NULL; }
+    if(b->len + size > b->cap) {
+        SyscallWinDrawBatch(b->layer_id_flags | LAYER_NO_REDRAW, b->buf, b->len);
+        b->len = 0;
+    }
+    struct DrawCommandHeader *header =
+        (struct DrawCommandHeader *)(b->buf + b->len);
+    header->type = type;
+    header->size = size;
+    b->len += size;
+    return header;
+}
+
+static inline void DrawBatchFillRect(struct DrawBatch *b, int x, int y, int w,
+                                     int h, uint32_t color) {
+    struct DrawFillRect *c = (struct DrawFillRect *)DrawBatchAlloc(
+        b, kDrawFillRect, sizeof(struct DrawFillRect));
+    if(c == NULL) { return; }
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    c->color = color;
+}
+
+static inline void DrawBatchLine(struct DrawBatch *b, int x0, int y0, int x1,
+                                 int y1, uint32_t color) {
+    struct DrawLine *c =
+        (struct DrawLine *)DrawBatchAlloc(b, kDrawLine, sizeof(struct DrawLine));
+    if(c == NULL) { return; }
+    c->x0 = x0;
+    c->y0 = y0;
+    c->x1 = x1;
+    c->y1 = y1;
+    c->color = color;
+}
+
+static inline void DrawBatchText(struct DrawBatch *b, int x, int y,
+                                 uint32_t color, const char *s, size_t len) {
+    struct DrawText *c = (struct DrawText *)DrawBatchAlloc(
+        b, kDrawText, sizeof(struct DrawText) + len);
+    if(c == NULL) { return; }
+    c->x = x;
+    c->y = y;
+    c->color = color;
+    c->len = len;
+    for(size_t i = 0; i < len; ++i) { c->text[i] = s[i]; }
+}
+
+/* pixels は DrawBatchFlush するまで書き換えないこと */
+static inline void DrawBatchBlit(struct DrawBatch *b, int x, int y, int w,
+                                 int h, const uint32_t *pixels) {
+    struct DrawBlit *c =
+        (struct DrawBlit *)DrawBatchAlloc(b, kDrawBlit, sizeof(struct DrawBlit));
+    if(c == NULL) { return; }
+    c->x = x;
+    c->y = y;
+    c->w = w;
+    c->h = h;
+    c->pixels = pixels;
+}
+
+static inline void DrawBatchCopyRect(struct DrawBatch *b, int x, int y, int sx,
+                                     int sy, int w, int h) {
+    struct DrawCopyRect *c = (struct DrawCopyRect *)DrawBatchAlloc(
+        b, kDrawCopyRect, sizeof(struct DrawCopyRect));
+    if(c == NULL) { return; }
+    c->x = x;
+    c->y = y;
+    c->sx = sx;
+    c->sy = sy;
+    c->w = w;
+    c->h = h;
+}
 
 #ifdef __cplusplus
 } // extern "C"
@@ -0,0 +1,65 @@
+/*
+ * システムコールリング(kernel/syscall_ring.hpp)に SQE を積み, CQE を取り出す.
+ */
+#pragma once
+
+#include "../kernel/syscall_ring.hpp"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* リングから呼べる主なシステムコールの番号 */
+#define SYS_PUT_STRING         0x01
+#define SYS_WIN_WRITE_STRING   0x04
+#define SYS_WIN_FILL_RECTANGLE 0x05
+#define SYS_GET_CURRENT_TICK   0x06
+#define SYS_WIN_REDRAW         0x07
+#define SYS_WIN_DRAW_LINE      0x08
+#define SYS_CREATE_TIMER       0x0b
+#define SYS_READ_FILE          0x0d
+#define SYS_SOCKET_RECV_FROM   0x13
+#define SYS_SOCKET_SEND_TO     0x14
+#define SYS_SOCKET_RECV        0x19
+#define SYS_SOCKET_SEND        0x1a
+#define SYS_CANCEL_TIMER       0x1b
+#define SYS_WIN_COMMIT         0x27
+#define SYS_SHM_NOTIFY         0x2c
+
+/* SQ が一杯なら 0 を返す */
+static inline int SyscallRingPrep(struct SyscallRing *ring, uint64_t op,
+                                  uint64_t a1, uint64_t a2, uint64_t a3,
+                                  uint64_t a4, uint64_t a5, uint64_t a6,
+                                  uint64_t user_data) {
+    const uint32_t tail = ring->sq_tail;
+    if(tail - ring->sq_head >= SYSCALL_RING_ENTRIES) { return 0; }
+
+    struct SyscallRingSQE *sqe = &ring->sq[tail % SYSCALL_RING_ENTRIES];
+    sqe->op = op;
+    sqe->args[0] = a1;
+    sqe->args[1] = a2;
+    sqe->args[2] = a3;
+    sqe->args[3] = a4;
+    sqe->args[4] = a5;
+    sqe->args[5] = a6;
+    sqe->user_data = user_data;
+    __asm__ volatile("" ::: "memory");
+    ring->sq_tail = tail + 1;
+    return 1;
+}
+
+/* 取り出せる CQE がなければ 0 を返す */
+static inline int SyscallRingReap(struct SyscallRing *ring,
+                                  struct SyscallRingCQE *cqe) {
+    const uint32_t head = ring->cq_head;
+    if(head == ring->cq_tail) { return 0; }
+
+    *cqe = ring->cq[head % SYSCALL_RING_ENTRIES];
+    __asm__ volatile("" ::: "memory");
+    ring->cq_head = head + 1;
+    return 1;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
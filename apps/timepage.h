@@ -0,0 +1,76 @@
+/*
+ * カーネルが写像した時刻ページ(kernel/time_page.hpp)をシステムコールなしで読む.
+ * 値は seqlock で一貫したものを読む.
+ */
+#pragma once
+
+#include "../kernel/time_page.hpp"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+static inline const struct TimePage *GetTimePage(void) {
+    return (const struct TimePage *)TIME_PAGE_ADDR;
+}
+
+static inline uint32_t TimePageReadBegin(const struct TimePage *p) {
+    uint32_t seq;
+    while((seq = p->seq) & 1) { __asm__ volatile("pause"); }
+    __asm__ volatile("" ::: "memory");
+    return seq;
+}
+
+static inline int TimePageReadRetry(const struct TimePage *p, uint32_t seq) {
+    __asm__ volatile("" ::: "memory");
+    return p->seq != seq;
+}
+
+static inline uint64_t TimePageRdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* SyscallGetCurrentTick と同じ値. *freq にはティックの周波数(Hz)が入る */
+static inline uint64_t TimePageTick(uint64_t *freq) {
+    const struct TimePage *p = GetTimePage();
+    uint32_t seq;
+    uint64_t tick;
+    do {
+        seq = TimePageReadBegin(p);
+        tick = p->tick;
+        if(freq) { *freq = p->tick_freq; }
+    } while(TimePageReadRetry(p, seq));
+    return tick;
+}
+
+/* SyscallGetTimeNs と同じ, 起動からの経過時間(ナノ秒) */
+static inline uint64_t TimePageNs(void) {
+    const struct TimePage *p = GetTimePage();
+    uint32_t seq;
+    uint64_t base, mult, tsc;
+    do {
+        seq = TimePageReadBegin(p);
+        base = p->tsc_base;
+        mult = p->tsc_to_ns_mult;
+        tsc = TimePageRdtsc();
+    } while(TimePageReadRetry(p, seq));
+    return (uint64_t)(((unsigned __int128)(tsc - base) * mult) >> 32);
+}
+
+/* UNIX 時刻(ナノ秒) */
+static inline int64_t TimePageWallNs(void) {
+    const struct TimePage *p = GetTimePage();
+    uint32_t seq;
+    int64_t offset;
+    do {
+        seq = TimePageReadBegin(p);
+        offset = p->wall_offset_ns;
+    } while(TimePageReadRetry(p, seq));
+    return (int64_t)TimePageNs() + offset;
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
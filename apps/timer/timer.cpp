@@ -11,7 +11,7 @@ extern "C" void main(int argc, char **argv) {
 
     const unsigned long duration_ms = atoi(argv[1]);
     const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, duration_ms);
-    printf("timer created. timeout = %lu\n", timeout.value);
+    printf("timer created. id = %lu\n", timeout.value);
 
     AppEvent events[1];
     while(true) {
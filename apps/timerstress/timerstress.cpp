@@ -0,0 +1,68 @@
+#include "../syscall.h"
+#include "../timepage.h"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/*
+ * 大量のタイマーを登録・取り消しして, カーネルのタイマーホイールに負荷をかける.
+ * 奇数番目のタイマーを取り消し, 残りが満了順に1回ずつ届くことを確かめる.
+ */
+unsigned long CurrentMs() { return TimePageNs() / 1000000; }
+
+extern "C" void main(int argc, char **argv) {
+    const int num_timers = argc > 1 ? atoi(argv[1]) : 4000;
+    if(num_timers <= 0 || num_timers > 8000) {
+        printf("Usage: timerstress [1-8000]\n");
+        exit(1);
+    }
+
+    std::vector<uint64_t> ids(num_timers);
+    srand(num_timers);
+
+    const auto t0 = CurrentMs();
+    for(int i = 0; i < num_timers; ++i) {
+        // 10 ms(1 ティック)の倍数にしてタイマーホイールに載せる
+        const unsigned long timeout_ms = 100 + rand() % 300 * 10;
+        const auto timer = SyscallCreateTimer(TIMER_ONESHOT_REL, i + 1, timeout_ms);
+        if(timer.error) {
+            printf("failed to create timer %d: %d\n", i, timer.error);
+            exit(1);
+        }
+        ids[i] = timer.value;
+    }
+    const auto t1 = CurrentMs();
+
+    int cancelled = 0;
+    for(int i = 1; i < num_timers; i += 2) {
+        if(SyscallCancelTimer(ids[i]).error == 0) { ++cancelled; }
+    }
+    const auto t2 = CurrentMs();
+
+    const int expected = num_timers - cancelled;
+    int fired = 0, unexpected = 0, out_of_order = 0;
+    unsigned long last_timeout = 0;
+    AppEvent events[64];
+    while(fired < expected) {
+        const auto n = SyscallReadEvent(events, 64);
+        for(size_t i = 0; i < n.value; ++i) {
+            if(events[i].type == AppEvent::kQuit) {
+                exit(1);
+            } else if(events[i].type != AppEvent::kTimerTimeout) {
+                continue;
+            }
+
+            if(events[i].arg.timer.value % 2 == 0) { ++unexpected; }
+            if(events[i].arg.timer.timeout < last_timeout) { ++out_of_order; }
+            last_timeout = events[i].arg.timer.timeout;
+            ++fired;
+        }
+    }
+    const auto t3 = CurrentMs();
+
+    printf("create %d timers: %lu ms\n", num_timers, t1 - t0);
+    printf("cancel %d timers: %lu ms\n", cancelled, t2 - t1);
+    printf("%d timers fired in %lu ms (unexpected %d, out of order %d)\n",
+           fired, t3 - t2, unexpected, out_of_order);
+    exit(unexpected || out_of_order ? 1 : 0);
+}
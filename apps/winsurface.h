@@ -0,0 +1,29 @@
+/*
+ * SyscallWinMapSurface で写像したウィンドウの画素領域に直接描く.
+ */
+#pragma once
+
+#include "../kernel/window_surface.hpp"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* 0xRRGGBB を画素領域の形式に変換する */
+static inline uint32_t SurfaceColor(const struct WinSurface *s, uint32_t rgb) {
+    if(s->pixel_format == kPixelBGRResv8BitPerColor) { return rgb; }
+    return ((rgb & 0xff) << 16) | (rgb & 0xff00) | ((rgb >> 16) & 0xff);
+}
+
+static inline uint32_t *SurfaceRow(const struct WinSurface *s, int y) {
+    return (uint32_t *)(s->pixels + (size_t)s->bytes_per_scan_line * y);
+}
+
+static inline void SurfaceWrite(const struct WinSurface *s, int x, int y,
+                                uint32_t rgb) {
+    SurfaceRow(s, y)[x] = SurfaceColor(s, rgb);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
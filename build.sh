@@ -2,6 +2,14 @@
 
 make ${MAKE_OPTS:-} -C kernel kernel.elf
 
+# 共有ランタイムはアプリが参照するシンボルを集めて作るので, 先にアプリのオブジェクトを作る
+for MK in $(ls apps/*/Makefile)
+do
+  APP_DIR=$(dirname $MK)
+  make ${MAKE_OPTS:-} -C $APP_DIR objs
+done
+make ${MAKE_OPTS:-} -C apps/runtime runtime
+
 for MK in $(ls apps/*/Makefile)
 do
   APP_DIR=$(dirname $MK)
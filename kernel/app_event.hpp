@@ -10,6 +10,7 @@ extern "C" {
 			kMouseButton,
 			kTimerTimeout,
 			kKeyPush,
+			kShmNotify,
 		} type;
 
 		union {
@@ -26,7 +27,7 @@ extern "C" {
 			} mouse_button;
 
 			struct {
-				unsigned long timeout;
+				unsigned long timeout; // 満了時刻(起動からのミリ秒)
 				int value;
 			} timer;
 
@@ -36,6 +37,11 @@ extern "C" {
 				char ascii;
 				int press; // 1: press, 0: release
 			} keypush;
+
+			struct {
+				int fd; // SyscallShmOpen で得たファイルディスクリプタ
+				uint64_t value; // SyscallShmNotify に渡された値
+			} shm;
 		} arg;
 	};
 
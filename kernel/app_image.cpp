@@ -0,0 +1,281 @@
+#include "app_image.hpp"
+
+#include "bootconfig.hpp"
+#include "elf.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "terminal.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+AppImageCache *app_images;
+
+namespace {
+/**
+ * PT_LOAD セグメントをデマンドページングの対象として segments に登録する.
+ * 内容は最初に触れたときにファイルから読む. 最後のアドレスを返す.
+ */
+WithError<uint64_t> MapLoadSegments(const std::vector<Elf64_Phdr> &phdrs,
+                                    fat::DirectoryEntry &file_entry,
+                                    PageMapEntry *page_cache,
+                                    std::vector<ElfMapping> &segments) {
+    uint64_t last_addr = 0;
+    for(const auto &phdr : phdrs) {
+        if(phdr.p_type != PT_LOAD) { continue; }
+        if(phdr.p_vaddr < 0xffff'8000'0000'0000 ||
+           phdr.p_filesz > phdr.p_memsz ||
+           phdr.p_offset + phdr.p_filesz > file_entry.file_size) {
+            return {0, MAKE_ERROR(Error::kInvalidFormat)};
+        }
+
+        last_addr = std::max(last_addr, phdr.p_vaddr + phdr.p_memsz);
+        segments.push_back(ElfMapping{&file_entry, page_cache, phdr.p_vaddr,
+                                      phdr.p_vaddr + phdr.p_memsz,
+                                      phdr.p_vaddr + phdr.p_filesz,
+                                      phdr.p_offset});
+    }
+    return {last_addr, MAKE_ERROR(Error::kSuccess)};
+}
+
+/**
+ * PT_NOTE セグメントから共有ランタイムの識別子(名前 "laplus", 種類 1)を探す.
+ * apps/runtime/runtime_id.c がランタイムとアプリの両方に入れる. 無ければ 0.
+ */
+uint64_t ReadRuntimeID(const std::vector<Elf64_Phdr> &phdrs,
+                       fat::FileDescriptor &fd) {
+    struct Note {
+        uint32_t namesz, descsz, type;
+        char name[8];
+        uint64_t id;
+    } __attribute__((packed));
+
+    for(const auto &phdr : phdrs) {
+        if(phdr.p_type != PT_NOTE) { continue; }
+        for(uint64_t off = 0; off + sizeof(Note) <= phdr.p_filesz;) {
+            Note note;
+            if(fd.Load(&note, sizeof(note), phdr.p_offset + off) !=
+               sizeof(note)) {
+                break;
+            }
+            if(note.namesz == 7 && note.descsz == 8 && note.type == 1 &&
+               memcmp(note.name, "laplus", 7) == 0) {
+                return note.id;
+            }
+            off += 12 + ((note.namesz + 3) & ~3u) + ((note.descsz + 3) & ~3u);
+        }
+    }
+    return 0;
+}
+
+/** 空きフレームが全体の 1/16 を切ったら, 使われていないイメージをすべて追い出す */
+bool LowOnMemory() {
+    const auto stat = memory_manager->Stat();
+    const size_t free_frames = stat.total_frames - stat.allocated_frames;
+    return free_frames * 16 < stat.total_frames;
+}
+} // namespace
+
+AppImage::AppImage(fat::DirectoryEntry &file_entry, PageMapEntry *page_cache)
+    : file_entry_{file_entry}, loaded_entry_{file_entry},
+      loaded_generation_{fat::WriteGeneration(file_entry)},
+      page_cache_{page_cache} {}
+
+AppImage::~AppImage() {
+    if(auto err = FreePageCache(page_cache_)) {
+        Log(kError, "failed to free app image: %s\n", err.Name());
+    }
+}
+
+Error AppImage::Load() {
+    fat::FileDescriptor fd{file_entry_};
+    Elf64_Ehdr ehdr;
+    if(fd.Load(&ehdr, sizeof(ehdr), 0) != sizeof(ehdr) ||
+       memcmp(ehdr.e_ident,
+              "\x7f"
+              "ELF",
+              4) != 0) {
+        return MAKE_ERROR(Error::kInvalidFile);
+    }
+    if(ehdr.e_type != ET_EXEC || ehdr.e_phentsize != sizeof(Elf64_Phdr)) {
+        return MAKE_ERROR(Error::kInvalidFormat);
+    }
+
+    std::vector<Elf64_Phdr> phdrs(ehdr.e_phnum);
+    const size_t phdrs_bytes = sizeof(Elf64_Phdr) * phdrs.size();
+    if(fd.Load(phdrs.data(), phdrs_bytes, ehdr.e_phoff) != phdrs_bytes) {
+        return MAKE_ERROR(Error::kInvalidFormat);
+    }
+
+    entry_ = ehdr.e_entry;
+    runtime_id_ = ReadRuntimeID(phdrs, fd);
+    auto [last_addr, err] =
+        MapLoadSegments(phdrs, file_entry_, page_cache_, segments_);
+    vaddr_end_ = last_addr;
+    return err;
+}
+
+Error AppImage::Prefault() {
+    for(const auto &m : segments_) {
+        for(uint64_t page = m.vaddr_begin & 0xffff'ffff'ffff'f000;
+            page < m.file_vaddr_end; page += 4096) {
+            // 実行中のアプリのページフォルトと同じページを読み込まないようにする
+            const auto rflags = DisableInterrupts();
+            auto [frame, err] = CacheElfPage(segments_, page);
+            RestoreInterrupts(rflags);
+            if(err) { return err; }
+        }
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+uint64_t AppImage::VAddrBegin() const {
+    uint64_t begin = vaddr_end_;
+    for(const auto &m : segments_) { begin = std::min(begin, m.vaddr_begin); }
+    return begin;
+}
+
+bool AppImage::IsValid() const {
+    // 書き込み時刻は 2 秒単位なので, 見分けには書き込みの回数を使う
+    const auto &e = file_entry_;
+    return fat::WriteGeneration(e) == loaded_generation_ &&
+           e.file_size == loaded_entry_.file_size &&
+           e.FirstCluster() == loaded_entry_.FirstCluster();
+}
+
+AppImageCache::AppImageCache(size_t max_frames) : max_frames_{max_frames} {}
+
+WithError<std::shared_ptr<AppImage>>
+AppImageCache::Get(fat::DirectoryEntry &file_entry) {
+    mutex_.Lock();
+    auto it = std::find_if(lru_.begin(), lru_.end(), [&](const auto &image) {
+        return &image->FileEntry() == &file_entry;
+    });
+    if(it != lru_.end()) {
+        if((*it)->IsValid()) {
+            ++hits_;
+            lru_.splice(lru_.begin(), lru_, it);
+            auto image = lru_.front();
+            mutex_.Unlock();
+            return {image, MAKE_ERROR(Error::kSuccess)};
+        }
+        // 実行中のアプリは古いイメージを最後の参照が外れるまで使い続ける.
+        // その内容は BeforeWrite で書き換えの前に読み込んである
+        ++reloads_;
+        lru_.erase(it);
+    } else {
+        ++misses_;
+    }
+
+    auto [page_cache, err] = NewPageMap();
+    if(err) {
+        mutex_.Unlock();
+        return {nullptr, err};
+    }
+    auto image = std::make_shared<AppImage>(file_entry, page_cache);
+    if(auto err = image->Load()) {
+        mutex_.Unlock();
+        return {nullptr, err};
+    }
+    lru_.push_front(image);
+    ShrinkLocked();
+    mutex_.Unlock();
+    return {image, MAKE_ERROR(Error::kSuccess)};
+}
+
+Error AppImageCache::Prewarm(fat::DirectoryEntry &file_entry) {
+    auto [image, err] = Get(file_entry);
+    if(err) { return err; }
+    return image->Prefault();
+}
+
+void AppImageCache::Shrink() {
+    mutex_.Lock();
+    ShrinkLocked();
+    mutex_.Unlock();
+}
+
+Error AppImageCache::BeforeWrite(fat::DirectoryEntry &file_entry) {
+    mutex_.Lock();
+    auto it = std::find_if(lru_.begin(), lru_.end(), [&](const auto &image) {
+        return &image->FileEntry() == &file_entry;
+    });
+    if(it == lru_.end()) {
+        mutex_.Unlock();
+        return MAKE_ERROR(Error::kSuccess);
+    }
+    // キャッシュ以外から参照されていなければ, 読み込まずに捨てるだけでよい
+    if(it->use_count() > 1) {
+        if(auto err = (*it)->Prefault()) {
+            mutex_.Unlock();
+            return err;
+        }
+    }
+    lru_.erase(it);
+    ++reloads_;
+    mutex_.Unlock();
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+AppImageCache::Stat AppImageCache::GetStat() {
+    mutex_.Lock();
+    Stat stat{lru_.size(), 0, max_frames_, hits_, misses_, reloads_,
+              evictions_};
+    for(const auto &image : lru_) { stat.frames += image->Frames(); }
+    mutex_.Unlock();
+    return stat;
+}
+
+void AppImageCache::ShrinkLocked() {
+    size_t frames = 0;
+    for(const auto &image : lru_) { frames += image->Frames(); }
+
+    const bool low_memory = LowOnMemory();
+    auto it = lru_.end();
+    while(it != lru_.begin() && (frames > max_frames_ || low_memory)) {
+        --it;
+        // キャッシュ以外から参照されているイメージは実行中のアプリが使っている
+        if(it->use_count() > 1) { continue; }
+        frames -= (*it)->Frames();
+        it = lru_.erase(it);
+        ++evictions_;
+    }
+}
+
+void InitializeAppImageCache() {
+    const long max_frames = BootConfigInt("appcache.frames", 4096);
+    app_images =
+        new AppImageCache{static_cast<size_t>(std::max(0l, max_frames))};
+    fat::before_write = [](fat::DirectoryEntry &entry) {
+        return app_images->BeforeWrite(entry);
+    };
+
+    if(auto [runtime, post_slash] = fat::FindFile(kRuntimePath);
+       runtime && !post_slash) {
+        if(auto err = app_images->Prewarm(*runtime)) {
+            Log(kWarn, "%s: %s\n", kRuntimePath, err.Name());
+        }
+    }
+
+    const std::string prewarm = BootConfig("appcache.prewarm", "");
+    size_t begin = 0;
+    while(begin < prewarm.length()) {
+        size_t end = prewarm.find(',', begin);
+        if(end == std::string::npos) { end = prewarm.length(); }
+        auto name = prewarm.substr(begin, end - begin);
+        begin = end + 1;
+        name.erase(0, name.find_first_not_of(' '));
+        name.erase(name.find_last_not_of(' ') + 1);
+        if(name.empty()) { continue; }
+
+        auto file_entry = FindCommand(name.c_str());
+        if(file_entry == nullptr) {
+            Log(kWarn, "appcache.prewarm: %s not found\n", name.c_str());
+            continue;
+        }
+        if(auto err = app_images->Prewarm(*file_entry)) {
+            Log(kWarn, "appcache.prewarm: %s: %s\n", name.c_str(),
+                err.Name());
+        }
+    }
+}
@@ -0,0 +1,113 @@
+/**
+ * @file app_image.hpp
+ *
+ * 読み込み済みアプリのイメージのキャッシュ.
+ * 2回目以降の起動ではページテーブルをコピーするだけで済む.
+ */
+#pragma once
+#include "error.hpp"
+#include "fat.hpp"
+#include "paging.hpp"
+#include "sync.hpp"
+#include "task.hpp"
+#include <list>
+#include <memory>
+#include <vector>
+
+/**
+ * 読み込み済みアプリのイメージ. page_cache は ELF のファイルページを写像する
+ * テンプレートのページテーブルで, 起動するときはここからページテーブルをコピーする.
+ * 最後の参照が外れたときにページキャッシュごと解放する.
+ */
+class AppImage {
+  public:
+    AppImage(fat::DirectoryEntry &file_entry, PageMapEntry *page_cache);
+    ~AppImage();
+    AppImage(const AppImage &) = delete;
+    AppImage &operator=(const AppImage &) = delete;
+
+    /** ELF ヘッダを読み, PT_LOAD セグメントをデマンドページングの対象に登録する */
+    Error Load();
+    /** ファイルの内容を含むページをすべてページキャッシュに読み込んでおく */
+    Error Prefault();
+    /** 読み込んだ後にファイルへ書き込まれておらず, 大きさと先頭クラスタも同じなら true */
+    bool IsValid() const;
+
+    fat::DirectoryEntry &FileEntry() const { return file_entry_; }
+    PageMapEntry *PageCache() const { return page_cache_; }
+    uint64_t Entry() const { return entry_; }
+    /** PT_LOAD セグメントが占める [VAddrBegin, VAddrEnd) */
+    uint64_t VAddrBegin() const;
+    uint64_t VAddrEnd() const { return vaddr_end_; }
+    const std::vector<ElfMapping> &Segments() const { return segments_; }
+    /**
+     * リンクした共有ランタイムの識別子(ランタイム自身なら自分の識別子).
+     * ランタイムを使わないアプリなら 0
+     */
+    uint64_t RuntimeID() const { return runtime_id_; }
+    /** ページキャッシュが持っているフレームの数 */
+    size_t Frames() const { return CountPageCacheFrames(page_cache_); }
+
+  private:
+    fat::DirectoryEntry &file_entry_;
+    fat::DirectoryEntry loaded_entry_; // 読み込んだときのディレクトリエントリ
+    uint64_t loaded_generation_;       // 読み込んだときの fat::WriteGeneration
+    PageMapEntry *page_cache_;
+    uint64_t entry_{0}, vaddr_end_{0};
+    uint64_t runtime_id_{0};
+    std::vector<ElfMapping> segments_{};
+};
+
+/**
+ * AppImage の LRU キャッシュ. 使われていないイメージを古い順に追い出し,
+ * ページキャッシュの合計を max_frames 以下に保つ. 空きメモリが少ないときは
+ * 使われていないイメージをすべて追い出す.
+ */
+class AppImageCache {
+  public:
+    explicit AppImageCache(size_t max_frames);
+
+    /**
+     * file_entry のイメージを返す. 無いか, 読み込んだ後にファイルが書き換えられていれば
+     * 読み込み直す. 返したイメージは参照がある間は解放されない.
+     */
+    WithError<std::shared_ptr<AppImage>> Get(fat::DirectoryEntry &file_entry);
+    /** file_entry のイメージを読み込み, ファイルの内容もページキャッシュに入れておく */
+    Error Prewarm(fat::DirectoryEntry &file_entry);
+    /** 上限を超えていれば使われていないイメージを追い出す. アプリの終了時に呼ぶ */
+    void Shrink();
+    /**
+     * file_entry へ書き込む前に呼ぶ. イメージを使っているアプリが書き換え後の内容を
+     * 読まないよう, ファイルのページをすべてページキャッシュに読み込んでから
+     * キャッシュから外す. 読み込めなければエラーを返し, イメージは残す.
+     */
+    Error BeforeWrite(fat::DirectoryEntry &file_entry);
+
+    struct Stat {
+        size_t images, frames, max_frames;
+        uint64_t hits, misses, reloads, evictions;
+    };
+    Stat GetStat();
+
+  private:
+    Mutex mutex_{};
+    size_t max_frames_;
+    std::list<std::shared_ptr<AppImage>> lru_{}; // 先頭が最近使ったもの
+    uint64_t hits_{0}, misses_{0}, reloads_{0}, evictions_{0};
+
+    void ShrinkLocked();
+};
+
+extern AppImageCache *app_images;
+
+/**
+ * 全アプリで共有するランタイム(newlib, libc++)の ELF.
+ * アプリはこのシンボルを固定アドレスに解決してリンクしてあるので, 起動時に一緒に写像する.
+ */
+const char *const kRuntimePath = "/apps/runtime";
+
+/**
+ * bootconfig の appcache.frames を上限としてキャッシュを作り, ランタイムと
+ * appcache.prewarm に ',' で区切って並べたアプリを読み込んでおく. タスク管理の初期化後に呼ぶ.
+ */
+void InitializeAppImageCache();
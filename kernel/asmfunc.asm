@@ -145,7 +145,7 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0]
+    ; FPU/SSE の状態は TaskManager が遅延して退避する
     ; fall through to RestoreContext
 
 global RestoreContext
@@ -158,8 +158,6 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     push qword [rdi + 0x08] ; RIP
 
     ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
-
     mov rax, [rdi + 0x00]
     mov cr3, rax
     mov rax, [rdi + 0x30]
@@ -206,6 +204,7 @@ CallApp:  ; int CallApp(int argc, char** argv, uint16_t ss,
     ; アプリケーションが終了してもここには来ない
 
 extern LAPICTimerOnInterrupt
+extern fpu_in_interrupt
 ; void LAPICTimerOnInterrupt(const TaskContext& ctx_stack);
 
 global IntHandlerLAPICTimer
@@ -215,7 +214,17 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
 
     ; スタック上に TaskContext 型の構造を構築する
     sub rsp, 512
+    push rax
+    mov rax, cr0
+    test al, 0x08            ; CR0.TS
+    pop rax
+    jnz .fpu_not_owned
     fxsave [rsp]
+    jmp .fpu_saved
+.fpu_not_owned:
+    ; FPU は別のタスクの状態を保持している. ハンドラ内で使われたら #NM で退避する
+    mov byte [fpu_in_interrupt], 1
+.fpu_saved:
     push r15
     push r14
     push r13
@@ -265,12 +274,71 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
+    cmp byte [fpu_in_interrupt], 0
+    jne .fpu_release
     fxrstor [rsp]
+    jmp .fpu_restored
+.fpu_release:
+    ; ハンドラ内で #NM により TS が落とされていたら立て直す
+    mov byte [fpu_in_interrupt], 0
+    push rax
+    mov rax, cr0
+    or rax, 0x08
+    mov cr0, rax
+    pop rax
+.fpu_restored:
 
     mov rsp, rbp
     pop rbp
     iretq
 
+extern ReleaseFPUOwner
+extern ClaimFPUForCurrentTask
+; uint8_t* ReleaseFPUOwner();
+; uint8_t* ClaimFPUForCurrentTask();
+
+global IntHandlerNM
+IntHandlerNM:  ; void IntHandlerNM();
+    push rax
+    clts
+
+    ; FPU レジスタを保持しているタスクがあれば, その状態を退避する
+    call ReleaseFPUOwner
+    test rax, rax
+    jz .load
+    fxsave [rax]
+.load:
+    ; タイマー割り込みハンドラ内では作業用に使わせるだけで, 状態は読み込まない
+    cmp byte [fpu_in_interrupt], 0
+    jne .done
+    call ClaimFPUForCurrentTask
+    fxrstor [rax]
+.done:
+    pop rax
+    iretq
+
+global ClearTS
+ClearTS:  ; void ClearTS();
+    clts
+    ret
+
+global SetTS
+SetTS:  ; void SetTS();
+    mov rax, cr0
+    or rax, 0x08
+    mov cr0, rax
+    ret
+
+global SaveFPU
+SaveFPU:  ; void SaveFPU(void* fxsave_area);
+    fxsave [rdi]
+    ret
+
+global RestoreFPU
+RestoreFPU:  ; void RestoreFPU(void* fxsave_area);
+    fxrstor [rdi]
+    ret
+
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
     ltr di
@@ -285,8 +353,25 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     wrmsr
     ret
 
+global ReadMSR
+ReadMSR:  ; uint64_t ReadMSR(uint32_t msr);
+    mov ecx, edi
+    rdmsr
+    shl rdx, 32
+    or rax, rdx
+    ret
+
+global ReadTSC
+ReadTSC:  ; uint64_t ReadTSC(void);
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 extern GetCurrentTaskOSStackPointer
 extern syscall_table
+extern syscall_trace_mode
+extern TraceSyscall
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
     push rbp
@@ -316,14 +401,19 @@ SyscallEntry:  ; void SyscallEntry(void);
     pop rax
     and rsp, 0xfffffffffffffff0
 
+    cmp byte [syscall_trace_mode], 0
+    jne .traced
     call [syscall_table + 8 * eax]
     ; rbx, r12-r15 は callee-saved なので呼び出し側で保存しない
     ; rax は戻り値用なので呼び出し側で保存しない
 
+.dispatched:
     mov rsp, rbp
 
     pop rsi  ; システムコール番号を復帰
-    cmp esi, 0x80000002
+    cmp esi, 0x80000002  ; Exit
+    je  .exit
+    cmp esi, 0x80000020  ; ThreadExit
     je  .exit
 
     pop r11
@@ -331,6 +421,13 @@ SyscallEntry:  ; void SyscallEntry(void);
     pop rbp
     o64 sysret
 
+.traced:
+    ; TraceSyscall の第7引数としてシステムコール番号をスタックに積む
+    sub rsp, 8
+    push rax
+    call TraceSyscall
+    jmp .dispatched
+
 .exit:
     mov rdi, rax
     mov esi, edx
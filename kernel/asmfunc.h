@@ -19,8 +19,15 @@ extern "C" {
 	void RestoreContext(void* ctx);
 	int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
 	void IntHandlerLAPICTimer();
+	void IntHandlerNM();
+	void ClearTS();
+	void SetTS();
+	void SaveFPU(void* fxsave_area);
+	void RestoreFPU(void* fxsave_area);
 	void LoadTR(uint16_t sel);
 	void WriteMSR(uint32_t msr, uint64_t value);
+	uint64_t ReadMSR(uint32_t msr);
+	uint64_t ReadTSC(void);
 	void SyscallEntry(void);
 	void ExitApp(uint64_t rsp, int32_t ret_val);
 	void InvalidateTLB(uint64_t addr);
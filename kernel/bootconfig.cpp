@@ -0,0 +1,74 @@
+#include "bootconfig.hpp"
+#include "fat.hpp"
+#include "logger.hpp"
+#include <cctype>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+std::map<std::string, std::string> *boot_config;
+
+std::string Trim(const char *begin, const char *end) {
+    while(begin < end && isspace(*begin)) { ++begin; }
+    while(end > begin && isspace(end[-1])) { --end; }
+    return std::string(begin, end);
+}
+
+void ParseLine(const char *begin, const char *end) {
+    for(auto p = begin; p < end; ++p) {
+        if(*p == '#') {
+            end = p;
+            break;
+        }
+    }
+
+    const char *eq = begin;
+    while(eq < end && *eq != '=') { ++eq; }
+    if(eq == end) { return; }
+
+    auto key = Trim(begin, eq);
+    if(key.empty()) { return; }
+    (*boot_config)[key] = Trim(eq + 1, end);
+}
+} // namespace
+
+void InitializeBootConfig() {
+    boot_config = new std::map<std::string, std::string>;
+
+    auto [entry, post_slash] = fat::FindFile("/laplus.cfg");
+    if(entry == nullptr || post_slash) { return; }
+
+    std::vector<char> buf(entry->file_size);
+    const size_t len = fat::LoadFile(buf.data(), buf.size(), *entry);
+
+    const char *line = buf.data();
+    const char *end = buf.data() + len;
+    for(auto p = line; p < end; ++p) {
+        if(*p == '\n') {
+            ParseLine(line, p);
+            line = p + 1;
+        }
+    }
+    ParseLine(line, end);
+
+    for(auto &[key, value] : *boot_config) {
+        Log(kInfo, "bootconfig: %s=%s\n", key.c_str(), value.c_str());
+    }
+}
+
+const char *BootConfig(const char *key, const char *default_value) {
+    if(boot_config == nullptr) { return default_value; }
+    auto it = boot_config->find(key);
+    return it == boot_config->end() ? default_value : it->second.c_str();
+}
+
+long BootConfigInt(const char *key, long default_value) {
+    const char *value = BootConfig(key);
+    if(value == nullptr || *value == '\0') { return default_value; }
+
+    char *endp;
+    const long v = strtol(value, &endp, 0);
+    return *endp == '\0' ? v : default_value;
+}
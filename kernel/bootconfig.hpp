@@ -0,0 +1,17 @@
+/**
+ * @file bootconfig.hpp
+ *
+ * 起動時設定ファイル(/laplus.cfg)の読み込み
+ */
+#pragma once
+
+/**
+ * ボリュームの /laplus.cfg を読み込む. fat::Initialize の後に呼ぶ.
+ * 1行に1つ "key=value" を書く. '#' から行末まではコメント.
+ * ファイルがなければすべての設定が既定値になる.
+ */
+void InitializeBootConfig();
+
+/** key の値. 設定されていなければ default_value */
+const char *BootConfig(const char *key, const char *default_value = nullptr);
+long BootConfigInt(const char *key, long default_value);
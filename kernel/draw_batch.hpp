@@ -0,0 +1,66 @@
+/**
+ * @file draw_batch.hpp
+ *
+ * WinDrawBatch に渡す描画コマンドの形式.
+ * 各コマンドは DrawCommandHeader で始まり, size バイトごとに並べる.
+ */
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+enum DrawCommandType {
+    kDrawFillRect = 1,
+    kDrawLine,
+    kDrawText,
+    kDrawBlit,
+    kDrawCopyRect,
+};
+
+struct DrawCommandHeader {
+    uint16_t type;
+    uint16_t size; // ヘッダを含むコマンドのバイト数. 4 の倍数
+};
+
+/** 色はすべて 0xRRGGBB. 座標はウィンドウ枠を含むウィンドウ内の座標 */
+struct DrawFillRect {
+    struct DrawCommandHeader header;
+    int32_t x, y, w, h;
+    uint32_t color;
+};
+
+struct DrawLine {
+    struct DrawCommandHeader header;
+    int32_t x0, y0, x1, y1;
+    uint32_t color;
+};
+
+/** text は UTF-8 で len バイト. 終端の NUL は要らない */
+struct DrawText {
+    struct DrawCommandHeader header;
+    int32_t x, y;
+    uint32_t color;
+    uint32_t len;
+    char text[];
+};
+
+/** pixels は w * h 個の 0xRRGGBB. アプリのメモリを指す */
+struct DrawBlit {
+    struct DrawCommandHeader header;
+    int32_t x, y, w, h;
+    const uint32_t *pixels;
+};
+
+/** (sx, sy, w, h) の内容を (x, y) に写す */
+struct DrawCopyRect {
+    struct DrawCommandHeader header;
+    int32_t x, y, sx, sy, w, h;
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -1,4 +1,6 @@
 #include "fat.hpp"
+#include "sync.hpp"
+#include "uefi.hpp"
 #include <algorithm>
 #include <cctype>
 #include <cstring>
@@ -20,15 +22,28 @@ std::pair<const char *, bool> NextPathElement(const char *path,
     return {&next_slash[1], true};
 }
 
+/** 書き込み時刻を現在時刻にする */
+void SetWriteTime(fat::DirectoryEntry &entry) {
+    EFI_TIME t;
+    if(uefi_rt == nullptr || uefi_rt->GetTime(&t, nullptr) != EFI_SUCCESS) {
+        return;
+    }
+    entry.write_date = (t.Year - 1980) << 9 | t.Month << 5 | t.Day;
+    entry.write_time = t.Hour << 11 | t.Minute << 5 | t.Second / 2;
+}
+
 } // namespace
 
 namespace fat {
 
 BPB *boot_volume_image;
 unsigned long bytes_per_cluster;
+Error (*before_write)(DirectoryEntry &entry);
+std::map<const DirectoryEntry *, uint64_t> *write_generations;
 
 /*FATモジュールの初期化*/
 void Initialize(void *volume_image) {
+    write_generations = new std::map<const DirectoryEntry *, uint64_t>;
     boot_volume_image = reinterpret_cast<fat::BPB *>(volume_image);
     bytes_per_cluster =
         static_cast<unsigned long>(boot_volume_image->bytes_per_sector) *
@@ -263,12 +278,29 @@ size_t FileDescriptor::Read(void *buf, size_t len) {
     return total;
 }
 
+uint64_t WriteGeneration(const DirectoryEntry &entry) {
+    const auto rflags = DisableInterrupts();
+    auto it = write_generations->find(&entry);
+    const uint64_t gen = it == write_generations->end() ? 0 : it->second;
+    RestoreInterrupts(rflags);
+    return gen;
+}
+
 size_t FileDescriptor::Write(const void *buf, size_t len) {
     auto num_cluster = [](size_t bytes) {
         return (bytes + bytes_per_cluster - 1) / bytes_per_cluster;
     };
 
+    // 書き込みはクラスタをその場で書き換えるので, 先に今の内容を読ませておく
+    if(before_write) {
+        if(auto err = before_write(fat_entry_)) { return 0; }
+    }
+    const auto rflags = DisableInterrupts();
+    ++(*write_generations)[&fat_entry_];
+    RestoreInterrupts(rflags);
+
     if(wr_cluster_ == 0) {
+        SetWriteTime(fat_entry_);
         if(fat_entry_.FirstCluster() != 0) {
             wr_cluster_ = fat_entry_.FirstCluster();
         } else {
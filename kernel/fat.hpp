@@ -8,6 +8,7 @@
 #include "file.hpp"
 #include <cstddef>
 #include <cstdint>
+#include <map>
 
 namespace fat {
 struct BPB {
@@ -149,6 +150,13 @@ WithError<DirectoryEntry *> CreateFile(const char *path);
  nはクラスタ数*/
 unsigned long AllocateClusterChain(size_t n);
 
+/*ファイルの内容を書き換える直前に呼ぶ関数. 今の内容をまだ読む者(実行中のアプリ)に
+ *先に読み終えさせるのに使う. エラーを返すと書き込みは失敗する*/
+extern Error (*before_write)(DirectoryEntry &entry);
+
+/*entryへの書き込みの回数を返す. 読み込んだ内容が古くなっていないか確かめるのに使う*/
+uint64_t WriteGeneration(const DirectoryEntry &entry);
+
 class FileDescriptor : public ::FileDescriptor {
   public:
     explicit FileDescriptor(DirectoryEntry &fat_entry);
@@ -6,7 +6,12 @@
 #include "font.hpp"
 #include "fat.hpp"
 #include "logger.hpp"
+#include "sync.hpp"
+#include <algorithm>
+#include <array>
 #include <cstdlib>
+#include <cstring>
+#include <map>
 #include <vector>
 
 extern const uint8_t _binary_hankaku_bin_start;
@@ -23,10 +28,70 @@ const uint8_t *GetFont(char c) {
     return &_binary_hankaku_bin_start + index;
 }
 
+/** ビットの並び(最上位ビットが左端)を 1 ピクセル 1 バイトのマスクに展開する */
+void ExpandMaskRow(uint32_t bits, int width, uint8_t *mask) {
+    for(int dx = 0; dx < width; ++dx) {
+        mask[dx] = (bits << dx) & 0x80000000u ? 0xff : 0;
+    }
+}
+
+/** 半角フォントのマスク. 各文字 16 行 x 8 ピクセル */
+struct HankakuMask {
+    uint16_t rows; // マスクが 0 でない行のビット. 空の行を飛ばすのに使う
+    uint8_t mask[16][8];
+};
+// InitializeFont より前のコンソール出力でも使うので, ヒープを使わず初回に埋める
+std::array<HankakuMask, 256> hankaku_masks;
+bool hankaku_masks_ready = false;
+
+void InitializeHankakuMasks() {
+    for(int c = 0; c < 256; ++c) {
+        const uint8_t *font = GetFont(c);
+        if(font == nullptr) { continue; }
+        auto &m = hankaku_masks[c];
+        m.rows = 0;
+        for(int dy = 0; dy < 16; ++dy) {
+            ExpandMaskRow(static_cast<uint32_t>(font[dy]) << 24, 8,
+                          m.mask[dy]);
+            if(font[dy]) { m.rows |= 1u << dy; }
+        }
+    }
+    hankaku_masks_ready = true;
+}
+
 FT_Library ft_library;
 std::vector<uint8_t> *nihongo_buf, *chinese_buf;
+FT_Face nihongo_face;
+int face_pixel_size;
+
+/**
+ * 描画済みのグリフ. mask は各行を 1 ピクセル 1 バイトに展開したもので,
+ * PixelWriter::WriteMaskRow で1行ずつ描く. bitmap は行ごとのビット(最上位ビットが左端).
+ * left, top は描画位置からビットマップ左上までのずれ.
+ */
+struct Glyph {
+    static const int kMaxRows = 32, kMaxWidth = 32;
+
+    char32_t c;
+    int pixel_size;
+    bool found; // フォントにグリフが無ければ false
+    int left, top, width, rows;
+    std::array<uint32_t, kMaxRows> bitmap;
+    uint8_t mask[kMaxRows][kMaxWidth];
+};
+
+Error RenderUnicode(char32_t c, int pixel_size, Glyph &glyph) {
+    glyph = Glyph{c, pixel_size, false};
+    if(nihongo_face == nullptr) { return MAKE_ERROR(Error::kNoSuchEntry); }
+
+    FT_Face face = nihongo_face;
+    if(face_pixel_size != pixel_size) {
+        if(int err = FT_Set_Pixel_Sizes(face, pixel_size, pixel_size)) {
+            return MAKE_ERROR(Error::kFreeTypeError);
+        }
+        face_pixel_size = pixel_size;
+    }
 
-Error RenderUnicode(char32_t c, FT_Face face) {
     const auto glyph_index = FT_Get_Char_Index(face, c);
     if(glyph_index == 0) { return MAKE_ERROR(Error::kFreeTypeError); }
 
@@ -34,21 +99,128 @@ Error RenderUnicode(char32_t c, FT_Face face) {
                                FT_LOAD_RENDER | FT_LOAD_TARGET_MONO)) {
         return MAKE_ERROR(Error::kFreeTypeError);
     }
+    const FT_Bitmap &bitmap = face->glyph->bitmap;
+
+    const int baseline = (face->height + face->descender) *
+                         face->size->metrics.y_ppem / face->units_per_EM;
+    glyph.found = true;
+    glyph.left = face->glyph->bitmap_left;
+    glyph.top = baseline - face->glyph->bitmap_top;
+    glyph.width = std::min<int>(bitmap.width, Glyph::kMaxWidth);
+    glyph.rows = std::min<int>(bitmap.rows, Glyph::kMaxRows);
+
+    for(int dy = 0; dy < glyph.rows; ++dy) {
+        const unsigned char *q = &bitmap.buffer[bitmap.pitch * dy];
+        if(bitmap.pitch < 0) { q -= bitmap.pitch * bitmap.rows; }
+        uint32_t row = 0;
+        for(int i = 0; i < 4 && i * 8 < glyph.width; ++i) {
+            row |= static_cast<uint32_t>(q[i]) << (24 - 8 * i);
+        }
+        if(glyph.width < 32) { row &= ~(0xffffffffu >> glyph.width); }
+        glyph.bitmap[dy] = row;
+        ExpandMaskRow(row, glyph.width, glyph.mask[dy]);
+    }
     return MAKE_ERROR(Error::kSuccess);
 }
 
+/**
+ * 描画済みグリフの LRU キャッシュ. (コードポイント, 大きさ) で引き,
+ * 一杯なら最も長く使われていないグリフを描画し直したグリフで置き換える.
+ * 割り込み禁止で使う.
+ */
+class GlyphCache {
+  public:
+    static const int kMaxGlyphs = 512;
+
+    GlyphCache() { Clear(); }
+
+    /** c のグリフ. キャッシュになければ FreeType で描画して入れる */
+    const Glyph &Get(char32_t c, int pixel_size) {
+        const uint64_t key = Key(c, pixel_size);
+        if(auto it = index_.find(key); it != index_.end()) {
+            ++stat_.hits;
+            MoveToFront(it->second);
+            return nodes_[it->second].glyph;
+        }
+
+        ++stat_.misses;
+        int i;
+        if(used_ < kMaxGlyphs) {
+            i = used_++;
+        } else {
+            i = tail_;
+            Unlink(i);
+            const auto &old = nodes_[i].glyph;
+            index_.erase(Key(old.c, old.pixel_size));
+            ++stat_.evictions;
+        }
+        RenderUnicode(c, pixel_size, nodes_[i].glyph);
+        index_[key] = i;
+        PushFront(i);
+        return nodes_[i].glyph;
+    }
+
+    void Clear() {
+        index_.clear();
+        used_ = 0;
+        head_ = tail_ = kNil;
+    }
+
+    GlyphCacheStat Stat() const {
+        auto stat = stat_;
+        stat.glyphs = used_;
+        stat.max_glyphs = kMaxGlyphs;
+        return stat;
+    }
+
+  private:
+    static const int kNil = -1;
+
+    struct Node {
+        Glyph glyph;
+        int prev, next;
+    };
+
+    std::array<Node, kMaxGlyphs> nodes_;
+    std::map<uint64_t, int> index_{};
+    int used_, head_, tail_;
+    GlyphCacheStat stat_{};
+
+    static uint64_t Key(char32_t c, int pixel_size) {
+        return static_cast<uint64_t>(pixel_size) << 32 | c;
+    }
+
+    void Unlink(int i) {
+        auto &n = nodes_[i];
+        (n.prev == kNil ? head_ : nodes_[n.prev].next) = n.next;
+        (n.next == kNil ? tail_ : nodes_[n.next].prev) = n.prev;
+    }
+
+    void PushFront(int i) {
+        nodes_[i].prev = kNil;
+        nodes_[i].next = head_;
+        (head_ == kNil ? tail_ : nodes_[head_].prev) = i;
+        head_ = i;
+    }
+
+    void MoveToFront(int i) {
+        if(head_ == i) { return; }
+        Unlink(i);
+        PushFront(i);
+    }
+};
+
+GlyphCache *glyph_cache;
+
 } // namespace
 
 void WriteAscii(PixelWriter &writer, Vector2D<int> pos, char c,
                 const PixelColor &color) {
-    const uint8_t *font = GetFont(c);
-    if(font == nullptr) { return; }
-    for(int dy = 0; dy < 16; ++dy) {
-        for(int dx = 0; dx < 8; ++dx) {
-            if((font[dy] << dx) & 0x80u) {
-                writer.Write(pos + Vector2D<int>{dx, dy}, color);
-            }
-        }
+    if(!hankaku_masks_ready) { InitializeHankakuMasks(); }
+    const auto &m = hankaku_masks[static_cast<uint8_t>(c)];
+    for(uint16_t rows = m.rows; rows; rows &= rows - 1) {
+        const int dy = __builtin_ctz(rows);
+        writer.WriteMaskRow(pos + Vector2D<int>{0, dy}, m.mask[dy], 8, color);
     }
 }
 
@@ -102,20 +274,6 @@ std::pair<char32_t, int> ConvertUTF8To32(const char *u8) {
 
 bool IsHankaku(char32_t c) { return c <= 0x7f; }
 
-WithError<FT_Face> NewFTFace() {
-    if(!nihongo_buf) { return {0, MAKE_ERROR(Error::kNoSuchEntry)}; }
-
-    FT_Face face;
-    if(int err = FT_New_Memory_Face(ft_library, nihongo_buf->data(),
-                                    nihongo_buf->size(), 0, &face)) {
-        return {face, MAKE_ERROR(Error::kFreeTypeError)};
-    }
-    if(int err = FT_Set_Pixel_Sizes(face, 16, 16)) {
-        return {face, MAKE_ERROR(Error::kFreeTypeError)};
-    }
-    return {face, MAKE_ERROR(Error::kSuccess)};
-}
-
 Error WriteUnicode(PixelWriter &writer, Vector2D<int> pos, char32_t c,
                    const PixelColor &color) {
     if(c <= 0x7f) {
@@ -123,42 +281,53 @@ Error WriteUnicode(PixelWriter &writer, Vector2D<int> pos, char32_t c,
         return MAKE_ERROR(Error::kSuccess);
     }
 
-    auto [face, err] = NewFTFace();
-    if(err) {
-        WriteAscii(writer, pos, '?', color);
-        WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-        return err;
+    // 他のタスクに追い出されないよう, 使う行のマスクだけ写してから
+    // 割り込みを許可して描く
+    const auto rflags = DisableInterrupts();
+    const Glyph &glyph = glyph_cache->Get(c, kGlyphPixelSize);
+    const bool found = glyph.found;
+    const auto glyph_topleft = pos + Vector2D<int>{glyph.left, glyph.top};
+    const int width = glyph.width, rows = glyph.rows;
+    uint32_t row_bits[Glyph::kMaxRows];
+    uint8_t mask[Glyph::kMaxRows][Glyph::kMaxWidth];
+    if(found) {
+        for(int dy = 0; dy < rows; ++dy) {
+            row_bits[dy] = glyph.bitmap[dy];
+            if(row_bits[dy]) { memcpy(mask[dy], glyph.mask[dy], width); }
+        }
     }
-    if(auto err = RenderUnicode(c, face)) {
-        FT_Done_Face(face);
+    RestoreInterrupts(rflags);
+
+    if(!found) {
         WriteAscii(writer, pos, '?', color);
         WriteAscii(writer, pos + Vector2D<int>{8, 0}, '?', color);
-        return err;
+        return MAKE_ERROR(nihongo_face ? Error::kFreeTypeError
+                                       : Error::kNoSuchEntry);
     }
-    FT_Bitmap &bitmap = face->glyph->bitmap;
 
-    const int baseline = (face->height + face->descender) *
-                         face->size->metrics.y_ppem / face->units_per_EM;
-    const auto glyph_topleft =
-        pos + Vector2D<int>{face->glyph->bitmap_left,
-                            baseline - face->glyph->bitmap_top};
-
-    for(int dy = 0; dy < bitmap.rows; ++dy) {
-        unsigned char *q = &bitmap.buffer[bitmap.pitch * dy];
-        if(bitmap.pitch < 0) { q -= bitmap.pitch * bitmap.rows; }
-        for(int dx = 0; dx < bitmap.width; ++dx) {
-            const bool b = q[dx >> 3] & (0x80 >> (dx & 0x7));
-            if(b) {
-                writer.Write(glyph_topleft + Vector2D<int>{dx, dy}, color);
-            }
-        }
+    for(int dy = 0; dy < rows; ++dy) {
+        if(row_bits[dy] == 0) { continue; }
+        writer.WriteMaskRow(glyph_topleft + Vector2D<int>{0, dy}, mask[dy],
+                            width, color);
     }
-
-    FT_Done_Face(face);
     return MAKE_ERROR(Error::kSuccess);
 }
 
+GlyphCacheStat GetGlyphCacheStat() {
+    const auto rflags = DisableInterrupts();
+    const auto stat = glyph_cache->Stat();
+    RestoreInterrupts(rflags);
+    return stat;
+}
+
+void ClearGlyphCache() {
+    const auto rflags = DisableInterrupts();
+    glyph_cache->Clear();
+    RestoreInterrupts(rflags);
+}
+
 void InitializeFont() {
+    glyph_cache = new GlyphCache;
     if(int err = FT_Init_FreeType(&ft_library)) {
         Log(kError, "Failed to initialize FreeType library\n");
         exit(1);
@@ -178,6 +347,15 @@ void InitializeFont() {
         exit(1);
     }
 
+    // フェイスは一度だけ作り, 描いたグリフは glyph_cache に残す
+    if(FT_New_Memory_Face(ft_library, nihongo_buf->data(), nihongo_buf->size(),
+                          0, &nihongo_face) ||
+       FT_Set_Pixel_Sizes(nihongo_face, kGlyphPixelSize, kGlyphPixelSize)) {
+        Log(kError, "Failed to open nihongo.ttf\n");
+        nihongo_face = nullptr;
+    }
+    face_pixel_size = kGlyphPixelSize;
+
     if(int err = FT_Init_FreeType(&ft_library)) {
         Log(kError, "Failed to initialize FreeType library\n");
         exit(1);
@@ -12,7 +12,17 @@ void WriteString(PixelWriter& writer, Vector2D<int> pos, const char* s, const Pi
 int CountUTF8Size(uint8_t c);
 std::pair<char32_t, int> ConvertUTF8To32(const char* u8);
 bool IsHankaku(char32_t c);
-WithError<FT_Face> NewFTFace();
+/** WriteUnicode が描く全角文字の大きさ(ピクセル) */
+const int kGlyphPixelSize = 16;
+/** 全角文字はキャッシュ済みのグリフから描く. 無ければ FreeType で描画してキャッシュに入れる */
 Error WriteUnicode(PixelWriter& writer, Vector2D<int> pos,
 	char32_t c, const PixelColor& color);
 void InitializeFont();
+
+struct GlyphCacheStat {
+	size_t glyphs, max_glyphs;
+	uint64_t hits, misses, evictions;
+};
+GlyphCacheStat GetGlyphCacheStat();
+/** キャッシュしたグリフをすべて捨てる. fontbench が描画し直す速さを測るのに使う */
+void ClearGlyphCache();
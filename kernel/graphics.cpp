@@ -19,6 +19,8 @@
 #include <cerrno>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <emmintrin.h>
 #include <fcntl.h>
 //#include "appsyscall.h"
 
@@ -43,6 +45,150 @@ void BGRResv8BitPerColorPixelWriter::Write(Vector2D<int> pos,
     p[2] = c.r;
 }
 
+void PixelWriter::WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                               int width, const PixelColor &c) {
+    for(int dx = 0; dx < width; ++dx) {
+        if(mask[dx]) { Write(pos + Vector2D<int>{dx, 0}, c); }
+    }
+}
+
+void BlendMaskRow(uint32_t *dst, const uint8_t *mask, int width,
+                  uint32_t pixel) {
+    const __m128i color = _mm_set1_epi32(pixel);
+    int x = 0;
+    for(; x + 4 <= width; x += 4) {
+        uint32_t m4;
+        memcpy(&m4, &mask[x], 4);
+        if(m4 == 0) { continue; }
+        // 0xff のバイトを 4 倍に広げて 0xffffffff のピクセルマスクにする
+        __m128i m = _mm_cvtsi32_si128(m4);
+        m = _mm_unpacklo_epi8(m, m);
+        m = _mm_unpacklo_epi16(m, m);
+        auto p = reinterpret_cast<__m128i *>(&dst[x]);
+        const __m128i d = _mm_loadu_si128(p);
+        _mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(m, d),
+                                         _mm_and_si128(m, color)));
+    }
+    for(; x < width; ++x) {
+        if(mask[x]) { dst[x] = pixel; }
+    }
+}
+
+void FrameBufferWriter::WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                                     int width, const PixelColor &c) {
+    if(pos.y < 0 || pos.y >= Height()) { return; }
+    if(pos.x < 0) {
+        mask -= pos.x;
+        width += pos.x;
+        pos.x = 0;
+    }
+    width = std::min(width, Width() - pos.x);
+    if(width <= 0) { return; }
+    BlendMaskRow(reinterpret_cast<uint32_t *>(PixelAt(pos)), mask, width,
+                 PixelValue(c));
+}
+
+void PixelWriter::FillSpan(Vector2D<int> pos, int width, const PixelColor &c) {
+    for(int dx = 0; dx < width; ++dx) {
+        Write(pos + Vector2D<int>{dx, 0}, c);
+    }
+}
+
+void PixelWriter::FillRect(Vector2D<int> pos, Vector2D<int> size,
+                           const PixelColor &c) {
+    for(int dy = 0; dy < size.y; ++dy) {
+        FillSpan(pos + Vector2D<int>{0, dy}, size.x, c);
+    }
+}
+
+void PixelWriter::BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                           const uint32_t *src, int src_stride) {
+    for(int dy = 0; dy < size.y; ++dy) {
+        const uint32_t *row = src + static_cast<size_t>(src_stride) * dy;
+        for(int dx = 0; dx < size.x; ++dx) {
+            Write(pos + Vector2D<int>{dx, dy}, ToColor(row[dx]));
+        }
+    }
+}
+
+void FillRow(uint32_t *dst, int width, uint32_t pixel) {
+    const __m128i color = _mm_set1_epi32(pixel);
+    int x = 0;
+    for(; x + 16 <= width; x += 16) {
+        auto p = reinterpret_cast<__m128i *>(&dst[x]);
+        _mm_storeu_si128(p, color);
+        _mm_storeu_si128(p + 1, color);
+        _mm_storeu_si128(p + 2, color);
+        _mm_storeu_si128(p + 3, color);
+    }
+    for(; x + 4 <= width; x += 4) {
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&dst[x]), color);
+    }
+    for(; x < width; ++x) { dst[x] = pixel; }
+}
+
+namespace {
+/** pos, size の矩形を {0, 0} から limit の範囲に切り詰める */
+Rectangle<int> ClipRect(Vector2D<int> pos, Vector2D<int> size,
+                        Vector2D<int> limit) {
+    return Rectangle<int>{pos, size} & Rectangle<int>{{0, 0}, limit};
+}
+} // namespace
+
+void FrameBufferWriter::FillRect(Vector2D<int> pos, Vector2D<int> size,
+                                 const PixelColor &c) {
+    const auto area = ClipRect(pos, size, {Width(), Height()});
+    if(area.size.x <= 0 || area.size.y <= 0) { return; }
+    const uint32_t pixel = PixelValue(c);
+    for(int dy = 0; dy < area.size.y; ++dy) {
+        FillRow(reinterpret_cast<uint32_t *>(
+                    PixelAt(area.pos + Vector2D<int>{0, dy})),
+                area.size.x, pixel);
+    }
+}
+
+void FrameBufferWriter::BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                                 const uint32_t *src, int src_stride) {
+    const auto area = ClipRect(pos, size, {Width(), Height()});
+    if(area.size.x <= 0 || area.size.y <= 0) { return; }
+    const auto skip = area.pos - pos;
+    src += static_cast<size_t>(src_stride) * skip.y + skip.x;
+    for(int dy = 0; dy < area.size.y; ++dy) {
+        CopyRow(reinterpret_cast<uint32_t *>(
+                    PixelAt(area.pos + Vector2D<int>{0, dy})),
+                src + static_cast<size_t>(src_stride) * dy, area.size.x);
+    }
+}
+
+void RGBResv8BitPerColorPixelWriter::CopyRow(uint32_t *dst,
+                                             const uint32_t *src,
+                                             int width) const {
+    // 0xRRGGBB の R と B を入れ替える
+    const __m128i rb_mask = _mm_set1_epi32(0x000000ff);
+    const __m128i g_mask = _mm_set1_epi32(0x0000ff00);
+    int x = 0;
+    for(; x + 4 <= width; x += 4) {
+        const __m128i s =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[x]));
+        const __m128i r = _mm_and_si128(_mm_srli_epi32(s, 16), rb_mask);
+        const __m128i b = _mm_slli_epi32(_mm_and_si128(s, rb_mask), 16);
+        const __m128i g = _mm_and_si128(s, g_mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(&dst[x]),
+                         _mm_or_si128(_mm_or_si128(r, g), b));
+    }
+    for(; x < width; ++x) {
+        const uint32_t s = src[x];
+        dst[x] = (s >> 16 & 0xff) | (s & 0xff00) | (s & 0xff) << 16;
+    }
+}
+
+void BGRResv8BitPerColorPixelWriter::CopyRow(uint32_t *dst,
+                                             const uint32_t *src,
+                                             int width) const {
+    // 0xRRGGBB はそのまま B, G, R の順のバイト列になる
+    memcpy(dst, src, 4 * static_cast<size_t>(width));
+}
+
 uint32_t GetColorRGB(unsigned char *image_data) {
     return static_cast<uint32_t>(image_data[0]) << 16 |
            static_cast<uint32_t>(image_data[1]) << 8 |
@@ -51,23 +197,18 @@ uint32_t GetColorRGB(unsigned char *image_data) {
 
 void DrawRectangle(PixelWriter &writer, const Vector2D<int> &pos,
                    const Vector2D<int> &size, const PixelColor &c) {
-    for(int dx = 0; dx < size.x; ++dx) {
-        writer.Write(pos + Vector2D<int>{dx, 0}, c);
-        writer.Write(pos + Vector2D<int>{dx, size.y - 1}, c);
-    }
-    for(int dy = 1; dy < size.y - 1; ++dy) {
-        writer.Write(pos + Vector2D<int>{0, dy}, c);
-        writer.Write(pos + Vector2D<int>{size.x - 1, dy}, c);
-    }
+    if(size.x <= 0 || size.y <= 0) { return; }
+    writer.FillSpan(pos, size.x, c);
+    if(size.y == 1) { return; }
+    writer.FillSpan(pos + Vector2D<int>{0, size.y - 1}, size.x, c);
+    writer.FillRect(pos + Vector2D<int>{0, 1}, {1, size.y - 2}, c);
+    writer.FillRect(pos + Vector2D<int>{size.x - 1, 1}, {1, size.y - 2}, c);
 }
 
 void FillRectangle(PixelWriter &writer, const Vector2D<int> &pos,
                    const Vector2D<int> &size, const PixelColor &c) {
-    for(int dy = 0; dy < size.y; ++dy) {
-        for(int dx = 0; dx < size.x; ++dx) {
-            writer.Write(pos + Vector2D<int>{dx, dy}, c);
-        }
-    }
+    if(size.x <= 0 || size.y <= 0) { return; }
+    writer.FillRect(pos, size, c);
 }
 
 namespace {
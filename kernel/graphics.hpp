@@ -86,20 +86,62 @@ class PixelWriter {
     virtual void Write(Vector2D<int> pos, const PixelColor &c) = 0;
     virtual int Width() const = 0;
     virtual int Height() const = 0;
+    /**
+     * pos から右へ width ピクセルのうち, mask が 0 でないピクセルを c で塗る.
+     * mask はグリフの1行を 1 ピクセル 1 バイト(0 か 0xff)に展開したもの.
+     * 既定の実装は立っているピクセルごとに Write を呼ぶ.
+     */
+    virtual void WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                              int width, const PixelColor &c);
+    /** pos から右へ width ピクセルを c で塗る. 既定の実装はピクセルごとに Write を呼ぶ */
+    virtual void FillSpan(Vector2D<int> pos, int width, const PixelColor &c);
+    /** pos から size の範囲を c で塗る. 既定の実装は行ごとに FillSpan を呼ぶ */
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size,
+                          const PixelColor &c);
+    /**
+     * src の size の範囲を pos に写す. src は 1 ピクセル 4 バイト(0xRRGGBB)で,
+     * 1 行が src_stride ピクセル. 既定の実装はピクセルごとに Write を呼ぶ.
+     */
+    virtual void BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                          const uint32_t *src, int src_stride);
 };
 
+/**
+ * 4 バイト/ピクセルの行 dst のうち mask が 0xff のピクセルを pixel にする.
+ * SSE2 で 4 ピクセルずつマスク合成する.
+ */
+void BlendMaskRow(uint32_t *dst, const uint8_t *mask, int width,
+                  uint32_t pixel);
+/** 4 バイト/ピクセルの行 dst の width ピクセルを pixel にする. SSE2 でまとめて書く */
+void FillRow(uint32_t *dst, int width, uint32_t pixel);
+
 class FrameBufferWriter : public PixelWriter {
   public:
     FrameBufferWriter(const FrameBufferConfig &config) : config_{config} {}
     virtual ~FrameBufferWriter() = default;
     virtual int Width() const override { return config_.horizontal_resolution; }
     virtual int Height() const override { return config_.vertical_resolution; }
+    virtual void WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                              int width, const PixelColor &c) override;
+    virtual void FillSpan(Vector2D<int> pos, int width,
+                          const PixelColor &c) override {
+        FillRect(pos, {width, 1}, c);
+    }
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size,
+                          const PixelColor &c) override;
+    virtual void BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                          const uint32_t *src, int src_stride) override;
 
   protected:
     uint8_t *PixelAt(Vector2D<int> pos) {
         return config_.frame_buffer +
                4 * (config_.pixels_per_scan_line * pos.y + pos.x);
     }
+    /** c をフレームバッファの 1 ピクセル(4 バイト)の値にする */
+    virtual uint32_t PixelValue(const PixelColor &c) const = 0;
+    /** 0xRRGGBB の行 src をフレームバッファの形式にして dst に書く */
+    virtual void CopyRow(uint32_t *dst, const uint32_t *src,
+                         int width) const = 0;
 
   private:
     const FrameBufferConfig &config_;
@@ -109,12 +151,26 @@ class RGBResv8BitPerColorPixelWriter : public FrameBufferWriter {
   public:
     using FrameBufferWriter::FrameBufferWriter;
     virtual void Write(Vector2D<int> pos, const PixelColor &c) override;
+
+  protected:
+    virtual uint32_t PixelValue(const PixelColor &c) const override {
+        return c.r | c.g << 8 | c.b << 16;
+    }
+    virtual void CopyRow(uint32_t *dst, const uint32_t *src,
+                         int width) const override;
 };
 
 class BGRResv8BitPerColorPixelWriter : public FrameBufferWriter {
   public:
     using FrameBufferWriter::FrameBufferWriter;
     virtual void Write(Vector2D<int> pos, const PixelColor &c) override;
+
+  protected:
+    virtual uint32_t PixelValue(const PixelColor &c) const override {
+        return c.b | c.g << 8 | c.r << 16;
+    }
+    virtual void CopyRow(uint32_t *dst, const uint32_t *src,
+                         int width) const override;
 };
 
 uint32_t GetColorRGB(unsigned char *image_data);
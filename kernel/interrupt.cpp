@@ -10,6 +10,7 @@
 #include "segment.hpp"
 #include "task.hpp"
 #include "timer.hpp"
+#include "workqueue.hpp"
 #include <csignal>
 
 std::array<InterruptDescriptor, 256> idt;
@@ -30,12 +31,12 @@ void NotifyEndOfInterrupt() {
 
 namespace {
 __attribute__((interrupt)) void IntHandlerXHCI(InterruptFrame *frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
+    xhci_workqueue->Queue(xhci_event_work);
     NotifyEndOfInterrupt();
 }
 
 __attribute__((interrupt)) void IntHandlerE1000(InterruptFrame *frame) {
-    task_manager->SendMessage(1, Message{Message::kInterruptE1000});
+    net_workqueue->Queue(e1000_intr_work);
     NotifyEndOfInterrupt();
 }
 
@@ -104,7 +105,7 @@ __attribute__((interrupt)) void IntHandlerPF(InterruptFrame *frame,
 
 FaultHandlerNoError(DE) FaultHandlerNoError(DB) FaultHandlerNoError(BP)
     FaultHandlerNoError(OF) FaultHandlerNoError(BR) FaultHandlerNoError(UD)
-        FaultHandlerNoError(NM) FaultHandlerWithError(DF)
+        FaultHandlerWithError(DF)
             FaultHandlerWithError(TS) FaultHandlerWithError(NP)
                 FaultHandlerWithError(SS) FaultHandlerWithError(GP)
                     FaultHandlerNoError(MF) FaultHandlerWithError(AC)
@@ -129,7 +130,7 @@ void InitializeInterrupt() {
     set_idt_entry(4, IntHandlerOF);
     set_idt_entry(5, IntHandlerBR);
     set_idt_entry(6, IntHandlerUD);
-    set_idt_entry(7, IntHandlerNM);
+    set_idt_entry(7, IntHandlerNM); // 遅延 FPU 切り替え (asmfunc.asm)
     set_idt_entry(8, IntHandlerDF);
     set_idt_entry(10, IntHandlerTS);
     set_idt_entry(11, IntHandlerNP);
@@ -62,6 +62,8 @@ void InitializeKeyboard() {
 		msg.arg.keyboard.keycode = keycode;
 		msg.arg.keyboard.ascii = ascii;
 		msg.arg.keyboard.press = press;
+		__asm__("cli");
 		task_manager->SendMessage(1, msg);
+		__asm__("sti");
 	};
 }
\ No newline at end of file
@@ -13,7 +13,9 @@
 #include <vector>
 
 #include "acpi.hpp"
+#include "app_image.hpp"
 #include "asmfunc.h"
+#include "bootconfig.hpp"
 #include "console.hpp"
 #include "fat.hpp"
 #include "font.hpp"
@@ -37,6 +39,7 @@
 #include "uefi.hpp"
 #include "usb/xhci/xhci.hpp"
 #include "window.hpp"
+#include "workqueue.hpp"
 
 #include "network/network.h"
 #include "network/nic/e1000.h"
@@ -205,6 +208,7 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
 
     /*FATモジュールの初期化*/
     fat::Initialize(volume_image);
+    InitializeBootConfig();
     InitializeFont();
     InitializePCI();
 
@@ -221,14 +225,11 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
     timer_manager->AddTimer(Timer{kTimer05Sec, kTextboxCursorTimer, 1});
     bool textbox_cursor_visible = false;
 
-    const int kNetTimer = 2;
-    const int kTimer01sec = static_cast<int>(kTimerFreq * 0.1);
-    timer_manager->AddTimer(Timer{kTimer01sec, kNetTimer, 1});
-
     InitializeSyscall();
 
     InitializeTask();
     Task &main_task = task_manager->CurrentTask();
+    InitializeWorkQueues();
 
     usb::xhci::Initialize();
     InitializeKeyboard();
@@ -239,7 +240,7 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
     e1000_probe();
     net_run();
 
-    app_loads = new std::map<fat::DirectoryEntry *, AppLoadInfo>;
+    InitializeAppImageCache();
     task_manager->NewTask().InitContext(TaskTerminal, 0).Wakeup();
 
     task_manager->NewTask().InitContext(TaskWallclock, 0).Wakeup();
@@ -268,8 +269,10 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
         __asm__("sti");
 
         switch(msg->type) {
-        case Message::kInterruptXHCI:
-            usb::xhci::ProcessEvents();
+        case Message::kMouseInput:
+            mouse_cursor->OnInterrupt(msg->arg.mouse_input.buttons,
+                                      msg->arg.mouse_input.dx,
+                                      msg->arg.mouse_input.dy);
             break;
         case Message::kTimerTimeout:
             if(msg->arg.timer.value == kTextboxCursorTimer) {
@@ -281,12 +284,6 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
                 textbox_cursor_visible = !textbox_cursor_visible;
                 DrawTextCursor(textbox_cursor_visible);
                 layer_manager->Draw(text_window_layer_id);
-            } else if(msg->arg.timer.value == kNetTimer) {
-                __asm__("cli");
-                timer_manager->AddTimer(
-                    Timer{msg->arg.timer.timeout + kTimer01sec, kNetTimer, 1});
-                __asm__("sti");
-                net_timer_handler();
             }
             break;
 
@@ -323,14 +320,6 @@ KernelMainNewStack(const FrameBufferConfig &frame_buffer_config_ref,
                                       Message{Message::kLayerFinish});
             __asm__("sti");
             break;
-        case Message::kInterruptE1000:
-            e1000_intr();
-            break;
-        case Message::kNetInput:
-            __asm__("cli");
-            net_softirq_handler();
-            __asm__("sti");
-            break;
         default:
             Log(kError, "Unknown message type: %d\n", msg->type);
         }
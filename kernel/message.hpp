@@ -1,10 +1,12 @@
 #pragma once
 
 enum class LayerOperation { Move, MoveRelative, Draw, DrawArea };
+
+struct Work;
+
 struct Message {
     /**メッセージ識別子*/
     enum Type {
-        kInterruptXHCI,
         kTimerTimeout,
         kKeyPush,
         kLayer,
@@ -12,10 +14,11 @@ struct Message {
         kMouseMove,
         kMouseButton,
         kWindowActive,
-        kPipe,
         kWindowClose,
-        kInterruptE1000,
-        kNetInput,
+        kWork,
+        kMouseInput,
+        kShmNotify,
+        kJobOutput,
     } type;
 
     uint64_t src_task;
@@ -58,14 +61,26 @@ struct Message {
             int activate; // 1: activate, 0: deactivate
         } window_active;
 
-        struct {
-            char data[16];
-            uint8_t len;
-        } pipe;
-
         /**layer_idでウィンドウを閉じる*/
         struct {
             unsigned int layer_id;
         } window_close;
+
+        /**ワーカータスクで実行する仕事*/
+        struct {
+            Work *work;
+        } work;
+
+        /**USB マウスからの入力. メインタスクがカーソルを動かす*/
+        struct {
+            uint8_t buttons;
+            int8_t dx, dy;
+        } mouse_input;
+
+        /**共有メモリのドアベル. fd は受け取るタスクでのファイルディスクリプタ*/
+        struct {
+            int fd;
+            uint64_t value;
+        } shm;
     } arg;
 };
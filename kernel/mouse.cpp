@@ -146,6 +146,8 @@ void Mouse::OnInterrupt(uint8_t buttons, int8_t displacement_x,
     previous_buttons_ = buttons;
 }
 
+std::shared_ptr<Mouse> mouse_cursor;
+
 void InitializeMouse() {
     auto mouse_window = std::make_shared<Window>(
         kMouseCursorWidth, kMouseCursorHeight, screen_config.pixel_format);
@@ -159,10 +161,18 @@ void InitializeMouse() {
     mouse->SetPosition({200, 200});
     layer_manager->UpDown(mouse->LayerID(), std::numeric_limits<int>::max());
 
+    // xHCI のワーカータスクから呼ばれるので, レイヤーの操作はメインタスクに任せる
     usb::HIDMouseDriver::default_observer =
-        [mouse](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
-            mouse->OnInterrupt(buttons, displacement_x, displacement_y);
+        [](uint8_t buttons, int8_t displacement_x, int8_t displacement_y) {
+            Message msg{Message::kMouseInput};
+            msg.arg.mouse_input.buttons = buttons;
+            msg.arg.mouse_input.dx = displacement_x;
+            msg.arg.mouse_input.dy = displacement_y;
+            __asm__("cli");
+            task_manager->SendMessage(1, msg);
+            __asm__("sti");
         };
+    mouse_cursor = mouse;
 
     active_layer->SetMouseLayer(mouse_layer_id);
 }
@@ -26,4 +26,7 @@ class Mouse {
     uint8_t previous_buttons_{0};
 };
 
+/** マウスカーソル. Message::kMouseInput を受けたメインタスクが動かす */
+extern std::shared_ptr<Mouse> mouse_cursor;
+
 void InitializeMouse();
\ No newline at end of file
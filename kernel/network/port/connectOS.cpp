@@ -3,14 +3,25 @@
 #include "network/benri.h"
 #include "network/nic/e1000.hpp"
 #include "pci.hpp"
+#include "sync.hpp"
 #include "task.hpp"
 #include "timer.hpp"
+#include "workqueue.hpp"
 #include <cctype>
 #include <cerrno>
 #include <cstdio>
 #include <ctime>
+#include <new>
 #include <sys/time.h>
 
+static_assert(sizeof(mutex_t) == sizeof(Mutex));
+static_assert(sizeof(cond_t) == sizeof(CondVar));
+
+namespace {
+Mutex &AsMutex(mutex_t *mutex) { return *reinterpret_cast<Mutex *>(mutex); }
+CondVar &AsCondVar(cond_t *cond) { return *reinterpret_cast<CondVar *>(cond); }
+} // namespace
+
 void flockfile(FILE *fp) {
     // pass
 }
@@ -20,10 +31,10 @@ void funlockfile(FILE *fp) {
 }
 
 int gettimeofday(struct timeval *tv, void *tz) {
-    unsigned long tick = timer_manager->CurrentTick();
+    const uint64_t ns = CurrentTime();
 
-    tv->tv_sec = tick / kTimerFreq;
-    tv->tv_usec = tick % kTimerFreq * (1000000 / kTimerFreq);
+    tv->tv_sec = ns / 1'000'000'000;
+    tv->tv_usec = ns % 1'000'000'000 / 1000;
     return 0;
 }
 
@@ -87,41 +98,48 @@ void hexdump(FILE *fp, const void *data, size_t size) {
     funlockfile(fp);
 }
 
-int mutex_init(mutex_t *mutex, const void *attr) { return 0; }
+int mutex_init(mutex_t *mutex, const void *attr) {
+    new(mutex) Mutex;
+    return 0;
+}
 
-int mutex_lock(mutex_t *mutex) { return 0; }
+int mutex_lock(mutex_t *mutex) {
+    AsMutex(mutex).Lock();
+    return 0;
+}
 
-int mutex_unlock(mutex_t *mutex) { return 0; }
+int mutex_unlock(mutex_t *mutex) {
+    AsMutex(mutex).Unlock();
+    return 0;
+}
 
 int cond_init(cond_t *cond, const void *attr) {
-    cond->taskid = 0;
-    cond->num = 0;
+    new(cond) CondVar;
     return 0;
 }
 
 int cond_wait(cond_t *cond, mutex_t *mutex) {
-    cond->taskid = task_manager->CurrentTask().ID();
-    cond->num++;
-    task_manager->Sleep(cond->taskid);
-    cond->num--;
+    AsCondVar(cond).Wait(AsMutex(mutex));
     return 0;
 }
 
 int cond_broadcast(cond_t *cond) {
-    task_manager->Wakeup(cond->taskid);
+    AsCondVar(cond).Broadcast();
     return 0;
 }
 
 int cond_destroy(cond_t *cond) {
-    if(cond->num) { return EBUSY; }
-    cond->taskid = 0;
-    cond->num = 0;
+    const auto rflags = DisableInterrupts();
+    const bool busy = AsCondVar(cond).HasWaiters();
+    RestoreInterrupts(rflags);
+    if(busy) {
+        errno = EBUSY;
+        return -1;
+    }
     return 0;
 }
 
-void softirq(void) {
-    task_manager->SendMessage(1, Message{Message::kNetInput});
-}
+void softirq(void) { net_workqueue->Queue(net_softirq_work); }
 
 void e1000_probe(void) {
     for(int i = 0; i < pci::num_device; ++i) {
@@ -15,8 +15,9 @@ extern void hexdump(FILE *fp, const void *data, size_t size);
 #define MUTEX_INITIALIZER                                                      \
     {}
 
+/* kernel/sync.hpp の Mutex. すべて 0 なら未ロック */
 typedef struct {
-    uint8_t _unused;
+    uint64_t _opaque[3];
 } mutex_t;
 
 extern int mutex_init(mutex_t *mutex, const void *attr);
@@ -26,14 +27,15 @@ extern int mutex_unlock(mutex_t *mutex);
 #define COND_INITIALIZER                                                       \
     {}
 
+/* kernel/sync.hpp の CondVar. すべて 0 なら待っているタスクはない */
 typedef struct {
-    uint64_t taskid;
-    uint64_t num;
+    uint64_t _opaque[2];
 } cond_t;
 
 extern int cond_init(cond_t *cond, const void *attr);
 extern int cond_wait(cond_t *cond, mutex_t *mutex);
 extern int cond_broadcast(cond_t *cond);
+/* 待っているタスクがいれば errno に EBUSY を設定して -1 を返す */
 extern int cond_destroy(cond_t *cond);
 
 extern void softirq(void);
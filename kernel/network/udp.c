@@ -116,7 +116,7 @@ static struct udp_pcb *udp_pcb_alloc(void) {
 static void udp_pcb_release(struct udp_pcb *pcb) {
     struct queue_entry *entry;
 
-    if(cond_destroy(&pcb->cond) == EBUSY) {
+    if(cond_destroy(&pcb->cond) == -1) {
         pcb->state = UDP_PCB_STATE_CLOSING;
         cond_broadcast(&pcb->cond);
         return;
@@ -8,6 +8,7 @@
 #include "logger.hpp"
 #include "memory_manager.hpp"
 #include "task.hpp"
+#include <algorithm>
 #include <array>
 
 namespace {
@@ -38,7 +39,9 @@ void SetupIdentityPageTable() {
 
 void InitializePaging() { SetupIdentityPageTable(); }
 
-void ResetCR3() { SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0])); }
+void ResetCR3() { SetCR3(KernelCR3()); }
+
+uint64_t KernelCR3() { return reinterpret_cast<uint64_t>(&pml4_table[0]); }
 
 namespace {
 
@@ -89,26 +92,76 @@ WithError<size_t> SetupPageMap(PageMapEntry *page_map, int page_map_level,
     return {num_4kpages, MAKE_ERROR(Error::kSuccess)};
 }
 
-Error CleanPageMap(PageMapEntry *page_map, int page_map_level,
-                   LinearAddress4Level addr) {
-    for(int i = addr.Part(page_map_level); i < 512; ++i) {
-        auto entry = page_map[i];
+/** 解放するフレームを連続した範囲にまとめ, 範囲ごとに1回だけ Free する */
+class FrameFreeBatch {
+  public:
+    Error Add(uintptr_t addr) {
+        const size_t id = addr / kBytesPerFrame;
+        if(num_frames_ > 0 && id == start_id_ + num_frames_) {
+            ++num_frames_;
+            return MAKE_ERROR(Error::kSuccess);
+        }
+        if(auto err = Flush()) { return err; }
+        start_id_ = id;
+        num_frames_ = 1;
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Error Flush() {
+        if(num_frames_ == 0) { return MAKE_ERROR(Error::kSuccess); }
+        const size_t n = num_frames_;
+        num_frames_ = 0;
+        return memory_manager->Free(FrameID{start_id_}, n);
+    }
+
+  private:
+    size_t start_id_{0};
+    size_t num_frames_{0};
+};
+
+bool IsEmptyPageMap(const PageMapEntry *page_map) {
+    for(int i = 0; i < 512; ++i) {
+        if(page_map[i].bits.present) { return false; }
+    }
+    return true;
+}
+
+/**
+ * page_map の [first, last] にかかるエントリだけを外す.
+ * 書き込み可で共有でない末端のフレームはタスク専用なので解放する.
+ * 範囲が覆ったページテーブルと, 外した結果空になったページテーブルも解放する.
+ */
+Error CleanPageMap(PageMapEntry *page_map, int page_map_level, uint64_t first,
+                   uint64_t last, FrameFreeBatch &frees) {
+    const uint64_t entry_bytes = 1ul << (12 + 9 * (page_map_level - 1));
+    const uint64_t table_base = first & ~((entry_bytes << 9) - 1);
+    const int i_first = LinearAddress4Level{first}.Part(page_map_level);
+    const int i_last = LinearAddress4Level{last}.Part(page_map_level);
+
+    for(int i = i_first; i <= i_last; ++i) {
+        auto &entry = page_map[i];
         if(!entry.bits.present) { continue; }
 
         if(page_map_level > 1) {
-            if(auto err =
-                   CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
+            const uint64_t entry_first = table_base + i * entry_bytes;
+            const uint64_t entry_last = entry_first + (entry_bytes - 1);
+            const uint64_t f = std::max(first, entry_first);
+            const uint64_t l = std::min(last, entry_last);
+            if(auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, f,
+                                       l, frees)) {
                 return err;
             }
+            const bool whole = f == entry_first && l == entry_last;
+            if(!whole && !IsEmptyPageMap(entry.Pointer())) { continue; }
         }
 
-        if(entry.bits.writable) {
-            const auto entry_addr =
-                reinterpret_cast<uintptr_t>(entry.Pointer());
-            const FrameID map_frame{entry_addr / kBytesPerFrame};
-            if(auto err = memory_manager->Free(map_frame, 1)) { return err; }
+        if(entry.bits.writable && !entry.bits.shared) {
+            if(auto err = frees.Add(
+                   reinterpret_cast<uintptr_t>(entry.Pointer()))) {
+                return err;
+            }
         }
-        page_map[i].data = 0;
+        entry.data = 0;
     }
 
     return MAKE_ERROR(Error::kSuccess);
@@ -124,6 +177,76 @@ const FileMapping *FindFileMapping(const std::vector<FileMapping> &fmaps,
     return nullptr;
 }
 
+/** pml4 の addr に対応する末端のエントリ. 途中のページテーブルがなければ作る */
+WithError<PageMapEntry *> LeafEntry(PageMapEntry *pml4,
+                                    LinearAddress4Level addr) {
+    auto page_map = pml4;
+    for(int level = 4; level > 1; --level) {
+        auto &entry = page_map[addr.Part(level)];
+        auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+        if(err) { return {nullptr, err}; }
+        entry.bits.user = 1;
+        entry.bits.writable = true;
+        page_map = child_map;
+    }
+    return {&page_map[addr.Part(1)], MAKE_ERROR(Error::kSuccess)};
+}
+
+const ElfMapping *FindElfMapping(const std::vector<ElfMapping> &emaps,
+                                 uint64_t causal_vaddr) {
+    for(const ElfMapping &m : emaps) {
+        if(m.vaddr_begin <= causal_vaddr && causal_vaddr < m.vaddr_end) {
+            return &m;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * ELF のセグメントを含むページを用意する. ファイルの内容を含むページは
+ * CacheElfPage でページキャッシュから読み取り専用で共有する.
+ * 0 だけのページ(.bss)はタスクごとに確保する.
+ */
+Error PrepareElfPage(const std::vector<ElfMapping> &emaps,
+                     uint64_t causal_vaddr) {
+    const uint64_t page = causal_vaddr & 0xffff'ffff'ffff'f000;
+    auto [frame, err] = CacheElfPage(emaps, page);
+    if(err) { return err; }
+    if(frame == 0) { return SetupPageMaps(LinearAddress4Level{page}, 1); }
+
+    const auto pml4 = reinterpret_cast<PageMapEntry *>(GetCR3());
+    return MapPage(pml4, LinearAddress4Level{page}, frame, false);
+}
+
+size_t CountPageMapFrames(const PageMapEntry *page_map, int page_map_level,
+                          int start) {
+    size_t n = 0;
+    for(int i = start; i < 512; ++i) {
+        if(!page_map[i].bits.present) { continue; }
+        ++n;
+        if(page_map_level > 1) {
+            n += CountPageMapFrames(page_map[i].Pointer(), page_map_level - 1,
+                                    0);
+        }
+    }
+    return n;
+}
+
+Error FreePageMapFrames(PageMapEntry *page_map, int page_map_level, int start) {
+    for(int i = start; i < 512; ++i) {
+        if(!page_map[i].bits.present) { continue; }
+        if(page_map_level > 1) {
+            if(auto err = FreePageMapFrames(page_map[i].Pointer(),
+                                            page_map_level - 1, 0)) {
+                return err;
+            }
+        }
+        if(auto err = FreePageMap(page_map[i].Pointer())) { return err; }
+        page_map[i].data = 0;
+    }
+    return MAKE_ERROR(Error::kSuccess);
+}
+
 Error PreparePageCache(FileDescriptor &fd, const FileMapping &m,
                        uint64_t causal_vaddr) {
     LinearAddress4Level page_vaddr{causal_vaddr};
@@ -181,9 +304,110 @@ Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
     return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
-Error CleanPageMaps(LinearAddress4Level addr) {
-    auto pml4_table = reinterpret_cast<PageMapEntry *>(GetCR3());
-    return CleanPageMap(pml4_table, 4, addr);
+Error MapPage(PageMapEntry *pml4, LinearAddress4Level addr,
+              uintptr_t frame_addr, bool writable) {
+    auto [entry, err] = LeafEntry(pml4, addr);
+    if(err) { return err; }
+    entry->data = 0;
+    entry->SetPointer(reinterpret_cast<PageMapEntry *>(frame_addr));
+    entry->bits.present = 1;
+    entry->bits.user = 1;
+    entry->bits.writable = writable;
+    InvalidateTLB(addr.value);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+uintptr_t LookupPage(PageMapEntry *pml4, LinearAddress4Level addr) {
+    auto page_map = pml4;
+    for(int level = 4; level > 1 && page_map; --level) {
+        const auto &entry = page_map[addr.Part(level)];
+        page_map = entry.bits.present ? entry.Pointer() : nullptr;
+    }
+    if(page_map == nullptr || !page_map[addr.Part(1)].bits.present) {
+        return 0;
+    }
+    return reinterpret_cast<uintptr_t>(page_map[addr.Part(1)].Pointer());
+}
+
+WithError<uintptr_t> CacheElfPage(const std::vector<ElfMapping> &emaps,
+                                  uint64_t page) {
+    const uint64_t page_end = page + kPageSize4K;
+    const LinearAddress4Level page_addr{page};
+
+    PageMapEntry *page_cache = nullptr;
+    for(const auto &m : emaps) {
+        if(m.vaddr_begin < m.file_vaddr_end && m.vaddr_begin < page_end &&
+           page < m.file_vaddr_end) {
+            page_cache = m.page_cache;
+        }
+    }
+    if(page_cache == nullptr) { return {0, MAKE_ERROR(Error::kSuccess)}; }
+
+    if(const auto frame = LookupPage(page_cache, page_addr)) {
+        return {frame, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    auto [p, err] = NewPageMap();
+    if(err) { return {0, err}; }
+    auto dst = reinterpret_cast<uint8_t *>(p);
+    for(const auto &m : emaps) {
+        const uint64_t begin = std::max(page, m.vaddr_begin);
+        const uint64_t end = std::min(page_end, m.file_vaddr_end);
+        if(begin >= end) { continue; }
+        fat::FileDescriptor fd{*m.file};
+        fd.Load(&dst[begin - page], end - begin,
+                m.file_offset + (begin - m.vaddr_begin));
+    }
+
+    const auto frame = reinterpret_cast<uintptr_t>(p);
+    if(auto err = MapPage(page_cache, page_addr, frame, false)) {
+        FreePageMap(p);
+        return {0, err};
+    }
+    return {frame, MAKE_ERROR(Error::kSuccess)};
+}
+
+size_t CountPageCacheFrames(const PageMapEntry *page_cache) {
+    return CountPageMapFrames(page_cache, 4, 256) + 1;
+}
+
+Error FreePageCache(PageMapEntry *page_cache) {
+    if(auto err = FreePageMapFrames(page_cache, 4, 256)) { return err; }
+    return FreePageMap(page_cache);
+}
+
+Error MapSharedPage(LinearAddress4Level addr, uintptr_t frame_addr,
+                    bool writable) {
+    auto pml4 = reinterpret_cast<PageMapEntry *>(GetCR3());
+    if(auto err = MapPage(pml4, addr, frame_addr, writable)) { return err; }
+    LeafEntry(pml4, addr).value->bits.shared = 1;
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void UnmapPages(LinearAddress4Level addr, size_t num_4kpages) {
+    for(; num_4kpages > 0; --num_4kpages, addr.value += kPageSize4K) {
+        auto page_map = reinterpret_cast<PageMapEntry *>(GetCR3());
+        for(int level = 4; level > 1 && page_map; --level) {
+            const auto &entry = page_map[addr.Part(level)];
+            page_map = entry.bits.present ? entry.Pointer() : nullptr;
+        }
+        if(page_map == nullptr) { continue; }
+
+        page_map[addr.Part(1)].data = 0;
+        InvalidateTLB(addr.value);
+    }
+}
+
+Error CleanPageMaps(PageMapEntry *pml4, LinearAddress4Level addr,
+                    size_t num_4kpages) {
+    if(num_4kpages == 0) { return MAKE_ERROR(Error::kSuccess); }
+    const uint64_t last = addr.value + (num_4kpages * kPageSize4K - 1);
+    FrameFreeBatch frees;
+    if(auto err = CleanPageMap(pml4, 4, addr.value, last, frees)) {
+        frees.Flush();
+        return err;
+    }
+    return frees.Flush();
 }
 
 Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start) {
@@ -225,6 +449,12 @@ Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
         return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
     }
 
+    // スレッドはアプリを起動したタスクの ELF を共有する
+    Task &owner = task.Leader() ? *task.Leader() : task;
+    if(FindElfMapping(owner.ElfMaps(), causal_addr)) {
+        return PrepareElfPage(owner.ElfMaps(), causal_addr);
+    }
+
     if(auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
         return PreparePageCache(*task.Files()[m->fd], *m, causal_addr);
     }
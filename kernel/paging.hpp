@@ -2,6 +2,7 @@
 #include "error.hpp"
 #include <cstddef>
 #include <cstdint>
+#include <vector>
 
 const size_t kPageDirectoryCount = 64;
 
@@ -9,6 +10,8 @@ void SetupIdentityPageTable();
 
 void InitializePaging();
 void ResetCR3();
+/** アプリを実行していないときの(カーネルだけを写像した) CR3 の値 */
+uint64_t KernelCR3();
 
 union LinearAddress4Level {
     uint64_t value;
@@ -73,7 +76,8 @@ union PageMapEntry {
         uint64_t dirty : 1;
         uint64_t huge_page : 1;
         uint64_t global : 1;
-        uint64_t : 3;
+        uint64_t shared : 1; // 他と共有するフレーム. CleanPageMaps で解放しない
+        uint64_t : 2;
 
         uint64_t addr : 40;
         uint64_t : 12;
@@ -92,6 +96,40 @@ WithError<PageMapEntry *> NewPageMap();
 Error FreePageMap(PageMapEntry *table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable = true);
-Error CleanPageMaps(LinearAddress4Level addr);
+/**
+ * 確保済みのフレームを pml4 のページテーブルの addr に写像する.
+ * 途中のページテーブルがなければ作る. 現在のアドレス空間でなくてもよい.
+ */
+Error MapPage(PageMapEntry *pml4, LinearAddress4Level addr,
+              uintptr_t frame_addr, bool writable);
+/** pml4 のページテーブルで addr に写像されているフレームのアドレス. なければ 0 */
+uintptr_t LookupPage(PageMapEntry *pml4, LinearAddress4Level addr);
+/**
+ * 確保済みのフレームを現在のアドレス空間の addr に写像する.
+ * shared ビットを立てるので CleanPageMaps はこのフレームを解放しない.
+ */
+Error MapSharedPage(LinearAddress4Level addr, uintptr_t frame_addr,
+                    bool writable);
+/** addr からのページの写像を外す. フレームは解放しない */
+void UnmapPages(LinearAddress4Level addr, size_t num_4kpages);
+/**
+ * pml4 の addr から num_4kpages ページの写像を外し, タスク専用のフレーム
+ * (書き込み可で shared でないもの)と使わなくなったページテーブルを解放する.
+ * 範囲外のエントリは走査しない. TLB は消さないので, 現在使っていない pml4 に対して呼ぶ.
+ */
+Error CleanPageMaps(PageMapEntry *pml4, LinearAddress4Level addr,
+                    size_t num_4kpages);
 Error CopyPageMaps(PageMapEntry *dest, PageMapEntry *src, int part, int start);
+
+struct ElfMapping;
+/**
+ * emaps のうちファイルの内容を含む page をページキャッシュ(ElfMapping::page_cache)に読み込み,
+ * そのフレームのアドレスを返す. 読み込み済みならそのフレーム. ファイルの内容を含まないページなら 0
+ */
+WithError<uintptr_t> CacheElfPage(const std::vector<ElfMapping> &emaps,
+                                  uint64_t page);
+/** ページキャッシュ(上位半分だけを使うページテーブル)が持つフレームの数. ページテーブル自身を含む */
+size_t CountPageCacheFrames(const PageMapEntry *page_cache);
+/** ページキャッシュを, 写像しているフレームとページテーブルごと解放する */
+Error FreePageCache(PageMapEntry *page_cache);
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
@@ -0,0 +1,174 @@
+#include "shm.hpp"
+
+#include "asmfunc.h"
+#include "logger.hpp"
+#include "message.hpp"
+#include "paging.hpp"
+#include "sync.hpp"
+#include "task.hpp"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+
+namespace {
+/** 名前から共有メモリへの表. ShmObject のデストラクタが自分を消す */
+std::map<std::string, std::weak_ptr<ShmObject>> *shm_objects;
+/** 生きている ShmDescriptor. RTTI を使わずに fd の種類を見分けるのに使う */
+std::set<FileDescriptor *> *shm_descriptors;
+} // namespace
+
+ShmObject::ShmObject(const std::string &name, FrameID frame,
+                     size_t num_frames)
+    : name_{name}, frame_{frame}, num_frames_{num_frames} {}
+
+ShmObject::~ShmObject() {
+    // 同じ名前で作り直されていれば, 新しい方を消さない
+    const auto rflags = DisableInterrupts();
+    if(auto it = shm_objects->find(name_);
+       it != shm_objects->end() && it->second.expired()) {
+        shm_objects->erase(it);
+    }
+    RestoreInterrupts(rflags);
+    memory_manager->Free(frame_, num_frames_);
+}
+
+void ShmObject::AddOpener(uint64_t task_id, int fd) {
+    openers_.push_back(Opener{task_id, fd});
+}
+
+void ShmObject::RemoveOpener(uint64_t task_id, int fd) {
+    auto it = std::find_if(openers_.begin(), openers_.end(),
+                           [&](const Opener &o) {
+                               return o.task_id == task_id && o.fd == fd;
+                           });
+    if(it != openers_.end()) { openers_.erase(it); }
+}
+
+int ShmObject::Notify(uint64_t src_task, uint64_t value) {
+    int sent = 0;
+    for(const auto &o : openers_) {
+        if(o.task_id == src_task) { continue; }
+        Message msg{Message::kShmNotify, src_task};
+        msg.arg.shm.fd = o.fd;
+        msg.arg.shm.value = value;
+        if(!task_manager->SendMessage(o.task_id, msg)) { ++sent; }
+    }
+    return sent;
+}
+
+WithError<std::shared_ptr<ShmObject>> OpenShm(const char *name, size_t bytes,
+                                              bool create, bool exclusive) {
+    auto rflags = DisableInterrupts();
+    if(shm_objects == nullptr) {
+        shm_objects = new std::map<std::string, std::weak_ptr<ShmObject>>;
+    }
+    std::shared_ptr<ShmObject> shm;
+    if(auto it = shm_objects->find(name); it != shm_objects->end()) {
+        shm = it->second.lock();
+    }
+    RestoreInterrupts(rflags);
+
+    if(shm) {
+        if(exclusive) {
+            return {nullptr, MAKE_ERROR(Error::kAlreadyAllocated)};
+        }
+        if(bytes > shm->Bytes()) {
+            return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)};
+        }
+        return {shm, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    if(!create) { return {nullptr, MAKE_ERROR(Error::kNoSuchEntry)}; }
+    if(bytes == 0) { return {nullptr, MAKE_ERROR(Error::kIndexOutOfRange)}; }
+
+    const size_t num_frames = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    auto [frame, err] = memory_manager->Allocate(num_frames);
+    if(err) { return {nullptr, err}; }
+    memset(frame.Frame(), 0, num_frames * kBytesPerFrame);
+
+    shm = std::make_shared<ShmObject>(name, frame, num_frames);
+    rflags = DisableInterrupts();
+    (*shm_objects)[name] = shm;
+    RestoreInterrupts(rflags);
+    return {shm, MAKE_ERROR(Error::kSuccess)};
+}
+
+ShmDescriptor::ShmDescriptor(std::shared_ptr<ShmObject> shm, uint64_t task_id,
+                             int fd)
+    : shm_{std::move(shm)}, task_id_{task_id}, fd_{fd} {
+    const auto rflags = DisableInterrupts();
+    if(shm_descriptors == nullptr) {
+        shm_descriptors = new std::set<FileDescriptor *>;
+    }
+    shm_descriptors->insert(this);
+    shm_->AddOpener(task_id_, fd_);
+    RestoreInterrupts(rflags);
+}
+
+ShmDescriptor::~ShmDescriptor() {
+    Unmap();
+    const auto rflags = DisableInterrupts();
+    shm_descriptors->erase(this);
+    shm_->RemoveOpener(task_id_, fd_);
+    RestoreInterrupts(rflags);
+}
+
+size_t ShmDescriptor::Load(void *buf, size_t len, size_t offset) {
+    if(offset >= shm_->Bytes()) { return 0; }
+    len = std::min(len, shm_->Bytes() - offset);
+    memcpy(buf, &shm_->Data()[offset], len);
+    return len;
+}
+
+WithError<uint64_t> ShmDescriptor::Map(Task &task) {
+    const uint64_t cr3 = GetCR3();
+    if(map_addr_ != 0 && map_cr3_ == cr3) {
+        return {map_addr_, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    const size_t bytes = shm_->Bytes();
+    const auto rflags = DisableInterrupts();
+    const uint64_t vaddr_begin = task.AllocateFileMapRange(bytes);
+    if(vaddr_begin == 0) {
+        RestoreInterrupts(rflags);
+        return {0, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    for(size_t off = 0; off < bytes; off += kBytesPerFrame) {
+        const auto addr = LinearAddress4Level{vaddr_begin + off};
+        const auto frame = reinterpret_cast<uintptr_t>(shm_->Data()) + off;
+        if(auto err = MapSharedPage(addr, frame, true)) {
+            UnmapPages(LinearAddress4Level{vaddr_begin}, off / kBytesPerFrame);
+            task.FreeFileMapRange(vaddr_begin, bytes);
+            RestoreInterrupts(rflags);
+            return {0, err};
+        }
+    }
+    RestoreInterrupts(rflags);
+
+    map_addr_ = vaddr_begin;
+    map_cr3_ = cr3;
+    return {map_addr_, MAKE_ERROR(Error::kSuccess)};
+}
+
+void ShmDescriptor::Unmap() {
+    if(map_addr_ == 0 || map_cr3_ != GetCR3()) { return; }
+    UnmapPages(LinearAddress4Level{map_addr_}, shm_->Bytes() / kBytesPerFrame);
+    // アドレス空間が同じなら現在のタスクは写像したアプリのもの
+    const auto rflags = DisableInterrupts();
+    task_manager->CurrentTask().FreeFileMapRange(map_addr_, shm_->Bytes());
+    RestoreInterrupts(rflags);
+    map_addr_ = 0;
+    map_cr3_ = 0;
+}
+
+ShmDescriptor *FindShmDescriptor(Task &task, int fd) {
+    if(fd < 0 || task.Files().size() <= fd || !task.Files()[fd]) {
+        return nullptr;
+    }
+    auto desc = task.Files()[fd].get();
+    const auto rflags = DisableInterrupts();
+    const bool is_shm = shm_descriptors && shm_descriptors->count(desc) > 0;
+    RestoreInterrupts(rflags);
+    return is_shm ? static_cast<ShmDescriptor *>(desc) : nullptr;
+}
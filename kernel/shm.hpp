@@ -0,0 +1,94 @@
+/**
+ * @file shm.hpp
+ *
+ * アプリ間の名前付き共有メモリ.
+ * 連続した物理フレームを確保し, 開いたアプリのアドレス空間にそれぞれ写像する.
+ */
+#pragma once
+#include "error.hpp"
+#include "file.hpp"
+#include "memory_manager.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Task;
+
+/**
+ * 名前付き共有メモリの実体.
+ * ShmDescriptor が shared_ptr で参照し, 最後の参照が外れたときにフレームを解放して名前を消す.
+ * 名前は開いているアプリがある間だけ残る.
+ */
+class ShmObject {
+  public:
+    static const size_t kMaxNameLen = 31;
+
+    ShmObject(const std::string &name, FrameID frame, size_t num_frames);
+    ~ShmObject();
+    ShmObject(const ShmObject &) = delete;
+    ShmObject &operator=(const ShmObject &) = delete;
+
+    const std::string &Name() const { return name_; }
+    uint8_t *Data() const {
+        return reinterpret_cast<uint8_t *>(frame_.Frame());
+    }
+    size_t Bytes() const { return num_frames_ * kBytesPerFrame; }
+
+    /** 割り込み禁止で呼ぶ. task_id(アプリのリーダー)が fd で開いたことを登録する */
+    void AddOpener(uint64_t task_id, int fd);
+    /** 割り込み禁止で呼ぶ */
+    void RemoveOpener(uint64_t task_id, int fd);
+    /**
+     * 割り込み禁止で呼ぶ. src_task 以外の開いているタスクに
+     * kShmNotify メッセージを送り, 送った数を返す.
+     */
+    int Notify(uint64_t src_task, uint64_t value);
+
+  private:
+    struct Opener {
+        uint64_t task_id;
+        int fd;
+    };
+
+    std::string name_;
+    FrameID frame_;
+    size_t num_frames_;
+    std::vector<Opener> openers_{};
+};
+
+/**
+ * name の共有メモリを探す. 無く, create が true なら bytes(ページ単位に切り上げる)で作る.
+ * exclusive が true なら既にあるときに失敗する.
+ */
+WithError<std::shared_ptr<ShmObject>> OpenShm(const char *name, size_t bytes,
+                                              bool create, bool exclusive);
+
+/** アプリが開いた共有メモリのファイルディスクリプタ. Load で内容を読める */
+class ShmDescriptor : public FileDescriptor {
+  public:
+    ShmDescriptor(std::shared_ptr<ShmObject> shm, uint64_t task_id, int fd);
+    ~ShmDescriptor() override;
+    size_t Read(void *buf, size_t len) override { return 0; }
+    size_t Write(const void *buf, size_t len) override { return 0; }
+    size_t Size() const override { return shm_->Bytes(); }
+    size_t Load(void *buf, size_t len, size_t offset) override;
+
+    ShmObject &Object() const { return *shm_; }
+    /** task の FileMapEnd の下に写像し, その先頭アドレスを返す. 写像済みならそのアドレス */
+    WithError<uint64_t> Map(Task &task);
+    /**
+     * 写像を外し, 使っていたアドレスの範囲を現在のタスクに返す.
+     * 写像したアドレス空間が現在のものでなければ何もしない.
+     */
+    void Unmap();
+
+  private:
+    std::shared_ptr<ShmObject> shm_;
+    uint64_t task_id_;
+    int fd_;
+    uint64_t map_addr_{0}, map_cr3_{0};
+};
+
+/** task の fd が共有メモリならその ShmDescriptor を返す. そうでなければ nullptr */
+ShmDescriptor *FindShmDescriptor(Task &task, int fd);
@@ -0,0 +1,154 @@
+#include "sync.hpp"
+#include "asmfunc.h"
+#include "task.hpp"
+#include <map>
+#include <utility>
+
+void WaitQueue::Wait() {
+    Task &task = task_manager->CurrentTask();
+    Node node{&task, nullptr, false};
+    if(tail_) {
+        tail_->next = &node;
+    } else {
+        head_ = &node;
+    }
+    tail_ = &node;
+    task.SetWaitingOn(this);
+
+    while(!node.woken) { task_manager->Sleep(&task); }
+}
+
+int WaitQueue::Wake(int n) {
+    int woken = 0;
+    while(head_ && woken < n) {
+        Node *node = head_;
+        head_ = node->next;
+        if(head_ == nullptr) { tail_ = nullptr; }
+
+        Task *task = node->task;
+        task->SetWaitingOn(nullptr);
+        node->woken = true; // これ以降 node は待っているタスクが破棄しうる
+        task_manager->Wakeup(task);
+        ++woken;
+    }
+    return woken;
+}
+
+void WaitQueue::Remove(Task *task) {
+    Node *prev = nullptr;
+    for(Node *node = head_; node; prev = node, node = node->next) {
+        if(node->task != task) { continue; }
+        if(prev) {
+            prev->next = node->next;
+        } else {
+            head_ = node->next;
+        }
+        if(tail_ == node) { tail_ = prev; }
+        task->SetWaitingOn(nullptr);
+        return;
+    }
+}
+
+void WaitQueue::Clear() {
+    for(Node *node = head_; node; node = node->next) {
+        node->task->SetWaitingOn(nullptr);
+    }
+    head_ = tail_ = nullptr;
+}
+
+int WaitQueue::WakeAll() {
+    int woken = 0;
+    while(!Empty()) { woken += Wake(1); }
+    return woken;
+}
+
+void Mutex::Lock() {
+    const auto rflags = DisableInterrupts();
+    const uint64_t id = task_manager->CurrentTask().ID();
+    while(owner_ != 0) { waiters_.Wait(); }
+    owner_ = id;
+    RestoreInterrupts(rflags);
+}
+
+bool Mutex::TryLock() {
+    const auto rflags = DisableInterrupts();
+    const bool locked = owner_ == 0;
+    if(locked) { owner_ = task_manager->CurrentTask().ID(); }
+    RestoreInterrupts(rflags);
+    return locked;
+}
+
+void Mutex::Unlock() {
+    const auto rflags = DisableInterrupts();
+    owner_ = 0;
+    waiters_.Wake(1);
+    RestoreInterrupts(rflags);
+}
+
+void CondVar::Wait(Mutex &mutex) {
+    // 解放から眠るまで割り込みを禁止するので, その間の Signal を取りこぼさない
+    const auto rflags = DisableInterrupts();
+    mutex.Unlock();
+    waiters_.Wait();
+    mutex.Lock();
+    RestoreInterrupts(rflags);
+}
+
+void CondVar::Signal() {
+    const auto rflags = DisableInterrupts();
+    waiters_.Wake(1);
+    RestoreInterrupts(rflags);
+}
+
+void CondVar::Broadcast() {
+    const auto rflags = DisableInterrupts();
+    waiters_.WakeAll();
+    RestoreInterrupts(rflags);
+}
+
+namespace {
+using FutexKey = std::pair<uint64_t, uint64_t>; // (CR3, アドレス)
+std::map<FutexKey, WaitQueue> *futex_queues;
+} // namespace
+
+bool FutexWait(const volatile uint32_t *addr, uint32_t val) {
+    const auto rflags = DisableInterrupts();
+    if(*addr != val) {
+        RestoreInterrupts(rflags);
+        return false;
+    }
+
+    if(futex_queues == nullptr) {
+        futex_queues = new std::map<FutexKey, WaitQueue>;
+    }
+    const FutexKey key{GetCR3(), reinterpret_cast<uint64_t>(addr)};
+    (*futex_queues)[key].Wait();
+    RestoreInterrupts(rflags);
+    return true;
+}
+
+int FutexWake(const volatile uint32_t *addr, int n) {
+    const auto rflags = DisableInterrupts();
+    int woken = 0;
+    const FutexKey key{GetCR3(), reinterpret_cast<uint64_t>(addr)};
+    if(futex_queues) {
+        if(auto it = futex_queues->find(key); it != futex_queues->end()) {
+            woken = it->second.Wake(n);
+            if(it->second.Empty()) { futex_queues->erase(it); }
+        }
+    }
+    RestoreInterrupts(rflags);
+    return woken;
+}
+
+void FutexForget(uint64_t cr3) {
+    const auto rflags = DisableInterrupts();
+    if(futex_queues) {
+        auto it = futex_queues->lower_bound(FutexKey{cr3, 0});
+        while(it != futex_queues->end() && it->first.first == cr3) {
+            it->second.Clear();
+            it = futex_queues->erase(it);
+        }
+    }
+    RestoreInterrupts(rflags);
+}
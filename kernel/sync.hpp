@@ -0,0 +1,91 @@
+/**
+ * @file sync.hpp
+ *
+ * タスク間の同期機構(待ち行列, ミューテックス, 条件変数, futex)
+ */
+#pragma once
+#include <cstdint>
+
+class Task;
+
+/** 割り込みを禁止し, 禁止する前の RFLAGS を返す */
+inline uint64_t DisableInterrupts() {
+    uint64_t rflags;
+    __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(rflags)::"memory");
+    return rflags;
+}
+
+/** DisableInterrupts() の前に割り込みが許可されていれば許可に戻す */
+inline void RestoreInterrupts(uint64_t rflags) {
+    if(rflags & 0x200) { __asm__ volatile("sti" ::: "memory"); }
+}
+
+/**
+ * 眠っているタスクの待ち行列.
+ * 待つタスクのスタック上にノードを置くのでメモリを確保しない.
+ * すべての操作は割り込み禁止で呼ぶ.
+ * すべてのメンバが 0 の状態が空の待ち行列になる.
+ */
+class WaitQueue {
+  public:
+    /**
+     * 現在のタスクを末尾に登録して Wake されるまで眠る.
+     * メッセージなど他の理由で起こされても Wake されるまでは戻らない.
+     * 戻った後は待ち行列に触れないので, 起こした側が待ち行列を破棄してよい.
+     */
+    void Wait();
+    /** 先頭から最大 n 個のタスクを起こし, 起こした数を返す */
+    int Wake(int n = 1);
+    int WakeAll();
+    bool Empty() const { return head_ == nullptr; }
+    /** task を起こさずに待ち行列から外す. 待っているタスクを強制終了するときに使う */
+    void Remove(Task *task);
+    /** 待っているタスクを起こさずにすべて外す. 待ち行列を破棄する前に使う */
+    void Clear();
+
+  private:
+    struct Node {
+        Task *task;
+        Node *next;
+        volatile bool woken;
+    };
+    Node *head_{nullptr}, *tail_{nullptr};
+};
+
+/** 所有者のいるスリープ型ロック. 割り込みハンドラからは使えない */
+class Mutex {
+  public:
+    void Lock();
+    bool TryLock();
+    void Unlock();
+    /** ロックしているタスクの ID. 0 なら未ロック */
+    uint64_t Owner() const { return owner_; }
+
+  private:
+    uint64_t owner_{0};
+    WaitQueue waiters_{};
+
+    friend class CondVar;
+};
+
+class CondVar {
+  public:
+    /** mutex を解放して Signal/Broadcast を待ち, 再びロックして戻る */
+    void Wait(Mutex &mutex);
+    void Signal();
+    void Broadcast();
+    bool HasWaiters() const { return !waiters_.Empty(); }
+
+  private:
+    WaitQueue waiters_{};
+};
+
+/**
+ * 現在のアドレス空間の addr が val のままなら FutexWake されるまで眠る.
+ * 値が異なれば眠らずに false を返す. (CR3, addr) の組で待ち行列を区別する.
+ */
+bool FutexWait(const volatile uint32_t *addr, uint32_t val);
+/** addr で待っているタスクを最大 n 個起こし, 起こした数を返す */
+int FutexWake(const volatile uint32_t *addr, int n);
+/** アドレス空間 cr3 を破棄する前に呼ぶ. そこで待っていたタスクの登録をすべて捨てる */
+void FutexForget(uint64_t cr3);
@@ -1,14 +1,22 @@
 #include "syscall.hpp"
 #include "app_event.hpp"
 #include "asmfunc.h"
+#include "draw_batch.hpp"
 #include "font.hpp"
 #include "keyboard.hpp"
 #include "logger.hpp"
 #include "msr.hpp"
 #include "network/socket.h"
+#include "paging.hpp"
+#include "shm.hpp"
+#include "sync.hpp"
+#include "syscall_ring.hpp"
+#include "syscall_trace.hpp"
 #include "task.hpp"
 #include "terminal.hpp"
 #include "timer.hpp"
+#include "window_surface.hpp"
+#include <algorithm>
 #include <array>
 #include <cerrno>
 #include <cmath>
@@ -122,57 +130,327 @@ SYSCALL(WinFillRectangle) {
         arg1, arg2, arg3, arg4, arg5, arg6);
 }
 
+SYSCALL(WinMapSurface) {
+    const unsigned int layer_id = arg1 & 0xffffffff;
+    if(arg2 < 0xffff'8000'0000'0000) { return {0, EFAULT}; }
+    auto info = reinterpret_cast<WinSurface *>(arg2);
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    auto layer = layer_manager->FindLayer(layer_id);
+    if(layer == nullptr) {
+        __asm__("sti");
+        return {0, EBADF};
+    }
+    auto &win = *layer->GetWindow();
+
+    const uint64_t cr3 = GetCR3();
+    if(win.SurfaceMapCR3() != cr3) {
+        auto [surface, err] = win.SharedSurface();
+        if(err) {
+            __asm__("sti");
+            return {0, ENOMEM};
+        }
+
+        const size_t bytes = win.SharedSurfaceBytes();
+        const uint64_t vaddr_begin = task.AllocateFileMapRange(bytes);
+        if(vaddr_begin == 0) {
+            __asm__("sti");
+            return {0, ENOMEM};
+        }
+        for(size_t off = 0; off < bytes; off += 4096) {
+            const auto addr = LinearAddress4Level{vaddr_begin + off};
+            const auto frame = reinterpret_cast<uintptr_t>(surface) + off;
+            if(auto err = MapSharedPage(addr, frame, true)) {
+                UnmapPages(LinearAddress4Level{vaddr_begin}, off / 4096);
+                task.FreeFileMapRange(vaddr_begin, bytes);
+                __asm__("sti");
+                return {0, ENOMEM};
+            }
+        }
+        win.SetSurfaceMap(cr3, vaddr_begin);
+    }
+    const auto &config = win.SurfaceConfig();
+    __asm__("sti");
+
+    info->pixels = reinterpret_cast<uint8_t *>(win.SurfaceMapAddr());
+    info->width = win.Width();
+    info->height = win.Height();
+    info->bytes_per_scan_line = 4 * config.pixels_per_scan_line;
+    info->pixel_format = config.pixel_format;
+    return {win.SurfaceMapAddr(), 0};
+}
+
+SYSCALL(WinCommit) {
+    const unsigned int layer_id = arg1 & 0xffffffff;
+    const int x = arg2, y = arg3, w = arg4, h = arg5;
+
+    __asm__("cli");
+    if(layer_manager->FindLayer(layer_id) == nullptr) {
+        __asm__("sti");
+        return {0, EBADF};
+    }
+    if(w <= 0 || h <= 0) {
+        layer_manager->Draw(layer_id);
+    } else {
+        layer_manager->Draw(layer_id, {{x, y}, {w, h}});
+    }
+    __asm__("sti");
+    return {0, 0};
+}
+
 SYSCALL(GetCurrentTick) { return {timer_manager->CurrentTick(), kTimerFreq}; }
 
+SYSCALL(GetTimeNs) { return {CurrentTime(), 0}; }
+
 SYSCALL(WinRedraw) {
     return DoWinFunc([](Window &) { return Result{0, 0}; }, arg1);
 }
 
+namespace {
+void DrawLineSegment(PixelWriter &writer, int x0, int y0, int x1, int y1,
+                     uint32_t color) {
+    auto sign = [](int x) { return (x > 0) ? 1 : (x < 0) ? -1 : 0; };
+    const int dx = x1 - x0 + sign(x1 - x0);
+    const int dy = y1 - y0 + sign(y1 - y0);
+
+    if(dx == 0 && dy == 0) {
+        writer.Write({x0, y0}, ToColor(color));
+        return;
+    }
+
+    const auto floord = static_cast<double (*)(double)>(floor);
+    const auto ceild = static_cast<double (*)(double)>(ceil);
+
+    if(abs(dx) >= abs(dy)) {
+        if(dx < 0) {
+            std::swap(x0, x1);
+            std::swap(y0, y1);
+        }
+        const auto roundish = y1 >= y0 ? floord : ceild;
+        const double m = static_cast<double>(dy) / dx;
+        for(int x = x0; x <= x1; ++x) {
+            const int y = roundish(m * (x - x0) + y0);
+            writer.Write({x, y}, ToColor(color));
+        }
+    } else {
+        if(dy < 0) {
+            std::swap(x0, x1);
+            std::swap(y0, y1);
+        }
+        const auto roundish = x1 >= x0 ? floord : ceild;
+        const double m = static_cast<double>(dx) / dy;
+        for(int y = y0; y <= y1; ++y) {
+            const int x = roundish(m * (y - y0) + x0);
+            writer.Write({x, y}, ToColor(color));
+        }
+    }
+}
+} // namespace
+
 SYSCALL(WinDrawLine) {
     return DoWinFunc(
         [](Window &win, int x0, int y0, int x1, int y1, uint32_t color) {
-            auto sign = [](int x) { return (x > 0) ? 1 : (x < 0) ? -1 : 0; };
-            const int dx = x1 - x0 + sign(x1 - x0);
-            const int dy = y1 - y0 + sign(y1 - y0);
-
-            if(dx == 0 && dy == 0) {
-                win.Writer()->Write({x0, y0}, ToColor(color));
-                return Result{0, 0};
-            }
-
-            const auto floord = static_cast<double (*)(double)>(floor);
-            const auto ceild = static_cast<double (*)(double)>(ceil);
-
-            if(abs(dx) >= abs(dy)) {
-                if(dx < 0) {
-                    std::swap(x0, x1);
-                    std::swap(y0, y1);
-                }
-                const auto roundish = y1 >= y0 ? floord : ceild;
-                const double m = static_cast<double>(dy) / dx;
-                for(int x = x0; x <= x1; ++x) {
-                    const int y = roundish(m * (x - x0) + y0);
-                    win.Writer()->Write({x, y}, ToColor(color));
-                }
-            } else {
-                if(dy < 0) {
-                    std::swap(x0, x1);
-                    std::swap(y0, y1);
-                }
-                const auto roundish = x1 >= x0 ? floord : ceild;
-                const double m = static_cast<double>(dx) / dy;
-                for(int y = y0; y <= y1; ++y) {
-                    const int x = roundish(m * (y - y0) + x0);
-                    win.Writer()->Write({x, y}, ToColor(color));
-                }
-            }
+            DrawLineSegment(*win.Writer(), x0, y0, x1, y1, color);
             return Result{0, 0};
         },
         arg1, arg2, arg3, arg4, arg5, arg6);
 }
 
+namespace {
+/** ウィンドウの外に出る画素を捨てる */
+class ClippedWriter : public PixelWriter {
+  public:
+    ClippedWriter(Window &win) : win_{win} {}
+    virtual void Write(Vector2D<int> pos, const PixelColor &c) override {
+        if(0 <= pos.x && pos.x < win_.Width() && 0 <= pos.y &&
+           pos.y < win_.Height()) {
+            win_.Write(pos, c);
+        }
+    }
+    virtual int Width() const override { return win_.Width(); }
+    virtual int Height() const override { return win_.Height(); }
+    virtual void WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                              int width, const PixelColor &c) override {
+        win_.WriteMaskRow(pos, mask, width, c);
+    }
+    virtual void FillSpan(Vector2D<int> pos, int width,
+                          const PixelColor &c) override {
+        win_.FillRect(pos, {width, 1}, c);
+    }
+    virtual void FillRect(Vector2D<int> pos, Vector2D<int> size,
+                          const PixelColor &c) override {
+        win_.FillRect(pos, size, c);
+    }
+    virtual void BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                          const uint32_t *src, int src_stride) override {
+        win_.BlitRect(pos, size, src, src_stride);
+    }
+
+  private:
+    Window &win_;
+};
+
+/** 描画コマンドを順に実行する. 描いた範囲を damage に足す */
+Result ExecuteDrawBatch(Window &win, const uint8_t *buf, size_t len,
+                        Rectangle<int> &damage) {
+    const Rectangle<int> win_area{{0, 0}, win.Size()};
+    ClippedWriter writer{win};
+    auto add_damage = [&](Rectangle<int> area) {
+        area = area & win_area;
+        if(area.size.x <= 0 || area.size.y <= 0) { return; }
+        if(damage.size.x <= 0 || damage.size.y <= 0) {
+            damage = area;
+            return;
+        }
+        const auto end = ElementMax(damage.pos + damage.size,
+                                    area.pos + area.size);
+        damage.pos = ElementMin(damage.pos, area.pos);
+        damage.size = end - damage.pos;
+    };
+
+    uint64_t executed = 0;
+    size_t off = 0;
+    while(off + sizeof(DrawCommandHeader) <= len) {
+        DrawCommandHeader header;
+        memcpy(&header, buf + off, sizeof(header));
+        if(header.size < sizeof(header) || header.size % 4 != 0 ||
+           header.size > len - off) {
+            return {executed, EINVAL};
+        }
+        const uint8_t *p = buf + off;
+        off += header.size;
+
+        // 引数が足りないコマンドは不正とする
+        auto load = [&](auto &cmd) {
+            if(header.size < sizeof(cmd)) { return false; }
+            memcpy(&cmd, p, sizeof(cmd));
+            return true;
+        };
+
+        switch(header.type) {
+        case kDrawFillRect: {
+            DrawFillRect cmd;
+            if(!load(cmd)) { return {executed, EINVAL}; }
+            const auto area = Rectangle<int>{{cmd.x, cmd.y}, {cmd.w, cmd.h}} &
+                              win_area;
+            if(area.size.x > 0 && area.size.y > 0) {
+                FillRectangle(*win.Writer(), area.pos, area.size,
+                              ToColor(cmd.color));
+                add_damage(area);
+            }
+            break;
+        }
+        case kDrawLine: {
+            DrawLine cmd;
+            if(!load(cmd)) { return {executed, EINVAL}; }
+            DrawLineSegment(writer, cmd.x0, cmd.y0, cmd.x1, cmd.y1, cmd.color);
+            const Vector2D<int> p0{cmd.x0, cmd.y0}, p1{cmd.x1, cmd.y1};
+            const auto top_left = ElementMin(p0, p1);
+            add_damage({top_left,
+                        ElementMax(p0, p1) - top_left + Vector2D<int>{1, 1}});
+            break;
+        }
+        case kDrawText: {
+            DrawText cmd;
+            if(!load(cmd) || cmd.len > header.size - sizeof(cmd)) {
+                return {executed, EINVAL};
+            }
+            char s[256];
+            const size_t n = std::min<size_t>(cmd.len, sizeof(s) - 1);
+            memcpy(s, p + sizeof(cmd), n);
+            s[n] = '\0';
+            WriteString(writer, {cmd.x, cmd.y}, s, ToColor(cmd.color));
+            add_damage({{cmd.x, cmd.y}, {8 * static_cast<int>(n), 16}});
+            break;
+        }
+        case kDrawBlit: {
+            DrawBlit cmd;
+            if(!load(cmd) || cmd.w < 0 || cmd.h < 0 ||
+               cmd.w > win.Width() || cmd.h > win.Height()) {
+                return {executed, EINVAL};
+            }
+            // 読み出す画素列全体がアプリ空間に収まっていなければならない
+            const uint64_t src_begin = reinterpret_cast<uint64_t>(cmd.pixels);
+            const uint64_t src_bytes = 4 * static_cast<uint64_t>(cmd.w) *
+                                       static_cast<uint64_t>(cmd.h);
+            if(src_begin < 0xffff'8000'0000'0000 ||
+               src_begin + src_bytes < src_begin) {
+                return {executed, EFAULT};
+            }
+            const auto area = Rectangle<int>{{cmd.x, cmd.y}, {cmd.w, cmd.h}} &
+                              win_area;
+            win.BlitRect({cmd.x, cmd.y}, {cmd.w, cmd.h}, cmd.pixels, cmd.w);
+            add_damage(area);
+            break;
+        }
+        case kDrawCopyRect: {
+            DrawCopyRect cmd;
+            if(!load(cmd)) { return {executed, EINVAL}; }
+            // 写し元と写し先の両方がウィンドウに収まる部分だけ写す
+            const Vector2D<int> shift{cmd.x - cmd.sx, cmd.y - cmd.sy};
+            auto src = Rectangle<int>{{cmd.sx, cmd.sy}, {cmd.w, cmd.h}} &
+                       win_area;
+            src = Rectangle<int>{src.pos + shift, src.size} & win_area;
+            src.pos = src.pos - shift;
+            if(src.size.x > 0 && src.size.y > 0) {
+                win.Move(src.pos + shift, src);
+                add_damage({src.pos + shift, src.size});
+            }
+            break;
+        }
+        default:
+            return {executed, EINVAL};
+        }
+        ++executed;
+    }
+    return {executed, 0};
+}
+} // namespace
+
+SYSCALL(WinDrawBatch) {
+    const uint32_t layer_flags = arg1 >> 32;
+    const unsigned int layer_id = arg1 & 0xffffffff;
+    const auto buf = reinterpret_cast<const uint8_t *>(arg2);
+    const size_t len = arg3;
+    if(arg2 < 0xffff'8000'0000'0000 || arg2 + len < arg2) {
+        return {0, EFAULT};
+    }
+
+    __asm__("cli");
+    auto layer = layer_manager->FindLayer(layer_id);
+    __asm__("sti");
+    if(layer == nullptr) { return {0, EBADF}; }
+
+    Rectangle<int> damage{{0, 0}, {0, 0}};
+    const auto res = ExecuteDrawBatch(*layer->GetWindow(), buf, len, damage);
+
+    // 不正なコマンドで止まっても, それまでに描いた分は画面に出す
+    if((layer_flags & 1) == 0 && damage.size.x > 0 && damage.size.y > 0) {
+        __asm__("cli");
+        layer_manager->Draw(layer_id, damage);
+        __asm__("sti");
+    }
+    return res;
+}
+
 SYSCALL(CloseWindow) {
     const unsigned int layer_id = arg1 & 0xffffffff;
+
+    // 写像した画素領域はウィンドウと一緒に解放されるので, 先に写像を外す
+    __asm__("cli");
+    if(auto layer = layer_manager->FindLayer(layer_id)) {
+        auto &win = *layer->GetWindow();
+        if(win.SurfaceMapCR3() == GetCR3()) {
+            UnmapPages(LinearAddress4Level{win.SurfaceMapAddr()},
+                       win.SharedSurfaceBytes() / 4096);
+            task_manager->CurrentTask().FreeFileMapRange(
+                win.SurfaceMapAddr(), win.SharedSurfaceBytes());
+            win.SetSurfaceMap(0, 0);
+        }
+    }
+    __asm__("sti");
+
     const auto err = CloseLayer(layer_id);
     if(err.Cause() == Error::kNoSuchEntry) { return {EBADF, 0}; }
     return {0, 0};
@@ -236,7 +514,8 @@ SYSCALL(ReadEvent) {
         case Message::kTimerTimeout:
             if(msg->arg.timer.value < 0) {
                 app_events[i].type = AppEvent::kTimerTimeout;
-                app_events[i].arg.timer.timeout = msg->arg.timer.timeout;
+                app_events[i].arg.timer.timeout =
+                    msg->arg.timer.timeout / 1'000'000;
                 app_events[i].arg.timer.value = -msg->arg.timer.value;
                 ++i;
             }
@@ -245,6 +524,12 @@ SYSCALL(ReadEvent) {
             app_events[i].type = AppEvent::kQuit;
             ++i;
             break;
+        case Message::kShmNotify:
+            app_events[i].type = AppEvent::kShmNotify;
+            app_events[i].arg.shm.fd = msg->arg.shm.fd;
+            app_events[i].arg.shm.value = msg->arg.shm.value;
+            ++i;
+            break;
         default:
             Log(kInfo, "uncaught event type: %u\n", msg->type);
         }
@@ -262,15 +547,38 @@ SYSCALL(CreateTimer) {
     const uint64_t task_id = task_manager->CurrentTask().ID();
     __asm__("sti");
 
-    unsigned long timeout = arg3 * kTimerFreq / 1000;
-    if(mode & 1) { // relative
-        timeout += timer_manager->CurrentTick();
+    // ティックの倍数の期限はホイールに置き, 半端な期限だけを HRTimer にする
+    const uint64_t timeout_ms = arg3;
+    const uint64_t tick_ms = 1000 / kTimerFreq;
+    TimerID id;
+    __asm__("cli");
+    if(timeout_ms % tick_ms == 0) {
+        unsigned long timeout = timeout_ms / tick_ms;
+        if(mode & 1) { // relative
+            timeout += timer_manager->CurrentTick();
+        }
+        id = timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+    } else {
+        uint64_t timeout = timeout_ms * 1'000'000;
+        if(mode & 1) { // relative
+            timeout += CurrentTime();
+        }
+        id = timer_manager->AddHRTimer(Timer{timeout, -timer_value, task_id});
     }
+    __asm__("sti");
+    if(id == kInvalidTimerID) { return {0, ENOMEM}; }
+    return {id, 0};
+}
 
+SYSCALL(CancelTimer) {
+    const TimerID id = arg1;
+
+    // 他のタスクのタイマーは取り消せない
     __asm__("cli");
-    timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    const bool cancelled = timer_manager->CancelTimer(id, task_id);
     __asm__("sti");
-    return {timeout * 1000 / kTimerFreq, 0};
+    return {0, cancelled ? 0 : ENOENT};
 }
 
 namespace {
@@ -317,8 +625,11 @@ SYSCALL(OpenFile) {
         return {0, ENOENT};
     }
 
+    auto fd_obj = std::make_unique<fat::FileDescriptor>(*file);
+    __asm__("cli");
     size_t fd = AllocateFD(task);
-    task.Files()[fd] = std::make_unique<fat::FileDescriptor>(*file);
+    task.Files()[fd] = std::move(fd_obj);
+    __asm__("sti");
     return {fd, 0};
 }
 
@@ -343,8 +654,11 @@ SYSCALL(DemandPages) {
     auto &task = task_manager->CurrentTask();
     __asm__("sti");
 
+    // 同じアプリの他のスレッドと領域が重ならないよう割り込み禁止で更新する
+    __asm__("cli");
     const uint64_t dp_end = task.DPagingEnd();
     task.SetDPagingEnd(dp_end + 4096 * num_pages);
+    __asm__("sti");
     return {dp_end, 0};
 }
 
@@ -360,12 +674,14 @@ SYSCALL(MapFile) {
         return {0, EBADF};
     }
 
-    *file_size = task.Files()[fd]->Size();
+    const size_t size = task.Files()[fd]->Size();
+    __asm__("cli");
     const uint64_t vaddr_end = task.FileMapEnd();
-    const uint64_t vaddr_begin =
-        (vaddr_end - *file_size) & 0xffff'ffff'ffff'f000;
+    const uint64_t vaddr_begin = (vaddr_end - size) & 0xffff'ffff'ffff'f000;
     task.SetFileMapEnd(vaddr_begin);
     task.FileMaps().push_back(FileMapping{fd, vaddr_begin, vaddr_end});
+    __asm__("sti");
+    *file_size = size;
     return {vaddr_begin, 0};
 }
 
@@ -436,13 +752,344 @@ SYSCALL(SocketSend) {
     return {ret, 0};
 }
 
+SYSCALL(FutexWait) {
+    const uint64_t addr = arg1;
+    const uint32_t val = arg2;
+    if(addr < 0xffff'8000'0000'0000 || addr % sizeof(uint32_t) != 0) {
+        return {0, EINVAL};
+    }
+    if(!::FutexWait(reinterpret_cast<volatile uint32_t *>(addr), val)) {
+        return {0, EAGAIN};
+    }
+    return {0, 0};
+}
+
+SYSCALL(FutexWake) {
+    const uint64_t addr = arg1;
+    const int n = arg2;
+    if(addr < 0xffff'8000'0000'0000 || addr % sizeof(uint32_t) != 0) {
+        return {0, EINVAL};
+    }
+    return {static_cast<uint64_t>(
+                ::FutexWake(reinterpret_cast<volatile uint32_t *>(addr), n)),
+            0};
+}
+
+namespace {
+struct ThreadStart {
+    uint64_t entry, arg, stack_top;
+};
+
+/** アプリのスレッドを実行するタスク. アプリと同じ CR3 で作られる */
+void TaskAppThread(uint64_t task_id, int64_t data) {
+    auto start = reinterpret_cast<ThreadStart *>(data);
+    const ThreadStart s = *start;
+    delete start;
+
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    // ThreadExit か Exit で戻ってくる
+    const int ret = CallApp(task_id, reinterpret_cast<char **>(s.arg),
+                            3 << 3 | 3, s.entry, s.stack_top - 8,
+                            &task.OSStackPointer());
+
+    __asm__("cli");
+    timer_manager->CancelAppTimers(task_id);
+    task_manager->Finish(ret);
+}
+} // namespace
+
+SYSCALL(ThreadCreate) {
+    const uint64_t entry = arg1;
+    const uint64_t arg = arg2;
+    size_t stack_size = arg3 ? arg3 : 16 * 4096;
+    stack_size = (stack_size + 4095) & ~static_cast<size_t>(4095);
+    if(entry < 0xffff'8000'0000'0000) { return {0, EINVAL}; }
+
+    // スタックはデマンドページング領域から切り出すので, 触れたページだけ割り当てられる
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    Task &leader = task.Leader() ? *task.Leader() : task;
+    const uint64_t stack_begin = leader.DPagingEnd();
+    if(stack_begin + stack_size > leader.FileMapEnd()) {
+        __asm__("sti");
+        return {0, ENOMEM};
+    }
+    leader.SetDPagingEnd(stack_begin + stack_size);
+
+    auto start = new ThreadStart{entry, arg, stack_begin + stack_size};
+    Task &thread = task_manager->NewTask()
+                       .InitContext(TaskAppThread,
+                                    reinterpret_cast<int64_t>(start))
+                       .SetLeader(&leader);
+    leader.Threads().push_back(thread.ID());
+    task_manager->Wakeup(&thread, task.Level());
+    __asm__("sti");
+    return {thread.ID(), 0};
+}
+
+SYSCALL(ThreadExit) {
+    // SyscallEntry が Exit と同じく CallApp の呼び出し元へ戻る
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+    return {task.OSStackPointer(), static_cast<int>(arg1)};
+}
+
+SYSCALL(ThreadJoin) {
+    const uint64_t tid = arg1;
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    Task &leader = task.Leader() ? *task.Leader() : task;
+    auto &threads = leader.Threads();
+    auto &joining = leader.Joining();
+    if(std::find(threads.begin(), threads.end(), tid) == threads.end() ||
+       tid == task.ID()) {
+        __asm__("sti");
+        return {0, ESRCH};
+    }
+    if(std::find(joining.begin(), joining.end(), tid) != joining.end()) {
+        __asm__("sti");
+        return {0, EINVAL};
+    }
+    // 待っている間もリーダーの終了時に強制終了できるよう, Threads() には残しておく
+    joining.push_back(tid);
+    auto [ec, err] = task_manager->WaitFinish(tid);
+    joining.erase(std::find(joining.begin(), joining.end(), tid));
+    threads.erase(std::find(threads.begin(), threads.end(), tid));
+    __asm__("sti");
+    return {static_cast<uint64_t>(ec), 0};
+}
+
+namespace {
+Result SleepUntil(uint64_t deadline) {
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    // メッセージなど他の理由で起こされても期限までは眠り直す
+    while(CurrentTime() < deadline) {
+        const auto id = timer_manager->AddWakeupTimer(deadline, task.ID());
+        if(id == kInvalidTimerID) {
+            __asm__("sti");
+            return {0, ENOMEM};
+        }
+        task.Sleep();
+        timer_manager->CancelTimer(id);
+    }
+    __asm__("sti");
+    return {0, 0};
+}
+} // namespace
+
+SYSCALL(Sleep) { return SleepUntil(CurrentTime() + arg1); }
+
+SYSCALL(SleepUntil) { return SleepUntil(arg1); }
+
+namespace {
+// syscall_table の後で定義する
+Result CallSyscall(uint64_t op, const uint64_t *args);
+} // namespace
+
+SYSCALL(RingSetup) {
+    const uint64_t addr = arg1;
+    if(addr != 0 && (addr < 0xffff'8000'0000'0000 || addr % 8 != 0 ||
+                     addr + sizeof(SyscallRing) < addr)) {
+        return {0, EINVAL};
+    }
+
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+    task.SetRing(reinterpret_cast<SyscallRing *>(addr));
+    return {0, 0};
+}
+
+SYSCALL(RingEnter) {
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto ring = task.Ring();
+    if(ring == nullptr) { return {0, EBADF}; }
+
+    // CQ が空くぶんだけ処理し, 残りの SQE は次の RingEnter に回す
+    const uint32_t sq_tail = ring->sq_tail;
+    uint32_t sq_head = ring->sq_head;
+    uint32_t cq_tail = ring->cq_tail;
+    uint64_t submitted = 0;
+    while(sq_head != sq_tail &&
+          cq_tail - ring->cq_head < SYSCALL_RING_ENTRIES) {
+        const auto &sqe = ring->sq[sq_head % SYSCALL_RING_ENTRIES];
+        const auto res = CallSyscall(sqe.op, sqe.args);
+
+        auto &cqe = ring->cq[cq_tail % SYSCALL_RING_ENTRIES];
+        cqe.user_data = sqe.user_data;
+        cqe.value = res.value;
+        cqe.error = res.error;
+        ++sq_head;
+        ++cq_tail;
+        ++submitted;
+    }
+    ring->sq_head = sq_head;
+    ring->cq_tail = cq_tail;
+    return {submitted, 0};
+}
+
+SYSCALL(ShmOpen) {
+    if(arg1 < 0xffff'8000'0000'0000) { return {0, EFAULT}; }
+    const char *name = reinterpret_cast<const char *>(arg1);
+    const size_t bytes = arg2;
+    const int flags = arg3;
+
+    const size_t name_len = strnlen(name, ShmObject::kMaxNameLen + 1);
+    if(name_len == 0) { return {0, EINVAL}; }
+    if(name_len > ShmObject::kMaxNameLen) { return {0, ENAMETOOLONG}; }
+
+    auto [shm, err] = OpenShm(name, bytes, flags & O_CREAT, flags & O_EXCL);
+    switch(err.Cause()) {
+    case Error::kSuccess:
+        break;
+    case Error::kNoSuchEntry:
+        return {0, ENOENT};
+    case Error::kAlreadyAllocated:
+        return {0, EEXIST};
+    case Error::kIndexOutOfRange:
+        return {0, EINVAL};
+    default:
+        return {0, ENOMEM};
+    }
+
+    // 通知はスレッドではなくアプリ(リーダー)に届ける
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    Task &leader = task.Leader() ? *task.Leader() : task;
+    const size_t fd = AllocateFD(task);
+    task.Files()[fd] = std::make_shared<ShmDescriptor>(shm, leader.ID(), fd);
+    __asm__("sti");
+    return {fd, 0};
+}
+
+SYSCALL(ShmMap) {
+    const int fd = arg1;
+    if(arg2 != 0 && arg2 < 0xffff'8000'0000'0000) { return {0, EFAULT}; }
+    auto shm_size = reinterpret_cast<size_t *>(arg2);
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto shm = FindShmDescriptor(task, fd);
+    if(shm == nullptr) { return {0, EBADF}; }
+    auto [addr, err] = shm->Map(task);
+    if(err) { return {0, ENOMEM}; }
+    if(shm_size) { *shm_size = shm->Size(); }
+    return {addr, 0};
+}
+
+SYSCALL(ShmUnmap) {
+    const int fd = arg1;
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto shm = FindShmDescriptor(task, fd);
+    if(shm == nullptr) { return {0, EBADF}; }
+    shm->Unmap();
+    return {0, 0};
+}
+
+SYSCALL(ShmNotify) {
+    const int fd = arg1;
+    const uint64_t value = arg2;
+    __asm__("cli");
+    auto &task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    auto shm = FindShmDescriptor(task, fd);
+    if(shm == nullptr) { return {0, EBADF}; }
+    __asm__("cli");
+    Task &leader = task.Leader() ? *task.Leader() : task;
+    const int sent = shm->Object().Notify(leader.ID(), value);
+    __asm__("sti");
+    return {static_cast<uint64_t>(sent), 0};
+}
+
+SYSCALL(Spawn) {
+    const char *path = reinterpret_cast<const char *>(arg1);
+    const char *const *argv = reinterpret_cast<const char *const *>(arg2);
+    const int *fds = reinterpret_cast<const int *>(arg3);
+    if(arg1 < 0xffff'8000'0000'0000 ||
+       (argv && arg2 < 0xffff'8000'0000'0000) ||
+       (fds && arg3 < 0xffff'8000'0000'0000)) {
+        return {0, EFAULT};
+    }
+
+    auto file_entry = FindCommand(path);
+    if(file_entry == nullptr) { return {0, ENOENT}; }
+
+    // 子は親と別のアドレス空間で動くので, 引数は起動前にカーネル側へ写しておく
+    std::vector<std::string> args;
+    if(argv == nullptr) {
+        args.push_back(path);
+    } else {
+        for(int i = 0; argv[i]; ++i) {
+            if(i >= 32) { return {0, E2BIG}; }
+            args.push_back(argv[i]);
+        }
+        if(args.empty()) { return {0, EINVAL}; }
+    }
+
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    Task &leader = task.Leader() ? *task.Leader() : task;
+    __asm__("sti");
+
+    std::vector<std::shared_ptr<FileDescriptor>> files;
+    for(int i = 0; i < 3; ++i) {
+        const int fd = fds ? fds[i] : i;
+        if(fd < 0 || fd >= leader.Files().size() || !leader.Files()[fd]) {
+            return {0, EBADF};
+        }
+        files.push_back(leader.Files()[fd]);
+    }
+
+    auto info = new AppSpawnInfo{file_entry, std::move(args), std::move(files)};
+
+    __asm__("cli");
+    Task &child = task_manager->NewTask().InitContext(
+        TaskApp, reinterpret_cast<int64_t>(info));
+    // 親のアドレス空間を引き継がず, TaskApp が自分のページテーブルを作る
+    child.Context().cr3 = KernelCR3();
+    leader.Children().push_back(child.ID());
+    task_manager->Wakeup(&child, task.Level());
+    __asm__("sti");
+    return {child.ID(), 0};
+}
+
+SYSCALL(Wait) {
+    const uint64_t pid = arg1;
+    __asm__("cli");
+    Task &task = task_manager->CurrentTask();
+    Task &leader = task.Leader() ? *task.Leader() : task;
+    auto &children = leader.Children();
+    auto it = std::find(children.begin(), children.end(), pid);
+    if(it == children.end()) {
+        __asm__("sti");
+        return {0, ECHILD};
+    }
+    children.erase(it);
+    auto [ec, err] = task_manager->WaitFinish(pid);
+    __asm__("sti");
+    return {static_cast<uint64_t>(ec), 0};
+}
+
 #undef SYSCALL
 
 } // namespace syscall
 
 using SyscallFuncType = syscall::Result(uint64_t, uint64_t, uint64_t, uint64_t,
                                         uint64_t, uint64_t);
-extern "C" std::array<SyscallFuncType *, 0x1b> syscall_table{
+extern "C" std::array<SyscallFuncType *, 0x2f> syscall_table{
     /* 0x00 */ syscall::LogString,
     /* 0x01 */ syscall::PutString,
     /* 0x02 */ syscall::Exit,
@@ -470,12 +1117,134 @@ extern "C" std::array<SyscallFuncType *, 0x1b> syscall_table{
     /* 0x18 */ syscall::SocketConnect,
     /* 0x19 */ syscall::SocketRecv,
     /* 0x1a */ syscall::SocketSend,
+    /* 0x1b */ syscall::CancelTimer,
+    /* 0x1c */ syscall::GetTimeNs,
+    /* 0x1d */ syscall::FutexWait,
+    /* 0x1e */ syscall::FutexWake,
+    /* 0x1f */ syscall::ThreadCreate,
+    /* 0x20 */ syscall::ThreadExit,
+    /* 0x21 */ syscall::ThreadJoin,
+    /* 0x22 */ syscall::Sleep,
+    /* 0x23 */ syscall::SleepUntil,
+    /* 0x24 */ syscall::RingSetup,
+    /* 0x25 */ syscall::RingEnter,
+    /* 0x26 */ syscall::WinMapSurface,
+    /* 0x27 */ syscall::WinCommit,
+    /* 0x28 */ syscall::WinDrawBatch,
+    /* 0x29 */ syscall::ShmOpen,
+    /* 0x2a */ syscall::ShmMap,
+    /* 0x2b */ syscall::ShmUnmap,
+    /* 0x2c */ syscall::ShmNotify,
+    /* 0x2d */ syscall::Spawn,
+    /* 0x2e */ syscall::Wait,
 };
 
+namespace {
+const std::array<const char *, syscall_table.size()> syscall_names{
+    /* 0x00 */ "LogString",
+    /* 0x01 */ "PutString",
+    /* 0x02 */ "Exit",
+    /* 0x03 */ "OpenWindow",
+    /* 0x04 */ "WinWriteString",
+    /* 0x05 */ "WinFillRectangle",
+    /* 0x06 */ "GetCurrentTick",
+    /* 0x07 */ "WinRedraw",
+    /* 0x08 */ "WinDrawLine",
+    /* 0x09 */ "CloseWindow",
+    /* 0x0a */ "ReadEvent",
+    /* 0x0b */ "CreateTimer",
+    /* 0x0c */ "OpenFile",
+    /* 0x0d */ "ReadFile",
+    /* 0x0e */ "DemandPages",
+    /* 0x0f */ "MapFile",
+    /* 0x10 */ "SocketOpen",
+    /* 0x11 */ "SocketClose",
+    /* 0x12 */ "SocketIOCTL",
+    /* 0x13 */ "SocketRecvFrom",
+    /* 0x14 */ "SocketSendTo",
+    /* 0x15 */ "SocketBind",
+    /* 0x16 */ "SocketListen",
+    /* 0x17 */ "SocketAccept",
+    /* 0x18 */ "SocketConnect",
+    /* 0x19 */ "SocketRecv",
+    /* 0x1a */ "SocketSend",
+    /* 0x1b */ "CancelTimer",
+    /* 0x1c */ "GetTimeNs",
+    /* 0x1d */ "FutexWait",
+    /* 0x1e */ "FutexWake",
+    /* 0x1f */ "ThreadCreate",
+    /* 0x20 */ "ThreadExit",
+    /* 0x21 */ "ThreadJoin",
+    /* 0x22 */ "Sleep",
+    /* 0x23 */ "SleepUntil",
+    /* 0x24 */ "RingSetup",
+    /* 0x25 */ "RingEnter",
+    /* 0x26 */ "WinMapSurface",
+    /* 0x27 */ "WinCommit",
+    /* 0x28 */ "WinDrawBatch",
+    /* 0x29 */ "ShmOpen",
+    /* 0x2a */ "ShmMap",
+    /* 0x2b */ "ShmUnmap",
+    /* 0x2c */ "ShmNotify",
+    /* 0x2d */ "Spawn",
+    /* 0x2e */ "Wait",
+};
+} // namespace
+
+size_t NumSyscalls() { return syscall_table.size(); }
+
+const char *SyscallName(uint32_t nr) {
+    if(nr >= syscall_names.size() || syscall_names[nr] == nullptr) {
+        return "?";
+    }
+    return syscall_names[nr];
+}
+
+/** トレースが有効なとき SyscallEntry から呼ばれる. nr はシステムコール番号 */
+extern "C" syscall::Result TraceSyscall(uint64_t arg1, uint64_t arg2,
+                                        uint64_t arg3, uint64_t arg4,
+                                        uint64_t arg5, uint64_t arg6,
+                                        uint64_t nr) {
+    if(nr >= syscall_table.size()) { return {0, ENOSYS}; }
+
+    const uint64_t args[3] = {arg1, arg2, arg3};
+    const uint64_t start = ReadTSC();
+    const auto res = syscall_table[nr](arg1, arg2, arg3, arg4, arg5, arg6);
+    RecordSyscall(nr, args, res.value, res.error, start, ReadTSC());
+    return res;
+}
+
+namespace syscall {
+namespace {
+Result CallSyscall(uint64_t op, const uint64_t *args) {
+    op &= 0x7fffffff;
+    // アプリを終わらせるものとリング自身はリングから呼べない
+    if(op >= syscall_table.size() || syscall_table[op] == Exit ||
+       syscall_table[op] == ThreadExit || syscall_table[op] == RingSetup ||
+       syscall_table[op] == RingEnter) {
+        return {0, ENOSYS};
+    }
+    if(syscall_trace_mode == 0) {
+        return syscall_table[op](args[0], args[1], args[2], args[3], args[4],
+                                 args[5]);
+    }
+
+    // リングから呼んだものも strace, syscallstat に1回ずつ数える
+    const uint64_t start = ReadTSC();
+    const auto res = syscall_table[op](args[0], args[1], args[2], args[3],
+                                       args[4], args[5]);
+    RecordSyscall(op, args, res.value, res.error, start, ReadTSC());
+    return res;
+}
+} // namespace
+} // namespace syscall
+
 void InitializeSyscall() {
     WriteMSR(kIA32_EFER, 0x0501u);
     WriteMSR(kIA32_LSTAR, reinterpret_cast<uint64_t>(SyscallEntry));
     WriteMSR(kIA32_STAR, static_cast<uint64_t>(8) << 32 |
                              static_cast<uint64_t>(16 | 3) << 48);
     WriteMSR(kIA32_FMASK, 0);
+
+    InitializeSyscallTrace();
 }
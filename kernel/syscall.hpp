@@ -1,3 +1,10 @@
 #pragma once
+#include <cstddef>
+#include <cstdint>
 
 void InitializeSyscall();
+
+/** syscall_table の要素数 */
+size_t NumSyscalls();
+/** システムコールの名前. 範囲外なら "?" */
+const char *SyscallName(uint32_t nr);
@@ -0,0 +1,45 @@
+/**
+ * @file syscall_ring.hpp
+ *
+ * システムコールをまとめて発行するためのリング.
+ * アプリが自分のメモリに置き, RingSetup でカーネルに登録する.
+ */
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+#define SYSCALL_RING_ENTRIES 64 // 2 のべき乗
+
+/** op は syscall.asm の番号(0x80000000 の有無は問わない) */
+struct SyscallRingSQE {
+    uint64_t op;
+    uint64_t args[6];
+    uint64_t user_data;
+};
+
+/** user_data は SQE の値をそのまま返す */
+struct SyscallRingCQE {
+    uint64_t user_data;
+    uint64_t value;
+    int64_t error;
+};
+
+/**
+ * sq_tail と cq_head はアプリが, sq_head と cq_tail はカーネルが進める.
+ * 添字は SYSCALL_RING_ENTRIES で割った余りで使う.
+ */
+struct SyscallRing {
+    volatile uint32_t sq_head, sq_tail;
+    volatile uint32_t cq_head, cq_tail;
+    struct SyscallRingSQE sq[SYSCALL_RING_ENTRIES];
+    struct SyscallRingCQE cq[SYSCALL_RING_ENTRIES];
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
@@ -0,0 +1,130 @@
+#include "syscall_trace.hpp"
+#include "bootconfig.hpp"
+#include "sync.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include <map>
+
+extern "C" volatile uint8_t syscall_trace_mode = 0;
+
+namespace {
+std::vector<SyscallStat> *stats;
+std::map<uint64_t, TaskSyscallStat> *task_stats;
+
+const size_t kMaxEvents = 1024;
+std::array<SyscallEvent, kMaxEvents> events;
+size_t num_events;
+uint64_t dropped_events;
+uint64_t event_task_id;
+
+int HistBucket(uint64_t cycles) {
+    if(cycles == 0) { return 0; }
+    const int b = 63 - __builtin_clzl(cycles);
+    return b < kSyscallHistBuckets ? b : kSyscallHistBuckets - 1;
+}
+
+bool IsEventTarget(const Task &task) {
+    if(task.ID() == event_task_id) { return true; }
+    return task.Leader() && task.Leader()->ID() == event_task_id;
+}
+} // namespace
+
+void InitializeSyscallTrace() {
+    stats = new std::vector<SyscallStat>(NumSyscalls());
+    task_stats = new std::map<uint64_t, TaskSyscallStat>;
+    EnableSyscallStat(BootConfigInt("syscall.trace", 0) != 0);
+}
+
+void RecordSyscall(uint32_t nr, const uint64_t *args, uint64_t value,
+                   int error, uint64_t start_tsc, uint64_t end_tsc) {
+    const uint64_t cycles = end_tsc - start_tsc;
+    const auto rflags = DisableInterrupts();
+    const Task &task = task_manager->CurrentTask();
+
+    if(syscall_trace_mode & kSyscallTraceStat) {
+        auto &st = (*stats)[nr];
+        ++st.count;
+        if(error) { ++st.errors; }
+        st.total_cycles += cycles;
+        st.max_cycles = std::max(st.max_cycles, cycles);
+        ++st.hist[HistBucket(cycles)];
+
+        auto &ts = (*task_stats)[task.ID()];
+        if(ts.counts.empty()) {
+            ts.task_id = task.ID();
+            ts.counts.resize(NumSyscalls());
+        }
+        ++ts.count;
+        ts.total_cycles += cycles;
+        ++ts.counts[nr];
+    }
+
+    if((syscall_trace_mode & kSyscallTraceEvent) && IsEventTarget(task)) {
+        if(num_events < kMaxEvents) {
+            events[num_events++] = {start_tsc, task.ID(), nr, error,
+                                    {args[0], args[1], args[2]},
+                                    value, cycles};
+        } else {
+            ++dropped_events;
+        }
+    }
+    RestoreInterrupts(rflags);
+}
+
+void EnableSyscallStat(bool enable) {
+    const auto rflags = DisableInterrupts();
+    if(enable) {
+        syscall_trace_mode |= kSyscallTraceStat;
+    } else {
+        syscall_trace_mode &= ~kSyscallTraceStat;
+    }
+    RestoreInterrupts(rflags);
+}
+
+bool SyscallStatEnabled() { return syscall_trace_mode & kSyscallTraceStat; }
+
+std::vector<SyscallStat> GetSyscallStats() {
+    const auto rflags = DisableInterrupts();
+    auto result = *stats;
+    RestoreInterrupts(rflags);
+    return result;
+}
+
+std::vector<TaskSyscallStat> GetTaskSyscallStats() {
+    std::vector<TaskSyscallStat> result;
+    const auto rflags = DisableInterrupts();
+    for(const auto &[id, ts] : *task_stats) { result.push_back(ts); }
+    RestoreInterrupts(rflags);
+    return result;
+}
+
+void ResetSyscallStats() {
+    const auto rflags = DisableInterrupts();
+    std::fill(stats->begin(), stats->end(), SyscallStat{});
+    task_stats->clear();
+    RestoreInterrupts(rflags);
+}
+
+void StartSyscallEventTrace(uint64_t task_id) {
+    const auto rflags = DisableInterrupts();
+    num_events = 0;
+    dropped_events = 0;
+    event_task_id = task_id;
+    syscall_trace_mode |= kSyscallTraceEvent;
+    RestoreInterrupts(rflags);
+}
+
+std::vector<SyscallEvent> StopSyscallEventTrace(uint64_t *dropped) {
+    const auto rflags = DisableInterrupts();
+    syscall_trace_mode &= ~kSyscallTraceEvent;
+    std::vector<SyscallEvent> result(events.begin(),
+                                     events.begin() + num_events);
+    if(dropped) { *dropped = dropped_events; }
+    RestoreInterrupts(rflags);
+    return result;
+}
+
+uint64_t CyclesToNs(uint64_t cycles) {
+    return static_cast<unsigned __int128>(cycles) * 1'000'000'000 / tsc_freq;
+}
@@ -0,0 +1,63 @@
+/**
+ * @file syscall_trace.hpp
+ *
+ * システムコールの呼び出し回数と所要時間の集計, および strace 用の記録
+ */
+#pragma once
+#include <array>
+#include <cstdint>
+#include <vector>
+
+/**
+ * SyscallEntry が参照するトレースの有効フラグ.
+ * 0 なら syscall_table を直接呼び, 0 以外なら TraceSyscall を経由する.
+ */
+extern "C" volatile uint8_t syscall_trace_mode;
+const uint8_t kSyscallTraceStat = 1;  // 回数と所要時間を集計する
+const uint8_t kSyscallTraceEvent = 2; // 個々の呼び出しを記録する(strace)
+
+/** 所要時間のヒストグラム. i 番目の区間は [2^i, 2^(i+1)) サイクル */
+const int kSyscallHistBuckets = 40;
+
+struct SyscallStat {
+    uint64_t count, errors;
+    uint64_t total_cycles, max_cycles;
+    std::array<uint64_t, kSyscallHistBuckets> hist;
+};
+
+struct TaskSyscallStat {
+    uint64_t task_id;
+    uint64_t count, total_cycles;
+    std::vector<uint64_t> counts; // システムコール番号ごとの回数
+};
+
+struct SyscallEvent {
+    uint64_t tsc;
+    uint64_t task_id;
+    uint32_t nr;
+    int error;
+    uint64_t args[3];
+    uint64_t value;
+    uint64_t cycles;
+};
+
+/** 起動時設定 syscall.trace=1 なら集計を始める */
+void InitializeSyscallTrace();
+
+/** TraceSyscall から呼ぶ. 現在のタスクの呼び出しとして記録する */
+void RecordSyscall(uint32_t nr, const uint64_t *args, uint64_t value,
+                   int error, uint64_t start_tsc, uint64_t end_tsc);
+
+void EnableSyscallStat(bool enable);
+bool SyscallStatEnabled();
+std::vector<SyscallStat> GetSyscallStats();
+std::vector<TaskSyscallStat> GetTaskSyscallStats();
+void ResetSyscallStats();
+
+/** task_id のタスクとそのスレッドの呼び出しを記録し始める */
+void StartSyscallEventTrace(uint64_t task_id);
+/** 記録を止めて, 記録した呼び出しを返す. 溢れて捨てた数を *dropped に書く */
+std::vector<SyscallEvent> StopSyscallEventTrace(uint64_t *dropped);
+
+/** TSC のサイクル数をナノ秒に直す */
+uint64_t CyclesToNs(uint64_t cycles);
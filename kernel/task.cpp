@@ -1,16 +1,39 @@
 #include "task.hpp"
 #include "asmfunc.h"
+#include "bootconfig.hpp"
 #include "segment.hpp"
+#include "sync.hpp"
 #include "timer.hpp"
+#include <cstdio>
+#include <cstring>
 
 namespace {
+const uint64_t kCR0MP = 1u << 1;
+const uint64_t kCR0EM = 1u << 2;
+const uint64_t kCR0TS = 1u << 3;
+
 template <class T, class U> void Erase(T &c, const U &value) {
     auto it = std::remove(c.begin(), c.end(), value);
     c.erase(it, c.end());
 }
 
+/*
+ * 他に実行可能なタスクがなければ周期ティックを止めて hlt する.
+ * 割り込みで他のタスクが起きたらティックを戻してすぐに切り替える.
+ */
 void TaskIdle(uint64_t task_id, int64_t data) {
-    while(true) __asm__("hlt");
+    while(true) {
+        __asm__("cli");
+        if(!task_manager->OnlyIdleRunnable()) {
+            timer_manager->ExitIdle();
+            task_manager->Yield();
+            __asm__("sti");
+            continue;
+        }
+
+        timer_manager->EnterIdle();
+        __asm__("sti\n\thlt");
+    }
 }
 } // namespace
 
@@ -67,45 +90,173 @@ std::optional<Message> Task::ReceiveMessage() {
     return m;
 }
 
-std::vector<std::shared_ptr<::FileDescriptor>> &Task::Files() { return files_; }
+std::optional<Message> Task::ReceiveMessage(Message::Type type) {
+    auto it = std::find_if(msgs_.begin(), msgs_.end(),
+                           [type](const auto &m) { return m.type == type; });
+    if(it == msgs_.end()) { return std::nullopt; }
+
+    auto m = *it;
+    msgs_.erase(it);
+    return m;
+}
+
+std::vector<std::shared_ptr<::FileDescriptor>> &Task::Files() {
+    return leader_ ? leader_->files_ : files_;
+}
+
+uint64_t Task::DPagingBegin() const {
+    return leader_ ? leader_->dpaging_begin_ : dpaging_begin_;
+}
+
+void Task::SetDPagingBegin(uint64_t v) {
+    (leader_ ? leader_->dpaging_begin_ : dpaging_begin_) = v;
+}
+
+uint64_t Task::DPagingEnd() const {
+    return leader_ ? leader_->dpaging_end_ : dpaging_end_;
+}
 
-uint64_t Task::DPagingBegin() const { return dpaging_begin_; }
+void Task::SetDPagingEnd(uint64_t v) {
+    (leader_ ? leader_->dpaging_end_ : dpaging_end_) = v;
+}
 
-void Task::SetDPagingBegin(uint64_t v) { dpaging_begin_ = v; }
+uint64_t Task::FileMapEnd() const {
+    return leader_ ? leader_->file_map_end_ : file_map_end_;
+}
 
-uint64_t Task::DPagingEnd() const { return dpaging_end_; }
+void Task::SetFileMapEnd(uint64_t v) {
+    (leader_ ? leader_->file_map_end_ : file_map_end_) = v;
+}
 
-void Task::SetDPagingEnd(uint64_t v) { dpaging_end_ = v; }
+std::vector<FileMapping> &Task::FileMaps() {
+    return leader_ ? leader_->file_maps_ : file_maps_;
+}
 
-uint64_t Task::FileMapEnd() const { return file_map_end_; }
+uint64_t Task::AllocateFileMapRange(uint64_t bytes) {
+    auto &free_maps = leader_ ? leader_->free_file_maps_ : free_file_maps_;
+    for(auto it = free_maps.begin(); it != free_maps.end(); ++it) {
+        const auto [begin, end] = *it;
+        if(end - begin < bytes) { continue; }
+        free_maps.erase(it);
+        if(end - begin > bytes) { free_maps[begin + bytes] = end; }
+        return begin;
+    }
 
-void Task::SetFileMapEnd(uint64_t v) { file_map_end_ = v; }
+    const uint64_t begin = FileMapEnd() - bytes;
+    if(bytes > FileMapEnd() || begin < DPagingEnd()) { return 0; }
+    SetFileMapEnd(begin);
+    return begin;
+}
 
-std::vector<FileMapping> &Task::FileMaps() { return file_maps_; }
+void Task::FreeFileMapRange(uint64_t begin, uint64_t bytes) {
+    auto &free_maps = leader_ ? leader_->free_file_maps_ : free_file_maps_;
+    uint64_t end = begin + bytes;
+    // 隣の空き範囲とつなげる
+    if(auto next = free_maps.find(end); next != free_maps.end()) {
+        end = next->second;
+        free_maps.erase(next);
+    }
+    if(auto next = free_maps.lower_bound(begin); next != free_maps.begin()) {
+        if(auto prev = std::prev(next); prev->second == begin) {
+            begin = prev->first;
+            free_maps.erase(prev);
+        }
+    }
+
+    // FileMapEnd に接していれば領域ごと返す
+    if(begin == FileMapEnd()) {
+        SetFileMapEnd(end);
+    } else {
+        free_maps[begin] = end;
+    }
+}
+
+void Task::ClearFreeFileMapRanges() {
+    (leader_ ? leader_->free_file_maps_ : free_file_maps_).clear();
+}
 
 TaskManager::TaskManager() {
     Task &task = NewTask().SetLevel(current_level_).SetRunning(true);
     running_[current_level_].push_back(&task);
 
+    // FPU レジスタは今動いているメインタスクのものとして始める
+    SetCR0((GetCR0() | kCR0MP) & ~(kCR0EM | kCR0TS));
+    fpu_owner_ = &task;
+
     Task &idle =
         NewTask().InitContext(TaskIdle, 0).SetLevel(0).SetRunning(true);
     running_[0].push_back(&idle);
+
+    LoadSchedulerConfig();
+    exec_start_ = CurrentTime();
+}
+
+void TaskManager::LoadSchedulerConfig() {
+    if(strcmp(BootConfig("scheduler", "rr"), "fair") == 0) {
+        policy_ = Policy::kFair;
+    }
+
+    sched_latency_ =
+        BootConfigInt("sched.latency_us", sched_latency_ / 1000) * 1000;
+    min_granularity_ =
+        BootConfigInt("sched.min_granularity_us", min_granularity_ / 1000) *
+        1000;
+    wakeup_granularity_ =
+        BootConfigInt("sched.wakeup_granularity_us",
+                      wakeup_granularity_ / 1000) *
+        1000;
+
+    char key[32];
+    for(int lv = 1; lv <= kMaxLevel; ++lv) {
+        sprintf(key, "sched.weight%d", lv);
+        const long w = BootConfigInt(key, weights_[lv]);
+        if(w > 0) { weights_[lv] = w; }
+    }
 }
 
 Task &TaskManager::NewTask() {
     ++latest_id_;
-    return *tasks_.emplace_back(new Task{latest_id_});
+    Task &task = *tasks_.emplace_back(new Task{latest_id_});
+    task.vruntime_ = min_vruntime_;
+    return task;
 }
 
 void TaskManager::SwitchTask(const TaskContext &current_ctx) {
     TaskContext &task_ctx = task_manager->CurrentTask().Context();
-    memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+    if(fpu_mode_ == FPUMode::kEager) {
+        memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+    } else {
+        memcpy(&task_ctx, &current_ctx, offsetof(TaskContext, fxsave_area));
+    }
     Task *current_task = RotateCurrentRunQueue(false);
     if(&CurrentTask() != current_task) {
+        if(fpu_mode_ == FPUMode::kEager) {
+            fpu_owner_ = nullptr;
+        } else if(fpu_owner_ == current_task) {
+            // 割り込みハンドラが壊したかもしれないレジスタを元に戻しておく
+            RestoreFPU(const_cast<uint8_t *>(current_ctx.fxsave_area.data()));
+        }
+        fpu_in_interrupt = 0;
+        SwitchFPU(&CurrentTask());
         RestoreContext(&CurrentTask().Context());
     }
 }
 
+void TaskManager::Yield() {
+    Task *current_task = RotateCurrentRunQueue(false);
+    if(&CurrentTask() != current_task) {
+        SwitchFPU(&CurrentTask());
+        SwitchContext(&CurrentTask().Context(), &current_task->Context());
+    }
+}
+
+bool TaskManager::OnlyIdleRunnable() const {
+    for(int lv = 1; lv <= kMaxLevel; ++lv) {
+        if(!running_[lv].empty()) { return false; }
+    }
+    return true;
+}
+
 void TaskManager::Sleep(Task *task) {
     if(!task->Running()) { return; }
 
@@ -113,6 +264,7 @@ void TaskManager::Sleep(Task *task) {
 
     if(task == running_[current_level_].front()) {
         Task *current_task = RotateCurrentRunQueue(true);
+        SwitchFPU(&CurrentTask());
         SwitchContext(&CurrentTask().Context(), &current_task->Context());
         return;
     }
@@ -139,9 +291,17 @@ void TaskManager::Wakeup(Task *task, int level) {
 
     task->SetLevel(level);
     task->SetRunning(true);
+    if(policy_ == Policy::kFair) { PlaceWokenTask(task); }
 
     running_[level].push_back(task);
-    if(level > current_level_) { level_changed_ = true; }
+    if(level > current_level_) {
+        level_changed_ = true;
+        // 高いレベルのタスクはタイムスライスの終わりを待たずに割り込ませる.
+        // アイドルタスクは自分で譲るので何もしない
+        if(policy_ == Policy::kRoundRobin && current_level_ > 0) {
+            timer_manager->SetTaskTimer(CurrentTime());
+        }
+    }
     return;
 }
 
@@ -169,18 +329,20 @@ void TaskManager::Finish(int exit_code) {
     Task *current_task = RotateCurrentRunQueue(true);
 
     const auto task_id = current_task->ID();
+    if(fpu_owner_ == current_task) { fpu_owner_ = nullptr; }
     auto it = std::find_if(
         tasks_.begin(), tasks_.end(),
         [current_task](const auto &t) { return t.get() == current_task; });
     tasks_.erase(it);
 
-    finish_tasks_[task_id] = exit_code;
+    if(detached_.erase(task_id) == 0) { finish_tasks_[task_id] = exit_code; }
     if(auto it = finish_waiter_.find(task_id); it != finish_waiter_.end()) {
         auto waiter = it->second;
         finish_waiter_.erase(it);
         Wakeup(waiter);
     }
 
+    SwitchFPU(&CurrentTask());
     RestoreContext(&CurrentTask().Context());
 }
 
@@ -199,6 +361,116 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id) {
     return {exit_code, MAKE_ERROR(Error::kSuccess)};
 }
 
+WithError<int> TaskManager::WaitFinishOrMessage(uint64_t task_id,
+                                                Message::Type type) {
+    Task *current_task = &CurrentTask();
+    while(true) {
+        if(auto it = finish_tasks_.find(task_id); it != finish_tasks_.end()) {
+            const int exit_code = it->second;
+            finish_tasks_.erase(it);
+            return {exit_code, MAKE_ERROR(Error::kSuccess)};
+        }
+        if(current_task->ReceiveMessage(type)) {
+            if(auto w = finish_waiter_.find(task_id);
+               w != finish_waiter_.end() && w->second == current_task) {
+                finish_waiter_.erase(w);
+            }
+            return {0, MAKE_ERROR(Error::kEmpty)};
+        }
+        finish_waiter_[task_id] = current_task;
+        Sleep(current_task);
+    }
+}
+
+Error TaskManager::Terminate(uint64_t task_id) {
+    auto it = std::find_if(
+        tasks_.begin(), tasks_.end(),
+        [task_id](const auto &t) { return t->ID() == task_id; });
+    if(it == tasks_.end()) {
+        if(finish_tasks_.erase(task_id) == 0) {
+            return MAKE_ERROR(Error::kNoSuchTask);
+        }
+        return MAKE_ERROR(Error::kSuccess);
+    }
+
+    Task *task = it->get();
+    if(task == &CurrentTask()) { return MAKE_ERROR(Error::kNoSuchTask); }
+
+    if(task->Running()) { Erase(running_[task->Level()], task); }
+    if(fpu_owner_ == task) { fpu_owner_ = nullptr; }
+    // 待ち行列のノードはこのタスクのスタック上にあるので, 破棄する前に外す
+    if(auto queue = task->WaitingOn()) { queue->Remove(task); }
+    if(auto w = finish_waiter_.find(task_id); w != finish_waiter_.end()) {
+        // 終了を待っているタスクには異常終了として知らせる
+        finish_tasks_[task_id] = -1;
+        Wakeup(w->second);
+        finish_waiter_.erase(w);
+    }
+    for(auto w = finish_waiter_.begin(); w != finish_waiter_.end();) {
+        if(w->second == task) {
+            w = finish_waiter_.erase(w);
+        } else {
+            ++w;
+        }
+    }
+    detached_.erase(task_id);
+    tasks_.erase(it);
+    return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::Detach(uint64_t task_id) {
+    if(finish_tasks_.erase(task_id) > 0) { return; }
+    const bool alive =
+        std::any_of(tasks_.begin(), tasks_.end(),
+                    [task_id](const auto &t) { return t->ID() == task_id; });
+    if(alive) { detached_.insert(task_id); }
+}
+
+void TaskManager::SetFPUMode(FPUMode mode) {
+    // 現在のタスクに FPU を持たせた状態から切り替える
+    Task *current_task = &CurrentTask();
+    if(fpu_owner_ != current_task) {
+        ClearTS();
+        if(fpu_owner_) { SaveFPU(fpu_owner_->Context().fxsave_area.data()); }
+        RestoreFPU(current_task->Context().fxsave_area.data());
+        fpu_owner_ = current_task;
+    }
+    fpu_mode_ = mode;
+}
+
+uint8_t *TaskManager::ReleaseFPU() {
+    ++fpu_traps_;
+    Task *owner = fpu_owner_;
+    fpu_owner_ = nullptr;
+    return owner ? owner->Context().fxsave_area.data() : nullptr;
+}
+
+uint8_t *TaskManager::ClaimFPU() {
+    fpu_owner_ = &CurrentTask();
+    return fpu_owner_->Context().fxsave_area.data();
+}
+
+void TaskManager::SwitchFPU(Task *next) {
+    if(fpu_mode_ == FPUMode::kEager) {
+        if(fpu_owner_ != next) {
+            if(fpu_owner_) {
+                SaveFPU(fpu_owner_->Context().fxsave_area.data());
+            }
+            RestoreFPU(next->Context().fxsave_area.data());
+            fpu_owner_ = next;
+        }
+        return;
+    }
+
+    // CR0 への書き込みは重いので, TS の状態が変わるときだけ書く
+    const bool ts = GetCR0() & kCR0TS;
+    if(fpu_owner_ == next) {
+        if(ts) { ClearTS(); }
+    } else if(!ts) {
+        SetTS();
+    }
+}
+
 void TaskManager::ChangeLevelRunning(Task *task, int level) {
     if(level < 0 || level == task->Level()) { return; }
 
@@ -230,6 +502,34 @@ Task *TaskManager::RotateCurrentRunQueue(bool current_sleep) {
     if(!current_sleep) { level_queue.push_back(current_task); }
     if(level_queue.empty()) { level_changed_ = true; }
 
+    const uint64_t now = CurrentTime();
+    Account(current_task, now);
+    ++current_task->switches_;
+
+    if(policy_ == Policy::kFair) {
+        level_changed_ = false;
+        uint64_t total_weight;
+        Task *next = PickFairTask(total_weight);
+        if(next == nullptr) {
+            current_level_ = 0;
+            return current_task;
+        }
+
+        auto &next_queue = running_[next->Level()];
+        if(next_queue.front() != next) {
+            Erase(next_queue, next);
+            next_queue.push_front(next);
+        }
+        current_level_ = next->Level();
+        min_vruntime_ = std::max(min_vruntime_, next->vruntime_);
+
+        // 実行可能なタスクが sched_latency_ で一巡するよう重みに比例して割り当てる
+        const uint64_t slice = std::max(
+            sched_latency_ * Weight(*next) / total_weight, min_granularity_);
+        timer_manager->SetTaskTimer(now + slice);
+        return current_task;
+    }
+
     if(level_changed_) {
         level_changed_ = false;
         for(int lv = kMaxLevel; lv >= 0; --lv) {
@@ -243,14 +543,53 @@ Task *TaskManager::RotateCurrentRunQueue(bool current_sleep) {
     return current_task;
 }
 
+void TaskManager::Account(Task *task, uint64_t now) {
+    const uint64_t delta = now - exec_start_;
+    exec_start_ = now;
+    task->runtime_ += delta;
+    task->vruntime_ += delta * kBaseWeight / Weight(*task);
+}
+
+Task *TaskManager::PickFairTask(uint64_t &total_weight) const {
+    Task *next = nullptr;
+    total_weight = 0;
+    for(int lv = 1; lv <= kMaxLevel; ++lv) {
+        for(Task *task : running_[lv]) {
+            total_weight += Weight(*task);
+            if(next == nullptr || task->vruntime_ < next->vruntime_) {
+                next = task;
+            }
+        }
+    }
+    return next;
+}
+
+void TaskManager::PlaceWokenTask(Task *task) {
+    // 長く眠っていたタスクが CPU を独占しないよう, 取り戻せる遅れは半周期までにする
+    const uint64_t credit = sched_latency_ / 2;
+    const uint64_t floor = min_vruntime_ > credit ? min_vruntime_ - credit : 0;
+    task->vruntime_ = std::max(task->vruntime_, floor);
+
+    Task *current_task = running_[current_level_].front();
+    if(current_task->Level() == 0) { return; } // アイドルタスクは自分で譲る
+
+    const uint64_t now = CurrentTime();
+    const uint64_t current_vruntime =
+        current_task->vruntime_ +
+        (now - exec_start_) * kBaseWeight / Weight(*current_task);
+    if(task->vruntime_ + wakeup_granularity_ < current_vruntime) {
+        timer_manager->SetTaskTimer(now);
+    }
+}
+
 TaskManager *task_manager;
 
 void InitializeTask() {
     task_manager = new TaskManager;
 
     __asm__("cli");
-    timer_manager->AddTimer(Timer{
-        timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
+    timer_manager->SetTaskTimer(CurrentTime() + kTaskTimerPeriodNs);
+    timer_manager->ProgramNextEvent();
     __asm__("sti");
 }
 
@@ -258,3 +597,15 @@ __attribute__((no_caller_saved_registers)) extern "C" uint64_t
 GetCurrentTaskOSStackPointer() {
     return task_manager->CurrentTask().OSStackPointer();
 }
+
+volatile uint8_t fpu_in_interrupt = 0;
+
+__attribute__((no_caller_saved_registers)) extern "C" uint8_t *
+ReleaseFPUOwner() {
+    return task_manager->ReleaseFPU();
+}
+
+__attribute__((no_caller_saved_registers)) extern "C" uint8_t *
+ClaimFPUForCurrentTask() {
+    return task_manager->ClaimFPU();
+}
@@ -9,6 +9,7 @@
 #include <deque>
 #include <map>
 #include <optional>
+#include <set>
 #include <vector>
 
 struct TaskContext {
@@ -22,12 +23,27 @@ struct TaskContext {
 using TaskFunc = void(uint64_t, int64_t);
 
 class TaskManager;
+class WaitQueue;
+struct SyscallRing;
 
 struct FileMapping {
     int fd;
     uint64_t vaddr_begin, vaddr_end;
 };
 
+/**
+ * アプリの ELF の PT_LOAD セグメント. ページは最初に触れたときにファイルから読む.
+ * 読んだページは page_cache(同じアプリで共有するページテーブル)にも写像しておき,
+ * 以後の起動では読み取り専用で共有する. 書き込まれたらコピーする.
+ */
+struct ElfMapping {
+    fat::DirectoryEntry *file;
+    PageMapEntry *page_cache;
+    uint64_t vaddr_begin, vaddr_end; // [p_vaddr, p_vaddr + p_memsz)
+    uint64_t file_vaddr_end;         // p_vaddr + p_filesz. 以降は 0 で埋める
+    uint64_t file_offset;            // vaddr_begin に対応するファイル上の位置
+};
+
 class Task {
   public:
     static const int kDefaultLevel = 1;
@@ -42,6 +58,8 @@ class Task {
     Task &Wakeup();
     void SendMessage(const Message &msg);
     std::optional<Message> ReceiveMessage();
+    /** 最初の type のメッセージを取り出す. ほかのメッセージは順序を保って残す */
+    std::optional<Message> ReceiveMessage(Message::Type type);
     std::vector<std::shared_ptr<::FileDescriptor>> &Files();
     uint64_t DPagingBegin() const;
     void SetDPagingBegin(uint64_t v);
@@ -50,9 +68,46 @@ class Task {
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
     std::vector<FileMapping> &FileMaps();
+    /**
+     * FileMapEnd の下から bytes(ページ単位)の範囲を確保して先頭を返す.
+     * FreeFileMapRange で返された範囲があればそれを使う. 空きがなければ 0.
+     */
+    uint64_t AllocateFileMapRange(uint64_t bytes);
+    /** AllocateFileMapRange で確保した範囲を返す */
+    void FreeFileMapRange(uint64_t begin, uint64_t bytes);
+    /** 返された範囲をすべて忘れる. アドレス空間を片付けるときに呼ぶ */
+    void ClearFreeFileMapRanges();
+    std::vector<ElfMapping> &ElfMaps() { return elf_maps_; }
+
+    /**
+     * アプリのスレッドなら, アプリを起動したタスク(リーダー)を返す. そうでなければ nullptr.
+     * スレッドのファイル, ファイルマップ, デマンドページング領域はリーダーのものを使う.
+     */
+    Task *Leader() const { return leader_; }
+    Task &SetLeader(Task *leader) {
+        leader_ = leader;
+        return *this;
+    }
+    /** リーダーが作成し, まだ回収していないスレッドの ID */
+    std::vector<uint64_t> &Threads() { return threads_; }
+    /** Threads() のうち, ThreadJoin で終了を待たれているスレッドの ID */
+    std::vector<uint64_t> &Joining() { return joining_; }
+    /** Spawn で起動し, まだ Wait していない子タスクの ID */
+    std::vector<uint64_t> &Children() { return children_; }
+    /** RingSetup で登録されたシステムコールリング. アプリのアドレス空間を指す */
+    SyscallRing *Ring() const { return ring_; }
+    void SetRing(SyscallRing *ring) { ring_ = ring; }
+    /** 眠っている WaitQueue. 待っていなければ nullptr */
+    WaitQueue *WaitingOn() const { return waiting_on_; }
+    void SetWaitingOn(WaitQueue *queue) { waiting_on_ = queue; }
 
     int Level() const { return level_; }
     bool Running() const { return running_; }
+    /** これまでに CPU を使った時間(ナノ秒) */
+    uint64_t Runtime() const { return runtime_; }
+    /** 重みで割った実行時間. 公平スケジューラはこれが最小のタスクを選ぶ */
+    uint64_t VRuntime() const { return vruntime_; }
+    uint64_t Switches() const { return switches_; }
 
   private:
     uint64_t id_;
@@ -66,6 +121,15 @@ class Task {
     uint64_t dpaging_begin_{0}, dpaging_end_{0};
     uint64_t file_map_end_{0};
     std::vector<FileMapping> file_maps_{};
+    std::map<uint64_t, uint64_t> free_file_maps_{}; // 先頭 -> 末尾
+    std::vector<ElfMapping> elf_maps_{};
+    uint64_t runtime_{0}, vruntime_{0}, switches_{0};
+    Task *leader_{nullptr};
+    std::vector<uint64_t> threads_{};
+    std::vector<uint64_t> joining_{};
+    std::vector<uint64_t> children_{};
+    SyscallRing *ring_{nullptr};
+    WaitQueue *waiting_on_{nullptr};
 
     Task &SetLevel(int level) {
         level_ = level;
@@ -84,9 +148,23 @@ class TaskManager {
     // level: 0 = lowest, kMaxLevel = highest
     static const int kMaxLevel = 3;
 
+    /**
+     * kRoundRobin: 最も高いレベルのタスクを順番に一定時間ずつ実行する.
+     * kFair: レベル 1 以上のタスクを区別せず, 仮想実行時間が最小のタスクを実行する.
+     *        レベルは重みとしてだけ使う. レベル 0 は他に実行可能なタスクがないときだけ動く.
+     * 起動時設定の scheduler=rr|fair で選ぶ.
+     */
+    enum class Policy { kRoundRobin, kFair };
+    /** 重み kBaseWeight のタスクは仮想実行時間が実時間と同じ速さで進む */
+    static const unsigned int kBaseWeight = 1024;
+
     TaskManager();
     Task &NewTask();
     void SwitchTask(const TaskContext &current_ctx);
+    /** 割り込み禁止で呼ぶ. 同じレベルか, より高いレベルの他のタスクへ実行を譲る */
+    void Yield();
+    /** アイドルタスク(レベル0)以外に実行可能なタスクがなければ true */
+    bool OnlyIdleRunnable() const;
 
     void Sleep(Task *task);
     Error Sleep(uint64_t id);
@@ -96,6 +174,46 @@ class TaskManager {
     Task &CurrentTask();
     void Finish(int exit_code);
     WithError<int> WaitFinish(uint64_t task_id);
+    /**
+     * 割り込み禁止で呼ぶ. WaitFinish と同じだが, 終了する前に現在のタスクへ
+     * type のメッセージが届いたら, それを取り除いて kEmpty を返す.
+     */
+    WithError<int> WaitFinishOrMessage(uint64_t task_id, Message::Type type);
+    /** 割り込み禁止で呼ぶ. 終了して WaitFinish されていないタスクなら true */
+    bool Finished(uint64_t task_id) const {
+        return finish_tasks_.count(task_id) > 0;
+    }
+    /**
+     * 現在のタスク以外のタスクを終了させて破棄する. 終了済みなら終了コードを破棄する.
+     * 割り込み禁止で呼ぶ.
+     */
+    Error Terminate(uint64_t task_id);
+    /**
+     * 割り込み禁止で呼ぶ. task_id のタスクを誰も終了を待たないタスクにする.
+     * 終了済みなら終了コードを捨て, そうでなければ終了したときに残さない.
+     */
+    void Detach(uint64_t task_id);
+
+    /**
+     * FPU/SSE 状態の切り替え方式.
+     * kEager はタスク切り替えのたびに退避・復帰する.
+     * kLazy は CR0.TS を立てておき, 次に FPU を使ったとき(#NM)に入れ替える.
+     */
+    enum class FPUMode { kEager, kLazy };
+    /** 割り込み禁止で呼ぶ */
+    void SetFPUMode(FPUMode mode);
+    FPUMode GetFPUMode() const { return fpu_mode_; }
+    /** #NM 例外から呼ぶ. FPU の所有者を外し, その退避先を返す(なければ nullptr) */
+    uint8_t *ReleaseFPU();
+    /** #NM 例外から呼ぶ. 現在のタスクを FPU の所有者にし, その退避先を返す */
+    uint8_t *ClaimFPU();
+    uint64_t FPUTraps() const { return fpu_traps_; }
+
+    Policy SchedPolicy() const { return policy_; }
+    unsigned int Weight(const Task &task) const { return weights_[task.Level()]; }
+    template <class F> void ForEachTask(F f) const {
+        for(const auto &t : tasks_) { f(*t); }
+    }
 
   private:
     std::vector<std::unique_ptr<Task>> tasks_{};
@@ -105,11 +223,34 @@ class TaskManager {
     bool level_changed_{false};
     std::map<uint64_t, int> finish_tasks_{};     // key: ID of a finished task
     std::map<uint64_t, Task *> finish_waiter_{}; // key: ID of a finished task
+    std::set<uint64_t> detached_{}; // 終了コードを残さないタスクの ID
+    Task *fpu_owner_{nullptr}; // FPU レジスタに状態が載っているタスク
+    FPUMode fpu_mode_{FPUMode::kLazy};
+    uint64_t fpu_traps_{0};
+
+    Policy policy_{Policy::kRoundRobin};
+    std::array<unsigned int, kMaxLevel + 1> weights_{1, 1024, 2048, 4096};
+    uint64_t sched_latency_{20'000'000};     // 実行可能なタスクが一巡する目標時間
+    uint64_t min_granularity_{2'000'000};    // 1回に割り当てる最短の時間
+    uint64_t wakeup_granularity_{1'000'000}; // 起床したタスクが横取りする閾値
+    uint64_t min_vruntime_{0};
+    uint64_t exec_start_{0}; // 現在のタスクが実行を始めた時刻
 
+    void LoadSchedulerConfig();
     void ChangeLevelRunning(Task *task, int level);
+    /** 現在のタスクの実行時間を now まで加算する */
+    void Account(Task *task, uint64_t now);
+    /** 仮想実行時間が最小の実行可能なタスク(レベル 0 を除く). total_weight に重みの合計を返す */
+    Task *PickFairTask(uint64_t &total_weight) const;
+    void PlaceWokenTask(Task *task);
+    /** next に切り替える直前に呼ぶ */
+    void SwitchFPU(Task *next);
     Task *RotateCurrentRunQueue(bool current_sleep);
 };
 
 extern TaskManager *task_manager;
 
+/** タイマー割り込みハンドラが FPU を所有していない状態で実行中なら 1 */
+extern "C" volatile uint8_t fpu_in_interrupt;
+
 void InitializeTask();
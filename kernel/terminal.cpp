@@ -1,6 +1,6 @@
 #include "terminal.hpp"
+#include "app_image.hpp"
 #include "asmfunc.h"
-#include "elf.hpp"
 #include "font.hpp"
 #include "keyboard.hpp"
 #include "layer.hpp"
@@ -8,35 +8,24 @@
 #include "memory_manager.hpp"
 #include "paging.hpp"
 #include "pci.hpp"
+#include "sync.hpp"
+#include "syscall.hpp"
+#include "syscall_trace.hpp"
+#include "time_page.hpp"
 #include "timer.hpp"
 #include "uefi.hpp"
 #include "usb/classdriver/cdc.hpp"
 #include "usb/xhci/xhci.hpp"
+#include "workqueue.hpp"
 #include <cstring>
 #include <limits>
 #include <vector>
 
 namespace {
-WithError<int> MakeArgVector(char *command, char *first_arg, char **argv,
-                             int argv_len, char *argbuf, int argbuf_len) {
-    int argc = 0;
-    int argbuf_index = 0;
-
-    auto push_to_argv = [&](const char *s) {
-        if(argc >= argv_len || argbuf_index >= argbuf_len) {
-            return MAKE_ERROR(Error::kFull);
-        }
-
-        argv[argc] = &argbuf[argbuf_index];
-        ++argc;
-        strcpy(&argbuf[argbuf_index], s);
-        argbuf_index += strlen(s) + 1;
-        return MAKE_ERROR(Error::kSuccess);
-    };
-
-    if(auto err = push_to_argv(command)) { return {argc, err}; }
-
-    if(!first_arg) { return {argc, MAKE_ERROR(Error::kSuccess)}; }
+/** コマンド名と空白で区切られた引数を argv[0] からの引数の列にする */
+std::vector<std::string> SplitArgs(char *command, char *first_arg) {
+    std::vector<std::string> args{command};
+    if(!first_arg) { return args; }
 
     char *p = first_arg;
     while(true) {
@@ -50,68 +39,32 @@ WithError<int> MakeArgVector(char *command, char *first_arg, char **argv,
 
         const bool is_end = p[0] == 0;
         p[0] = 0;
-        if(auto err = push_to_argv(arg)) { return {argc, err}; }
+        args.push_back(arg);
 
         if(is_end) { break; }
 
         ++p;
     }
-
-    return {argc, MAKE_ERROR(Error::kSuccess)};
+    return args;
 }
 
-Elf64_Phdr *GetProgramHeader(Elf64_Ehdr *ehdr) {
-    return reinterpret_cast<Elf64_Phdr *>(reinterpret_cast<uintptr_t>(ehdr) +
-                                          ehdr->e_phoff);
-}
-
-uintptr_t GetFirstLoadAddress(Elf64_Ehdr *ehdr) {
-    auto phdr = GetProgramHeader(ehdr);
-    for(int i = 0; i < ehdr->e_phnum; ++i) {
-        if(phdr[i].p_type != PT_LOAD) { continue; }
-        return phdr[i].p_vaddr;
-    }
-    return 0;
-}
-
-static_assert(kBytesPerFrame >= 4096);
-
-WithError<uint64_t> CopyLoadSegments(Elf64_Ehdr *ehdr) {
-    auto phdr = GetProgramHeader(ehdr);
-    uint64_t last_addr = 0;
-    for(int i = 0; i < ehdr->e_phnum; ++i) {
-        if(phdr[i].p_type != PT_LOAD) { continue; }
-
-        LinearAddress4Level dest_addr;
-        dest_addr.value = phdr[i].p_vaddr;
-        last_addr = std::max(last_addr, phdr[i].p_vaddr + phdr[i].p_memsz);
-        const auto num_4kpages =
-            ((phdr[i].p_vaddr & 4095) + phdr[i].p_memsz + 4095) / 4096;
+WithError<int> MakeArgVector(const std::vector<std::string> &args, char **argv,
+                             int argv_len, char *argbuf, int argbuf_len) {
+    int argc = 0;
+    int argbuf_index = 0;
 
-        // setup pagemaps as readonly (writable = false)
-        if(auto err = SetupPageMaps(dest_addr, num_4kpages, false)) {
-            return {last_addr, err};
+    for(const auto &arg : args) {
+        if(argc >= argv_len || argbuf_index + arg.length() + 1 > argbuf_len) {
+            return {argc, MAKE_ERROR(Error::kFull)};
         }
 
-        const auto src = reinterpret_cast<uint8_t *>(ehdr) + phdr[i].p_offset;
-        const auto dst = reinterpret_cast<uint8_t *>(phdr[i].p_vaddr);
-        memcpy(dst, src, phdr[i].p_filesz);
-        memset(dst + phdr[i].p_filesz, 0, phdr[i].p_memsz - phdr[i].p_filesz);
-    }
-    return {last_addr, MAKE_ERROR(Error::kSuccess)};
-}
-
-WithError<uint64_t> LoadELF(Elf64_Ehdr *ehdr) {
-    if(ehdr->e_type != ET_EXEC) {
-        return {0, MAKE_ERROR(Error::kInvalidFormat)};
-    }
-
-    const auto addr_first = GetFirstLoadAddress(ehdr);
-    if(addr_first < 0xffff'8000'0000'0000) {
-        return {0, MAKE_ERROR(Error::kInvalidFormat)};
+        argv[argc] = &argbuf[argbuf_index];
+        ++argc;
+        strcpy(&argbuf[argbuf_index], arg.c_str());
+        argbuf_index += arg.length() + 1;
     }
 
-    return CopyLoadSegments(ehdr);
+    return {argc, MAKE_ERROR(Error::kSuccess)};
 }
 
 WithError<PageMapEntry *> SetupPML4(Task &current_task) {
@@ -127,12 +80,32 @@ WithError<PageMapEntry *> SetupPML4(Task &current_task) {
     return pml4;
 }
 
+/**
+ * アプリのアドレス空間を片付ける. 先にカーネルの CR3 へ切り替えるので TLB の消去は1回で済む.
+ * 走査するのは ELF からデマンドページング領域の終わりまでと,
+ * ファイルの写像からアドレス空間の末尾(スタックと引数のページ)までだけ.
+ */
 Error FreePML4(Task &current_task) {
-    const auto cr3 = current_task.Context().cr3;
-    current_task.Context().cr3 = 0;
+    const auto pml4 =
+        reinterpret_cast<PageMapEntry *>(current_task.Context().cr3);
+    current_task.Context().cr3 = KernelCR3();
     ResetCR3();
 
-    return FreePageMap(reinterpret_cast<PageMapEntry *>(cr3));
+    const uint64_t app_begin = 0xffff'8000'0000'0000;
+    const uint64_t dp_end = current_task.DPagingEnd();
+    if(dp_end > app_begin) {
+        if(auto err = CleanPageMaps(pml4, LinearAddress4Level{app_begin},
+                                    (dp_end - app_begin + 4095) / 4096)) {
+            return err;
+        }
+    }
+    const uint64_t fmap_end = current_task.FileMapEnd();
+    if(auto err = CleanPageMaps(pml4, LinearAddress4Level{fmap_end},
+                                (0 - fmap_end) / 4096)) {
+        return err;
+    }
+
+    return FreePageMap(pml4);
 }
 
 void ListAllEntries(FileDescriptor &fd, uint32_t dir_cluster) {
@@ -160,49 +133,68 @@ void ListAllEntries(FileDescriptor &fd, uint32_t dir_cluster) {
     }
 }
 
-WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry &file_entry, Task &task) {
-    PageMapEntry *temp_pml4;
-    if(auto [pml4, err] = SetupPML4(task); err) {
-        return {{}, err};
-    } else {
-        temp_pml4 = pml4;
+/**
+ * app がリンクした共有ランタイムのイメージ. app がランタイムを使わないか,
+ * app 自身がランタイムなら nullptr. 入っているランタイムが app のリンクしたものと
+ * 異なれば(識別子が違えば), 呼び出す先がずれるのでエラーにする.
+ */
+WithError<std::shared_ptr<AppImage>> LoadRuntime(const AppImage &app) {
+    if(app.RuntimeID() == 0) { return {nullptr, MAKE_ERROR(Error::kSuccess)}; }
+
+    auto [file_entry, post_slash] = fat::FindFile(kRuntimePath);
+    if(file_entry == nullptr || post_slash ||
+       file_entry->attr == fat::Attribute::kDirectory) {
+        Log(kWarn, "%s is not found\n", kRuntimePath);
+        return {nullptr, MAKE_ERROR(Error::kNoSuchEntry)};
     }
 
-    if(auto it = app_loads->find(&file_entry); it != app_loads->end()) {
-        AppLoadInfo app_load = it->second;
-        auto err = CopyPageMaps(temp_pml4, app_load.pml4, 4, 256);
-        app_load.pml4 = temp_pml4;
-        return {app_load, err};
+    auto [runtime, err] = app_images->Get(*file_entry);
+    if(err) {
+        Log(kWarn, "failed to load %s: %s\n", kRuntimePath, err.Name());
+        return {nullptr, err};
     }
-
-    std::vector<uint8_t> file_buf(file_entry.file_size);
-    fat::LoadFile(&file_buf[0], file_buf.size(), file_entry);
-
-    auto elf_header = reinterpret_cast<Elf64_Ehdr *>(&file_buf[0]);
-    if(memcmp(elf_header->e_ident,
-              "\x7f"
-              "ELF",
-              4) != 0) {
-        return {{}, MAKE_ERROR(Error::kInvalidFile)};
+    if(runtime.get() == &app) {
+        return {nullptr, MAKE_ERROR(Error::kSuccess)};
     }
+    if(runtime->RuntimeID() != app.RuntimeID()) {
+        Log(kWarn, "app was linked against runtime %#lx, but %s is %#lx\n",
+            app.RuntimeID(), kRuntimePath, runtime->RuntimeID());
+        return {nullptr, MAKE_ERROR(Error::kInvalidFormat)};
+    }
+    if(app.VAddrBegin() < runtime->VAddrEnd() &&
+       runtime->VAddrBegin() < app.VAddrEnd()) {
+        return {nullptr, MAKE_ERROR(Error::kInvalidFormat)};
+    }
+    return {runtime, MAKE_ERROR(Error::kSuccess)};
+}
 
-    auto [last_addr, err_load] = LoadELF(elf_header);
-    if(err_load) { return {{}, err_load}; }
-
-    AppLoadInfo app_load{last_addr, elf_header->e_entry, temp_pml4};
-    app_loads->insert(std::make_pair(&file_entry, app_load));
-
-    if(auto [pml4, err] = SetupPML4(task); err) {
-        return {app_load, err};
-    } else {
-        app_load.pml4 = pml4;
+WithError<AppLoadInfo> LoadApp(fat::DirectoryEntry &file_entry, Task &task) {
+    auto [image, err] = app_images->Get(file_entry);
+    if(err) { return {{}, err}; }
+
+    auto [runtime, err_runtime] = LoadRuntime(*image);
+    if(err_runtime) { return {{}, err_runtime}; }
+
+    auto [pml4, err_pml4] = SetupPML4(task);
+    if(err_pml4) { return {{}, err_pml4}; }
+
+    AppLoadInfo app_load{image->VAddrEnd(), image->Entry(), pml4,
+                         image->Segments(), image};
+    // ランタイムのページはページフォルトのときに写像する
+    if(runtime) {
+        app_load.vaddr_end = std::max(app_load.vaddr_end, runtime->VAddrEnd());
+        app_load.segments.insert(app_load.segments.end(),
+                                 runtime->Segments().begin(),
+                                 runtime->Segments().end());
+        app_load.runtime = runtime;
     }
-    auto err = CopyPageMaps(app_load.pml4, temp_pml4, 4, 256);
-    return {app_load, err};
+    return {app_load, CopyPageMaps(pml4, image->PageCache(), 4, 256)};
 }
 
+} // namespace
+
 fat::DirectoryEntry *FindCommand(const char *command,
-                                 unsigned long dir_cluster = 0) {
+                                 unsigned long dir_cluster) {
     auto file_entry = fat::FindFile(command, dir_cluster);
     if(file_entry.first != nullptr &&
        (file_entry.first->attr == fat::Attribute::kDirectory ||
@@ -221,9 +213,90 @@ fat::DirectoryEntry *FindCommand(const char *command,
     }
     return FindCommand(command, apps_entry.first->FirstCluster());
 }
-} // namespace
 
-std::map<fat::DirectoryEntry *, AppLoadInfo> *app_loads;
+namespace {
+
+void TouchFPU() { __asm__ volatile("xorps %%xmm0, %%xmm0" ::: "xmm0"); }
+
+struct CtxBench {
+    uint64_t peer_id;
+    bool use_fpu;
+    volatile bool done;
+};
+
+/** ctxbench の相手役. 起こされるたびに相手を起こして眠る */
+void TaskCtxBenchPeer(uint64_t task_id, int64_t data) {
+    auto bench = reinterpret_cast<CtxBench *>(data);
+    Task &task = task_manager->CurrentTask();
+    __asm__("cli");
+    while(!bench->done) {
+        if(bench->use_fpu) { TouchFPU(); }
+        task_manager->Wakeup(bench->peer_id);
+        task.Sleep();
+    }
+    task_manager->Finish(0);
+}
+
+/** 2つのタスクで rounds 回往復し, 切り替え1回あたりの時間(ナノ秒)を返す */
+uint64_t MeasureContextSwitch(int rounds, bool use_fpu) {
+    Task &task = task_manager->CurrentTask();
+    CtxBench bench{task.ID(), use_fpu, false};
+
+    __asm__("cli");
+    Task &peer = task_manager->NewTask().InitContext(
+        TaskCtxBenchPeer, reinterpret_cast<int64_t>(&bench));
+    const uint64_t peer_id = peer.ID();
+    peer.Wakeup();
+    task.Sleep();
+
+    const auto start = CurrentTime();
+    for(int i = 0; i < rounds; ++i) {
+        if(use_fpu) { TouchFPU(); }
+        peer.Wakeup();
+        task.Sleep();
+    }
+    const auto elapsed = CurrentTime() - start;
+
+    bench.done = true;
+    peer.Wakeup();
+    task_manager->WaitFinish(peer_id);
+    __asm__("sti");
+    return elapsed / (2 * rounds);
+}
+
+/** 何も読めず, 書いた内容を捨てるファイル. バックグラウンドジョブの標準入力にする */
+class NullFileDescriptor : public FileDescriptor {
+  public:
+    size_t Read(void *buf, size_t len) override { return 0; }
+    size_t Write(const void *buf, size_t len) override { return len; }
+    size_t Size() const override { return 0; }
+    size_t Load(void *buf, size_t len, size_t offset) override { return 0; }
+};
+
+struct PipeBench {
+    PipeDescriptor *pipe;
+    size_t total_bytes, chunk_bytes;
+};
+
+/** pipebench の書き手. total_bytes を chunk_bytes ずつ書いてパイプを閉じる */
+void TaskPipeBenchWriter(uint64_t task_id, int64_t data) {
+    auto bench = reinterpret_cast<PipeBench *>(data);
+    {
+        std::vector<uint8_t> buf(bench->chunk_bytes, 0x5a);
+        size_t written = 0;
+        while(written < bench->total_bytes) {
+            const auto len =
+                std::min(bench->chunk_bytes, bench->total_bytes - written);
+            const auto n = bench->pipe->Write(buf.data(), len);
+            if(n == 0) { break; }
+            written += n;
+        }
+    }
+    bench->pipe->FinishWrite();
+    __asm__("cli");
+    task_manager->Finish(0);
+}
+} // namespace
 
 Terminal::Terminal(Task &task, const TerminalDescriptor *term_desc)
     : task_{task} {
@@ -299,6 +372,8 @@ Rectangle<int> Terminal::InputKey(uint8_t modifier, uint8_t keycode,
             Scroll1();
         }
         ExecuteLine();
+        // 実行中のアプリが kJobOutput を受け取って捨てていることがあるので, ここでも読む
+        DrainJobOutput();
         Print(">");
         draw_area.pos = ToplevelWindow::kTopLeftMargin;
         draw_area.size = window_->InnerSize();
@@ -345,10 +420,141 @@ void Terminal::Scroll1() {
 }
 
 void Terminal::ExecuteLine() {
-    char *command = &linebuf_[0];
-    char *first_arg = strchr(&linebuf_[0], ' ');
-    char *redir_char = strchr(&linebuf_[0], '>');
-    char *pipe_char = strchr(&linebuf_[0], '|');
+    const std::string command_line{&linebuf_[0]};
+    char *line = &linebuf_[0];
+
+    bool background = false;
+    char *line_end = &line[strlen(line)];
+    while(line_end > line && isspace(line_end[-1])) { --line_end; }
+    if(line_end > line && line_end[-1] == '&') {
+        background = true;
+        line_end[-1] = 0;
+    }
+
+    std::vector<char *> stages;
+    for(char *stage = line; stage;) {
+        char *next = strchr(stage, '|');
+        if(next) { *next++ = 0; }
+        while(isspace(*stage)) { ++stage; }
+        stages.push_back(stage);
+        stage = next;
+    }
+
+    if(!background && stages.size() == 1) {
+        last_exit_code_ = ExecuteCommand(stages[0]);
+        return;
+    }
+    for(auto stage : stages) {
+        if(stage[0] == 0) {
+            PrintToFD(*files_[2], "empty command in pipeline\n");
+            last_exit_code_ = 1;
+            return;
+        }
+    }
+
+    // ステージ i の標準出力とステージ i+1 の標準入力を pipes[i] でつなぐ
+    std::vector<std::shared_ptr<PipeDescriptor>> pipes(stages.size() - 1);
+    for(auto &pipe : pipes) { pipe = std::make_shared<PipeDescriptor>(); }
+
+    // フォアグラウンドなら先頭のステージはこのタスクで実行する
+    std::vector<uint64_t> task_ids;
+    auto stage_files = files_;
+    if(background && show_window_) {
+        // ジョブのタスクからこのターミナルへ直接描かず, job_output_ 経由で表示する
+        if(!job_output_) {
+            job_output_ = std::make_shared<JobOutputDescriptor>(task_.ID());
+        }
+        stage_files[1] = stage_files[2] = job_output_;
+    }
+    for(size_t i = background ? 0 : 1; i < stages.size(); ++i) {
+        auto term_desc = new TerminalDescriptor{stages[i], true, false,
+                                                stage_files};
+        if(i > 0) {
+            term_desc->pipe_in = pipes[i - 1];
+            term_desc->files[0] = pipes[i - 1];
+        } else {
+            term_desc->files[0] = std::make_shared<NullFileDescriptor>();
+        }
+        if(i + 1 < stages.size()) {
+            term_desc->pipe_out = pipes[i];
+            term_desc->files[1] = pipes[i];
+        }
+
+        task_ids.push_back(
+            task_manager->NewTask()
+                .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
+                .Wakeup()
+                .ID());
+    }
+
+    if(background) {
+        jobs_.push_back(Job{next_job_id_++, command_line, task_ids});
+        PrintToFD(*files_[1], "[%d]", jobs_.back().id);
+        for(auto id : task_ids) { PrintToFD(*files_[1], " %lu", id); }
+        PrintToFD(*files_[1], "\n");
+        last_exit_code_ = 0;
+        return;
+    }
+
+    (*layer_task_map)[layer_id_] = task_ids.front();
+    auto original_stdout = files_[1];
+    files_[1] = pipes[0];
+    ExecuteCommand(stages[0]);
+    files_[1] = original_stdout;
+    pipes[0]->FinishWrite();
+
+    last_exit_code_ = WaitTasks(task_ids);
+    __asm__("cli");
+    (*layer_task_map)[layer_id_] = task_.ID();
+    __asm__("sti");
+}
+
+void Terminal::DrainJobOutput() {
+    if(!job_output_) { return; }
+    char buf[256];
+    bool printed = false;
+    while(const size_t n = job_output_->Drain(buf, sizeof(buf))) {
+        Print(buf, n);
+        printed = true;
+    }
+    if(printed && show_window_) { Redraw(); }
+}
+
+void Terminal::AbandonJobs() {
+    if(job_output_) { job_output_->Close(); }
+    __asm__("cli");
+    for(const auto &job : jobs_) {
+        for(auto id : job.task_ids) { task_manager->Detach(id); }
+    }
+    __asm__("sti");
+    jobs_.clear();
+}
+
+int Terminal::WaitTasks(const std::vector<uint64_t> &task_ids) {
+    int exit_code = 0;
+    for(auto id : task_ids) {
+        // 待つ間もジョブの出力を読まないと, パイプが満杯になったジョブが進まない
+        while(true) {
+            __asm__("cli");
+            auto [ec, err] =
+                task_manager->WaitFinishOrMessage(id, Message::kJobOutput);
+            __asm__("sti");
+            if(err.Cause() == Error::kEmpty) {
+                DrainJobOutput();
+                continue;
+            }
+            if(err) { Log(kWarn, "failed to wait finish: %s\n", err.Name()); }
+            exit_code = ec;
+            break;
+        }
+    }
+    return exit_code;
+}
+
+int Terminal::ExecuteCommand(char *line) {
+    char *command = line;
+    char *first_arg = strchr(line, ' ');
+    char *redir_char = strchr(line, '>');
     if(first_arg) {
         *first_arg = 0;
         do { ++first_arg; } while(isspace(*first_arg));
@@ -368,38 +574,16 @@ void Terminal::ExecuteLine() {
             if(err) {
                 PrintToFD(*files_[2], "Failed to create a redirect file: %s\n",
                           err.Name());
-                return;
+                return 1;
             }
             file = new_file;
         } else if(file->attr == fat::Attribute::kDirectory || post_slash) {
             PrintToFD(*files_[2], "Cannot redirect to a directory\n");
-            return;
+            return 1;
         }
         files_[1] = std::make_shared<fat::FileDescriptor>(*file);
     }
 
-    std::shared_ptr<PipeDescriptor> pipe_fd;
-    uint64_t subtask_id = 0;
-
-    if(pipe_char) {
-        *pipe_char = 0;
-        char *subcommand = &pipe_char[1];
-        while(isspace(*subcommand)) { ++subcommand; }
-
-        auto &subtask = task_manager->NewTask();
-        pipe_fd = std::make_shared<PipeDescriptor>(subtask);
-        auto term_desc = new TerminalDescriptor{
-            subcommand, true, false, {pipe_fd, files_[1], files_[2]}};
-        files_[1] = pipe_fd;
-
-        subtask_id =
-            subtask
-                .InitContext(TaskTerminal, reinterpret_cast<int64_t>(term_desc))
-                .Wakeup()
-                .ID();
-        (*layer_task_map)[layer_id_] = subtask_id;
-    }
-
     /*echoコマンド*/
     if(strcmp(command, "echo") == 0) {
         if(first_arg && first_arg[0] == '$') {
@@ -500,6 +684,232 @@ void Terminal::ExecuteLine() {
         PrintToFD(*files_[1], "Phys total: %lu frames (%llu MiB)\n",
                   p_stat.total_frames,
                   p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
+    } else if(strcmp(command, "appcache") == 0) {
+        const auto stat = app_images->GetStat();
+        PrintToFD(*files_[1], "images   : %lu\n", stat.images);
+        PrintToFD(*files_[1], "frames   : %lu / %lu\n", stat.frames,
+                  stat.max_frames);
+        PrintToFD(*files_[1], "hits     : %lu\n", stat.hits);
+        PrintToFD(*files_[1], "misses   : %lu\n", stat.misses);
+        PrintToFD(*files_[1], "reloads  : %lu\n", stat.reloads);
+        PrintToFD(*files_[1], "evictions: %lu\n", stat.evictions);
+    } else if(strcmp(command, "idlestat") == 0) {
+        __asm__("cli");
+        const auto stat = timer_manager->GetIdleStat();
+        __asm__("sti");
+        const uint64_t uptime_ms = CurrentTime() / 1'000'000;
+        const uint64_t idle_ms = stat.idle_ns / 1'000'000;
+        const uint64_t uptime_s = uptime_ms / 1000 ? uptime_ms / 1000 : 1;
+        PrintToFD(*files_[1], "uptime     : %lu ms\n", uptime_ms);
+        PrintToFD(*files_[1], "idle       : %lu ms (%lu.%lu%%)\n", idle_ms,
+                  idle_ms * 100 / uptime_ms, idle_ms * 1000 / uptime_ms % 10);
+        PrintToFD(*files_[1], "wakeups    : %lu (%lu/s)\n", stat.wakeups,
+                  stat.wakeups / uptime_s);
+        PrintToFD(*files_[1], "timer irqs : %lu (%lu/s)\n",
+                  stat.timer_interrupts, stat.timer_interrupts / uptime_s);
+    } else if(strcmp(command, "ps") == 0) {
+        struct TaskStat {
+            uint64_t id;
+            int level;
+            unsigned int weight;
+            bool running;
+            uint64_t runtime, vruntime, switches;
+        };
+        std::vector<TaskStat> stats;
+        __asm__("cli");
+        const auto policy = task_manager->SchedPolicy();
+        task_manager->ForEachTask([&stats](const Task &t) {
+            stats.push_back({t.ID(), t.Level(), task_manager->Weight(t),
+                             t.Running(), t.Runtime(), t.VRuntime(),
+                             t.Switches()});
+        });
+        __asm__("sti");
+
+        PrintToFD(*files_[1], "scheduler: %s\n",
+                  policy == TaskManager::Policy::kFair ? "fair" : "rr");
+        PrintToFD(*files_[1],
+                  "   ID LV WEIGHT S  RUNTIME(ms) VRUNTIME(ms)  SWITCHES\n");
+        for(const auto &st : stats) {
+            PrintToFD(*files_[1], "%5lu %2d %6u %c %12lu %12lu %9lu\n", st.id,
+                      st.level, st.weight, st.running ? 'R' : 'S',
+                      st.runtime / 1'000'000, st.vruntime / 1'000'000,
+                      st.switches);
+        }
+    } else if(strcmp(command, "inputlat") == 0) {
+        // 割り込みからワーカータスクで処理が始まるまでの時間
+        const struct {
+            const char *name;
+            Work *work;
+        } works[] = {{"xhci event", &xhci_event_work},
+                     {"e1000 intr", &e1000_intr_work},
+                     {"net softirq", &net_softirq_work}};
+        const bool reset = first_arg && strcmp(first_arg, "reset") == 0;
+        for(const auto &w : works) {
+            __asm__("cli");
+            const auto lat = w.work->latency;
+            if(reset) { w.work->latency = {}; }
+            __asm__("sti");
+            PrintToFD(*files_[1],
+                      "%-12s: %8lu times, avg %6lu us, max %6lu us\n", w.name,
+                      lat.count,
+                      lat.count ? lat.total_ns / lat.count / 1000 : 0,
+                      lat.max_ns / 1000);
+        }
+    } else if(strcmp(command, "ctxbench") == 0) {
+        int rounds = first_arg ? atoi(first_arg) : 0;
+        if(rounds <= 0) { rounds = 10000; }
+
+        __asm__("cli");
+        const auto mode = task_manager->GetFPUMode();
+        __asm__("sti");
+        const struct {
+            const char *name;
+            TaskManager::FPUMode mode;
+        } modes[] = {{"eager", TaskManager::FPUMode::kEager},
+                     {"lazy", TaskManager::FPUMode::kLazy}};
+        for(const auto &m : modes) {
+            __asm__("cli");
+            task_manager->SetFPUMode(m.mode);
+            const auto traps = task_manager->FPUTraps();
+            __asm__("sti");
+            const auto int_ns = MeasureContextSwitch(rounds, false);
+            const auto fpu_ns = MeasureContextSwitch(rounds, true);
+            __asm__("cli");
+            const auto nm = task_manager->FPUTraps() - traps;
+            __asm__("sti");
+            PrintToFD(*files_[1],
+                      "%-5s: %lu ns/switch (integer), %lu ns/switch (fpu), "
+                      "%lu #NM\n",
+                      m.name, int_ns, fpu_ns, nm);
+        }
+        __asm__("cli");
+        task_manager->SetFPUMode(mode);
+        __asm__("sti");
+    } else if(strcmp(command, "fontbench") == 0) {
+        // fontbench [screens] [distinct]: 漢字で埋めた画面を画面外のウィンドウに描く
+        int screens = first_arg ? atoi(first_arg) : 0;
+        if(screens <= 0) { screens = 10; }
+        int distinct = 0;
+        if(first_arg) {
+            if(auto p = strchr(first_arg, ' ')) { distinct = atoi(p + 1); }
+        }
+        if(distinct <= 0) { distinct = 256; }
+
+        Window canvas{8 * kColumns, 16 * kRows, screen_config.pixel_format};
+        const int glyphs_per_screen = kRows * (kColumns / 2);
+        auto draw_screens = [&](int n) {
+            int k = 0;
+            const auto start = CurrentTime();
+            for(int i = 0; i < n; ++i) {
+                for(int y = 0; y < kRows; ++y) {
+                    for(int x = 0; x < kColumns / 2; ++x, ++k) {
+                        WriteUnicode(*canvas.Writer(), {16 * x, 16 * y},
+                                     U'\u4e00' + k % distinct, {255, 255, 255});
+                    }
+                }
+            }
+            return (CurrentTime() - start) / (n * glyphs_per_screen);
+        };
+
+        ClearGlyphCache();
+        const auto before = GetGlyphCacheStat();
+        const auto cold_ns = draw_screens(1);
+        const auto warm_ns = draw_screens(screens);
+        const auto after = GetGlyphCacheStat();
+        PrintToFD(*files_[1], "cold: %lu ns/glyph, warm: %lu ns/glyph\n",
+                  cold_ns, warm_ns);
+        PrintToFD(*files_[1],
+                  "%d glyphs x %d screens, %d distinct: "
+                  "%lu hits, %lu misses, %lu evictions\n",
+                  glyphs_per_screen, screens + 1, distinct,
+                  after.hits - before.hits, after.misses - before.misses,
+                  after.evictions - before.evictions);
+    } else if(strcmp(command, "pipebench") == 0) {
+        // pipebench [MiB] [chunk]: 別タスクが書いたデータをパイプ越しに読む
+        int mib = first_arg ? atoi(first_arg) : 0;
+        if(mib <= 0) { mib = 64; }
+        int chunk = 0;
+        if(first_arg) {
+            if(auto p = strchr(first_arg, ' ')) { chunk = atoi(p + 1); }
+        }
+        if(chunk <= 0) { chunk = 4096; }
+
+        auto pipe = std::make_shared<PipeDescriptor>();
+        PipeBench bench{pipe.get(), static_cast<size_t>(mib) << 20,
+                        static_cast<size_t>(chunk)};
+        std::vector<uint8_t> buf(chunk);
+        size_t read_bytes = 0;
+
+        const auto start = CurrentTime();
+        __asm__("cli");
+        const uint64_t writer_id =
+            task_manager->NewTask()
+                .InitContext(TaskPipeBenchWriter,
+                             reinterpret_cast<int64_t>(&bench))
+                .Wakeup()
+                .ID();
+        __asm__("sti");
+        while(auto n = pipe->Read(buf.data(), buf.size())) { read_bytes += n; }
+        const auto elapsed = CurrentTime() - start;
+        __asm__("cli");
+        task_manager->WaitFinish(writer_id);
+        __asm__("sti");
+
+        const auto us = std::max<uint64_t>(elapsed / 1000, 1);
+        PrintToFD(*files_[1], "%lu bytes in %lu us: %lu MB/s (chunk %d)\n",
+                  read_bytes, us, read_bytes / us, chunk);
+        PrintToFD(*files_[1], "reader waits %lu, writer waits %lu\n",
+                  pipe->ReadWaits(), pipe->WriteWaits());
+    } else if(strcmp(command, "jobs") == 0) {
+        for(auto it = jobs_.begin(); it != jobs_.end();) {
+            __asm__("cli");
+            const bool done = std::all_of(
+                it->task_ids.begin(), it->task_ids.end(),
+                [](uint64_t id) { return task_manager->Finished(id); });
+            __asm__("sti");
+            if(!done) {
+                PrintToFD(*files_[1], "[%d] Running  %s\n", it->id,
+                          it->command_line.c_str());
+                ++it;
+                continue;
+            }
+            const int ec = WaitTasks(it->task_ids);
+            PrintToFD(*files_[1], "[%d] Done(%d)  %s\n", it->id, ec,
+                      it->command_line.c_str());
+            it = jobs_.erase(it);
+        }
+    } else if(strcmp(command, "wait") == 0) {
+        // wait [%job]: 指定したジョブ(省略時はすべてのジョブ)の終了を待つ
+        int job_id = 0;
+        if(first_arg && first_arg[0]) {
+            job_id = atoi(first_arg[0] == '%' ? &first_arg[1] : first_arg);
+        }
+        bool found = job_id == 0;
+        for(auto it = jobs_.begin(); it != jobs_.end();) {
+            if(job_id != 0 && it->id != job_id) {
+                ++it;
+                continue;
+            }
+            found = true;
+            exit_code = WaitTasks(it->task_ids);
+            it = jobs_.erase(it);
+        }
+        if(!found) {
+            PrintToFD(*files_[2], "wait: no such job: %d\n", job_id);
+            exit_code = 1;
+        }
+    } else if(strcmp(command, "syscallstat") == 0) {
+        if(first_arg && strcmp(first_arg, "on") == 0) {
+            EnableSyscallStat(true);
+        } else if(first_arg && strcmp(first_arg, "off") == 0) {
+            EnableSyscallStat(false);
+        } else if(first_arg && strcmp(first_arg, "reset") == 0) {
+            ResetSyscallStats();
+        } else {
+            PrintSyscallStat();
+        }
+    } else if(strcmp(command, "strace") == 0) {
+        exit_code = Strace(first_arg);
     } else if(strcmp(command, "date") == 0) {
         EFI_TIME t;
         uefi_rt->GetTime(&t, nullptr);
@@ -575,22 +985,108 @@ void Terminal::ExecuteLine() {
         }
     }
 
-    if(pipe_fd) {
-        pipe_fd->FinishWrite();
-        __asm__("cli");
-        auto [ec, err] = task_manager->WaitFinish(subtask_id);
-        (*layer_task_map)[layer_id_] = task_.ID();
-        __asm__("sti");
-        if(err) { Log(kWarn, "failed to wait finish: %s\n", err.Name()); }
-        exit_code = ec;
+    files_[1] = original_stdout;
+    return exit_code;
+}
+
+void Terminal::PrintSyscallStat() {
+    const auto stats = GetSyscallStats();
+    PrintToFD(*files_[1], "tracing: %s\n",
+              SyscallStatEnabled() ? "on" : "off");
+    PrintToFD(*files_[1], "%-16s %8s %6s %9s %9s %9s\n", "SYSCALL", "CALLS",
+              "ERRORS", "AVG(us)", "P99(us)", "MAX(us)");
+    for(size_t nr = 0; nr < stats.size(); ++nr) {
+        const auto &st = stats[nr];
+        if(st.count == 0) { continue; }
+
+        // 99% の呼び出しが収まる区間の上端
+        uint64_t seen = 0;
+        int b = 0;
+        for(; b < kSyscallHistBuckets - 1; ++b) {
+            seen += st.hist[b];
+            if(seen * 100 >= st.count * 99) { break; }
+        }
+        PrintToFD(*files_[1], "%-16s %8lu %6lu %9lu %9lu %9lu\n",
+                  SyscallName(nr), st.count, st.errors,
+                  CyclesToNs(st.total_cycles / st.count) / 1000,
+                  CyclesToNs(2ul << b) / 1000,
+                  CyclesToNs(st.max_cycles) / 1000);
     }
 
-    last_exit_code_ = exit_code;
-    files_[1] = original_stdout;
+    // 合計時間の長いタスクから順に, 最も多く呼んだシステムコールを示す
+    auto task_stats = GetTaskSyscallStats();
+    std::sort(task_stats.begin(), task_stats.end(),
+              [](const auto &a, const auto &b) {
+                  return a.total_cycles > b.total_cycles;
+              });
+    PrintToFD(*files_[1], "\n%5s %8s %10s  %s\n", "TASK", "CALLS",
+              "TOTAL(ms)", "TOP SYSCALL");
+    for(const auto &ts : task_stats) {
+        const auto top = std::max_element(ts.counts.begin(), ts.counts.end());
+        PrintToFD(*files_[1], "%5lu %8lu %10lu  %s (%lu)\n", ts.task_id,
+                  ts.count, CyclesToNs(ts.total_cycles) / 1'000'000,
+                  SyscallName(top - ts.counts.begin()), *top);
+    }
+}
+
+int Terminal::Strace(char *args) {
+    if(args == nullptr || args[0] == 0) {
+        PrintToFD(*files_[2], "Usage: strace <command> [args...]\n");
+        return 1;
+    }
+
+    char *command = args;
+    char *first_arg = strchr(args, ' ');
+    if(first_arg) {
+        *first_arg = 0;
+        do { ++first_arg; } while(isspace(*first_arg));
+    }
+
+    auto file_entry = FindCommand(command);
+    if(!file_entry) {
+        PrintToFD(*files_[2], "no such command: %s\n", command);
+        return 1;
+    }
+
+    // アプリの出力と混ざらないよう, 記録はアプリの終了後にまとめて表示する
+    StartSyscallEventTrace(task_.ID());
+    auto [ec, err] = ExecuteFile(*file_entry, command, first_arg);
+    uint64_t dropped;
+    const auto events = StopSyscallEventTrace(&dropped);
+
+    const uint64_t base = events.empty() ? 0 : events[0].tsc;
+    for(const auto &e : events) {
+        PrintToFD(*files_[1], "%8lu [%lu] %s(%#lx, %#lx, %#lx) = ",
+                  CyclesToNs(e.tsc - base) / 1000, e.task_id,
+                  SyscallName(e.nr), e.args[0], e.args[1], e.args[2]);
+        if(e.error) {
+            PrintToFD(*files_[1], "%#lx err %d", e.value, e.error);
+        } else {
+            PrintToFD(*files_[1], "%#lx", e.value);
+        }
+        PrintToFD(*files_[1], " <%lu us>\n", CyclesToNs(e.cycles) / 1000);
+    }
+    if(dropped) {
+        PrintToFD(*files_[1], "(%lu calls not recorded)\n", dropped);
+    }
+
+    if(err) {
+        PrintToFD(*files_[2], "failed to exec file: %s\n", err.Name());
+        return -ec;
+    }
+    return ec;
 }
 
 WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
                                      char *command, char *first_arg) {
+    return ExecuteApp(file_entry, SplitArgs(command, first_arg),
+                      {files_.begin(), files_.end()});
+}
+
+WithError<int>
+ExecuteApp(fat::DirectoryEntry &file_entry,
+           const std::vector<std::string> &args,
+           const std::vector<std::shared_ptr<FileDescriptor>> &files) {
     __asm__("cli");
     auto &task = task_manager->CurrentTask();
     __asm__("sti");
@@ -605,8 +1101,7 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
     auto argbuf = reinterpret_cast<char *>(args_frame_addr.value +
                                            sizeof(char *) * argv_len);
     int argbuf_len = 4096 - sizeof(char *) * argv_len;
-    auto argc =
-        MakeArgVector(command, first_arg, argv, argv_len, argbuf, argbuf_len);
+    auto argc = MakeArgVector(args, argv, argv_len, argbuf, argbuf_len);
     if(argc.error) { return {0, argc.error}; }
 
     // #@@range_begin(increase_appstack)
@@ -617,28 +1112,55 @@ WithError<int> Terminal::ExecuteFile(fat::DirectoryEntry &file_entry,
         return {0, err};
     }
 
-    for(int i = 0; i < files_.size(); ++i) {
-        task.Files().push_back(files_[i]);
-    }
+    static_assert(TIME_PAGE_ADDR == 0xffff'ffff'ffff'f000 - stack_size - 4096);
+    if(auto err = MapTimePage()) { return {0, err}; }
+
+    for(const auto &file : files) { task.Files().push_back(file); }
 
     const uint64_t elf_next_page =
         (app_load.vaddr_end + 4095) & 0xffff'ffff'ffff'f000;
+    task.ElfMaps() = app_load.segments;
     task.SetDPagingBegin(elf_next_page);
     task.SetDPagingEnd(elf_next_page);
 
-    task.SetFileMapEnd(stack_frame_addr.value);
+    task.SetFileMapEnd(TIME_PAGE_ADDR);
 
     int ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
                       stack_frame_addr.value + stack_size - 8,
                       &task.OSStackPointer());
 
+    // 残っているスレッドを終了させてからアドレス空間を片付ける
+    __asm__("cli");
+    for(const auto tid : task.Threads()) {
+        timer_manager->CancelAppTimers(tid);
+        task_manager->Terminate(tid);
+    }
+    // 待っていた側より先に終了させたスレッドの終了コードが残るので捨てる
+    for(const auto tid : task.Joining()) { task_manager->Terminate(tid); }
+    task.Threads().clear();
+    task.Joining().clear();
+    // Wait されなかった子はそのまま走り続け, 終了コードは残さない
+    for(const auto pid : task.Children()) { task_manager->Detach(pid); }
+    task.Children().clear();
+    FutexForget(GetCR3());
+    __asm__("sti");
+
     task.Files().clear();
     task.FileMaps().clear();
+    task.ClearFreeFileMapRanges();
+    task.ElfMaps().clear();
+    task.SetRing(nullptr);
 
-    if(auto err = CleanPageMaps(LinearAddress4Level{0xffff'8000'0000'0000})) {
-        return {ret, err};
-    }
-    return {ret, FreePML4(task)};
+    __asm__("cli");
+    timer_manager->CancelAppTimers(task.ID());
+    __asm__("sti");
+
+    auto err_free = FreePML4(task);
+    // イメージの参照を外してから, 上限を超えた分を追い出す
+    app_load.image.reset();
+    app_load.runtime.reset();
+    app_images->Shrink();
+    return {ret, err_free};
 }
 
 void Terminal::Print(char32_t c) {
@@ -756,6 +1278,8 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     }
 
     if(term_desc && term_desc->exit_after_command) {
+        if(term_desc->pipe_in) { term_desc->pipe_in->FinishRead(); }
+        if(term_desc->pipe_out) { term_desc->pipe_out->FinishWrite(); }
         delete term_desc;
         __asm__("cli");
         task_manager->Finish(terminal->LastExitCode());
@@ -809,7 +1333,11 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
         case Message::kWindowActive:
             window_isactive = msg->arg.window_active.activate;
             break;
+        case Message::kJobOutput:
+            terminal->DrainJobOutput();
+            break;
         case Message::kWindowClose:
+            terminal->AbandonJobs();
             CloseLayer(msg->arg.window_close.layer_id);
             __asm__("cli");
             task_manager->Finish(terminal->LastExitCode());
@@ -820,6 +1348,20 @@ void TaskTerminal(uint64_t task_id, int64_t data) {
     }
 }
 
+void TaskApp(uint64_t task_id, int64_t data) {
+    const auto info = reinterpret_cast<AppSpawnInfo *>(data);
+    auto [ec, err] = ExecuteApp(*info->file_entry, info->args, info->files);
+    if(err) {
+        Log(kWarn, "failed to spawn %s: %s\n", info->args[0].c_str(),
+            err.Name());
+        ec = -1; // 起動できなかったことを Wait に知らせる
+    }
+    delete info;
+
+    __asm__("cli");
+    task_manager->Finish(ec);
+}
+
 TerminalFileDescriptor::TerminalFileDescriptor(Terminal &term) : term_{term} {}
 
 size_t TerminalFileDescriptor::Read(void *buf, size_t len) {
@@ -834,6 +1376,10 @@ size_t TerminalFileDescriptor::Read(void *buf, size_t len) {
         }
         __asm__("sti");
 
+        if(msg->type == Message::kJobOutput) {
+            term_.DrainJobOutput();
+            continue;
+        }
         if(msg->type != Message::kKeyPush || !msg->arg.keyboard.press) {
             continue;
         }
@@ -864,63 +1410,147 @@ size_t TerminalFileDescriptor::Load(void *buf, size_t len, size_t offset) {
     return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task &task) : task_{task} {}
+JobOutputDescriptor::JobOutputDescriptor(uint64_t term_task_id)
+    : term_task_id_{term_task_id} {}
 
-size_t PipeDescriptor::Read(void *buf, size_t len) {
-    if(len_ > 0) {
-        const size_t copy_bytes = std::min(len_, len);
-        memcpy(buf, data_, copy_bytes);
-        len_ -= copy_bytes;
-        memmove(data_, &data_[copy_bytes], len_);
-        return copy_bytes;
-    }
+size_t JobOutputDescriptor::Write(const void *buf, size_t len) {
+    auto src = reinterpret_cast<const uint8_t *>(buf);
+    size_t written = 0;
+    // 満杯で待つ前に溜まった分を知らせるよう, 半分ずつ書いては知らせる
+    while(written < len) {
+        const size_t chunk =
+            std::min(len - written, PipeDescriptor::kCapacity / 2);
+        const size_t n = pipe_.Write(&src[written], chunk);
+        written += n;
 
-    if(closed_) { return 0; }
-
-    while(true) {
         __asm__("cli");
-        auto msg = task_.ReceiveMessage();
-        if(!msg) {
-            task_.Sleep();
-            continue;
+        if(!notified_ && n > 0) {
+            notified_ = true;
+            task_manager->SendMessage(term_task_id_,
+                                      Message{Message::kJobOutput});
         }
         __asm__("sti");
+        if(n < chunk) { break; } // ターミナルが閉じた
+    }
+    // 閉じたターミナルへの出力は捨てたものとして成功させる
+    return len;
+}
+
+size_t JobOutputDescriptor::Drain(void *buf, size_t len) {
+    __asm__("cli");
+    notified_ = false;
+    __asm__("sti");
+    return pipe_.TryRead(buf, len);
+}
 
-        if(msg->type != Message::kPipe) { continue; }
+void JobOutputDescriptor::Close() { pipe_.FinishRead(); }
 
-        if(msg->arg.pipe.len == 0) {
-            closed_ = true;
-            return 0;
-        }
+PipeDescriptor::PipeDescriptor() {
+    auto frame = memory_manager->Allocate(kCapacity / kBytesPerFrame);
+    if(frame.error) {
+        Log(kError, "failed to allocate pipe buffer: %s\n", frame.error.Name());
+        return;
+    }
+    buf_ = reinterpret_cast<uint8_t *>(frame.value.Frame());
+}
 
-        const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-        memcpy(buf, msg->arg.pipe.data, copy_bytes);
-        len_ = msg->arg.pipe.len - copy_bytes;
-        memcpy(data_, &msg->arg.pipe.data[copy_bytes], len_);
-        return copy_bytes;
+PipeDescriptor::~PipeDescriptor() {
+    if(buf_) {
+        const FrameID frame{reinterpret_cast<uintptr_t>(buf_) / kBytesPerFrame};
+        memory_manager->Free(frame, kCapacity / kBytesPerFrame);
     }
 }
 
+size_t PipeDescriptor::Read(void *buf, size_t len) {
+    if(buf_ == nullptr || len == 0) { return 0; }
+
+    read_lock_.Lock();
+    __asm__("cli");
+    while(tail_ == head_ && !write_closed_) {
+        ++read_waits_;
+        readers_.Wait();
+    }
+    const size_t copy_bytes = std::min(len, tail_ - head_);
+    __asm__("sti");
+
+    // 書き手は head_ より前を上書きしないので, コピー中は割り込みを許可してよい
+    CopyOut(reinterpret_cast<uint8_t *>(buf), head_, copy_bytes);
+
+    __asm__("cli");
+    head_ += copy_bytes;
+    if(!writers_.Empty() && kCapacity - (tail_ - head_) >= kCapacity / 2) {
+        writers_.WakeAll();
+    }
+    __asm__("sti");
+    read_lock_.Unlock();
+    return copy_bytes;
+}
+
 size_t PipeDescriptor::Write(const void *buf, size_t len) {
-    auto bufc = reinterpret_cast<const char *>(buf);
-    Message msg{Message::kPipe};
-    size_t sent_bytes = 0;
-    while(sent_bytes < len) {
-        msg.arg.pipe.len =
-            std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-        memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-        sent_bytes += msg.arg.pipe.len;
+    if(buf_ == nullptr) { return 0; }
+    auto src = reinterpret_cast<const uint8_t *>(buf);
+
+    write_lock_.Lock();
+    size_t written = 0;
+    while(written < len) {
+        __asm__("cli");
+        while(tail_ - head_ == kCapacity && !read_closed_) {
+            ++write_waits_;
+            writers_.Wait();
+        }
+        if(read_closed_) {
+            __asm__("sti");
+            break;
+        }
+        const size_t copy_bytes =
+            std::min(len - written, kCapacity - (tail_ - head_));
+        __asm__("sti");
+
+        CopyIn(tail_, &src[written], copy_bytes);
+
         __asm__("cli");
-        task_.SendMessage(msg);
+        const bool was_empty = tail_ == head_;
+        tail_ += copy_bytes;
+        if(was_empty) { readers_.WakeAll(); }
         __asm__("sti");
+        written += copy_bytes;
     }
-    return len;
+    write_lock_.Unlock();
+    return written;
+}
+
+size_t PipeDescriptor::TryRead(void *buf, size_t len) {
+    __asm__("cli");
+    const bool empty = tail_ == head_;
+    __asm__("sti");
+    // 読み手は1つだけなので, 空でなければ Read は待たずに戻る
+    return empty ? 0 : Read(buf, len);
 }
 
 void PipeDescriptor::FinishWrite() {
-    Message msg{Message::kPipe};
-    msg.arg.pipe.len = 0;
     __asm__("cli");
-    task_.SendMessage(msg);
+    write_closed_ = true;
+    readers_.WakeAll();
     __asm__("sti");
 }
+
+void PipeDescriptor::FinishRead() {
+    __asm__("cli");
+    read_closed_ = true;
+    writers_.WakeAll();
+    __asm__("sti");
+}
+
+void PipeDescriptor::CopyIn(size_t pos, const uint8_t *src, size_t len) {
+    const size_t offset = pos % kCapacity;
+    const size_t first = std::min(len, kCapacity - offset);
+    memcpy(&buf_[offset], src, first);
+    memcpy(buf_, &src[first], len - first);
+}
+
+void PipeDescriptor::CopyOut(uint8_t *dst, size_t pos, size_t len) const {
+    const size_t offset = pos % kCapacity;
+    const size_t first = std::min(len, kCapacity - offset);
+    memcpy(dst, &buf_[offset], first);
+    memcpy(&dst[first], buf_, len - first);
+}
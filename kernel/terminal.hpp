@@ -1,6 +1,8 @@
 #pragma once
+#include "app_image.hpp"
 #include "fat.hpp"
 #include "layer.hpp"
+#include "sync.hpp"
 #include "task.hpp"
 #include "window.hpp"
 #include <array>
@@ -8,19 +10,31 @@
 #include <map>
 #include <memory>
 #include <optional>
-
+#include <string>
+#include <vector>
+
+/**
+ * 起動するアプリの情報. pml4 は image のページキャッシュからコピーしたこのタスクのページテーブル.
+ * segments には共有ランタイム(runtime)のセグメントも含む.
+ * image と runtime はアプリが終了するまで参照しておく.
+ */
 struct AppLoadInfo {
     uint64_t vaddr_end, entry;
     PageMapEntry *pml4;
+    std::vector<ElfMapping> segments;
+    std::shared_ptr<AppImage> image, runtime;
 };
 
-extern std::map<fat::DirectoryEntry *, AppLoadInfo> *app_loads;
+class PipeDescriptor;
+class JobOutputDescriptor;
 
 struct TerminalDescriptor {
     std::string command_line;
     bool exit_after_command;
     bool show_window;
     std::array<std::shared_ptr<FileDescriptor>, 3> files;
+    /** 標準入力, 標準出力のパイプ. コマンドの終了時にそれぞれの端を閉じる */
+    std::shared_ptr<PipeDescriptor> pipe_in{}, pipe_out{};
 };
 
 class Terminal {
@@ -38,6 +52,13 @@ class Terminal {
     Task &UnderlyingTask() const { return task_; }
     int LastExitCode() const { return last_exit_code_; }
     void Redraw();
+    /** kJobOutput を受け取ったときに呼ぶ. バックグラウンドジョブの出力を表示する */
+    void DrainJobOutput();
+    /**
+     * ターミナルを閉じる前に呼ぶ. ジョブの出力を捨てるようにし,
+     * 終了を待たずに走らせておく(終了コードは残さない).
+     */
+    void AbandonJobs();
 
   private:
     std::shared_ptr<ToplevelWindow> window_;
@@ -53,9 +74,17 @@ class Terminal {
     std::array<char, kLineMax> linebuf_{};
     void Scroll1();
 
+    /** 行を | で区切ったステージごとにタスクを起動する. 末尾の & はバックグラウンドジョブ */
     void ExecuteLine();
+    /** | を含まない1つのコマンドを現在のタスクで実行し, 終了コードを返す */
+    int ExecuteCommand(char *line);
+    /** タスクがすべて終了するまで待ち, 最後のタスクの終了コードを返す */
+    int WaitTasks(const std::vector<uint64_t> &task_ids);
     WithError<int> ExecuteFile(fat::DirectoryEntry &file_entry, char *command,
                                char *first_arg);
+    void PrintSyscallStat();
+    /** args のコマンドを実行し, 呼んだシステムコールを表示する. 終了コードを返す */
+    int Strace(char *args);
     void Print(char32_t c);
 
     /*コマンド履歴を保存するキュー*/
@@ -66,10 +95,47 @@ class Terminal {
     bool show_window_;
     std::array<std::shared_ptr<FileDescriptor>, 3> files_;
     int last_exit_code_{0};
+
+    /** & で起動したジョブ. task_ids はパイプラインの各ステージのタスク */
+    struct Job {
+        int id;
+        std::string command_line;
+        std::vector<uint64_t> task_ids;
+    };
+    std::vector<Job> jobs_{};
+    int next_job_id_{1};
+    /** ジョブの標準出力とエラー出力. ジョブのタスクから直接描かないよう, このタスクが読んで表示する */
+    std::shared_ptr<JobOutputDescriptor> job_output_{};
 };
 
 void TaskTerminal(uint64_t task_id, int64_t data);
 
+/**
+ * command をカレントディレクトリ, 無ければ apps ディレクトリから探す.
+ * ディレクトリやパスの途中で見つかったものは nullptr
+ */
+fat::DirectoryEntry *FindCommand(const char *command,
+                                 unsigned long dir_cluster = 0);
+
+/**
+ * 現在のタスクで file_entry のアプリを args を引数として実行し, 終了コードを返す.
+ * files がアプリのファイルディスクリプタ 0, 1, 2 になる.
+ */
+WithError<int>
+ExecuteApp(fat::DirectoryEntry &file_entry,
+           const std::vector<std::string> &args,
+           const std::vector<std::shared_ptr<FileDescriptor>> &files);
+
+/** Spawn システムコールが TaskApp に渡す起動情報 */
+struct AppSpawnInfo {
+    fat::DirectoryEntry *file_entry;
+    std::vector<std::string> args;
+    std::vector<std::shared_ptr<FileDescriptor>> files;
+};
+
+/** data の AppSpawnInfo のアプリをターミナル無しで実行し, その終了コードで終わる */
+void TaskApp(uint64_t task_id, int64_t data);
+
 class TerminalFileDescriptor : public FileDescriptor {
   public:
     explicit TerminalFileDescriptor(Terminal &term);
@@ -82,19 +148,67 @@ class TerminalFileDescriptor : public FileDescriptor {
     Terminal &term_;
 };
 
+/**
+ * タスク間のパイプ. kCapacity バイトのリングバッファを読み書きする.
+ * 読み手は空のとき, 書き手は満杯のときだけ眠り, 相手を起こすのは
+ * 空から空でなくなったときと, 満杯から半分以上空いたときに限る.
+ * 読み書きはそれぞれ Mutex で直列化し, データのコピーは割り込み許可で行う.
+ */
 class PipeDescriptor : public FileDescriptor {
   public:
-    explicit PipeDescriptor(Task &task);
+    static const size_t kCapacity = 64 * 1024;
+
+    PipeDescriptor();
+    ~PipeDescriptor();
+    /** 空なら書き込まれるまで待ち, 読めるだけ(最大 len バイト)読む. 閉じられて空なら 0 */
     size_t Read(void *buf, size_t len) override;
+    /** 待たずに読めるだけ読む. 空なら 0. 読み手が1つだけのときに使う */
+    size_t TryRead(void *buf, size_t len);
+    /** len バイトすべて書くまで待つ. 読み手が閉じたら書けた分だけ返す */
     size_t Write(const void *buf, size_t len) override;
     size_t Size() const override { return 0; }
     size_t Load(void *buf, size_t len, size_t offset) override { return 0; }
 
     void FinishWrite();
+    void FinishRead();
+
+    /** 読み手, 書き手が眠った回数 */
+    uint64_t ReadWaits() const { return read_waits_; }
+    uint64_t WriteWaits() const { return write_waits_; }
 
   private:
-    Task &task_;
-    char data_[16];
-    size_t len_{0};
-    bool closed_{false};
+    void CopyIn(size_t pos, const uint8_t *src, size_t len);
+    void CopyOut(uint8_t *dst, size_t pos, size_t len) const;
+
+    uint8_t *buf_{nullptr};
+    // 読み書きした累計バイト数. tail_ - head_ がバッファ内のバイト数
+    size_t head_{0}, tail_{0};
+    bool write_closed_{false}, read_closed_{false};
+    WaitQueue readers_{}, writers_{};
+    Mutex read_lock_{}, write_lock_{};
+    uint64_t read_waits_{0}, write_waits_{0};
+};
+
+/**
+ * バックグラウンドジョブの出力先. 書かれた内容をパイプに溜め,
+ * ターミナルのタスクに kJobOutput を送って読み出させる.
+ */
+class JobOutputDescriptor : public FileDescriptor {
+  public:
+    explicit JobOutputDescriptor(uint64_t term_task_id);
+    size_t Read(void *buf, size_t len) override { return 0; }
+    /** 溜まった分をターミナルが読むまで待つことがある. ターミナルが閉じたら捨てる */
+    size_t Write(const void *buf, size_t len) override;
+    size_t Size() const override { return 0; }
+    size_t Load(void *buf, size_t len, size_t offset) override { return 0; }
+
+    /** ターミナルのタスクから呼ぶ. 待たずに読めるだけ読む. 空なら 0 */
+    size_t Drain(void *buf, size_t len);
+    /** ターミナルのタスクから呼ぶ. 以後の書き込みを捨てる */
+    void Close();
+
+  private:
+    uint64_t term_task_id_;
+    PipeDescriptor pipe_{};
+    bool notified_{false}; // kJobOutput を送り, まだ Drain されていない
 };
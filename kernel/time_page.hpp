@@ -0,0 +1,34 @@
+/**
+ * @file time_page.hpp
+ *
+ * アプリのアドレス空間に読み取り専用で写像する時刻ページ.
+ * カーネルが更新し, アプリはシステムコールなしで時刻を読む.
+ */
+#pragma once
+
+#ifdef __cplusplus
+#include <cstdint>
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+
+// アプリのスタックの直下に置く
+#define TIME_PAGE_ADDR 0xfffffffffffee000ull
+
+/**
+ * seq が奇数の間はカーネルが書き換え中.
+ * 読む側は seq が偶数かつ読む前後で変わっていないことを確かめる(seqlock).
+ */
+struct TimePage {
+    volatile uint32_t seq;
+    uint32_t tick_freq;          // tick の周波数(Hz)
+    volatile uint64_t tick;      // タイマーのティック数
+    uint64_t tsc_base;           // 起動からの経過時間 0 ns に対応する TSC
+    uint64_t tsc_to_ns_mult;     // ns = (tsc - tsc_base) * tsc_to_ns_mult >> 32
+    volatile int64_t wall_offset_ns; // 経過時間に足すと UNIX 時刻(ns)になる
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
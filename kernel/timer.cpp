@@ -1,7 +1,16 @@
 #include "timer.hpp"
 #include "acpi.hpp"
+#include "asmfunc.h"
 #include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "msr.hpp"
+#include "paging.hpp"
 #include "task.hpp"
+#include "time_page.hpp"
+#include "uefi.hpp"
+#include <algorithm>
+#include <cpuid.h>
 
 namespace {
 const uint32_t kCountMax = 0xffffffffu;
@@ -9,6 +18,62 @@ volatile uint32_t &lvt_timer = *reinterpret_cast<uint32_t *>(0xfee00320);
 volatile uint32_t &initial_count = *reinterpret_cast<uint32_t *>(0xfee00380);
 volatile uint32_t &current_count = *reinterpret_cast<uint32_t *>(0xfee00390);
 volatile uint32_t &divide_config = *reinterpret_cast<uint32_t *>(0xfee003e0);
+
+// TSC とナノ秒の相互換算. ns = (tsc - tsc_base) * tsc_to_ns_mult >> 32
+uint64_t tsc_base;
+uint64_t tsc_to_ns_mult;
+// tsc = tsc_base + ns * ns_to_tsc_mult >> 24
+uint64_t ns_to_tsc_mult;
+
+bool tsc_deadline_mode;
+
+uint64_t NsToTSC(uint64_t ns) {
+    return tsc_base +
+           static_cast<uint64_t>(
+               (static_cast<unsigned __int128>(ns) * ns_to_tsc_mult) >> 24);
+}
+
+TimePage *time_page;
+
+/*1970-01-01 からの日数. 月は 1-12*/
+int64_t DaysFromCivil(int64_t y, unsigned m, unsigned d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const unsigned yoe = static_cast<unsigned>(y - era * 400);
+    const unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    const unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + static_cast<int64_t>(doe) - 719468;
+}
+
+/*UEFI の RTC(UTC として扱う)から, 経過時間を UNIX 時刻に直すための差分を求める*/
+int64_t WallClockOffset() {
+    EFI_TIME t;
+    if(uefi_rt == nullptr || uefi_rt->GetTime(&t, nullptr) != EFI_SUCCESS) {
+        return 0;
+    }
+    const uint64_t now = CurrentTime();
+
+    const int64_t days = DaysFromCivil(t.Year, t.Month, t.Day);
+    const int64_t secs = days * 86400 + t.Hour * 3600 + t.Minute * 60 + t.Second;
+    return secs * 1'000'000'000 + t.Nanosecond - static_cast<int64_t>(now);
+}
+
+/*LAPICタイマーを deadline (ナノ秒) に1回だけ割り込むよう設定する*/
+void ArmLAPICTimer(uint64_t deadline) {
+    if(tsc_deadline_mode) {
+        WriteMSR(kIA32_TSC_DEADLINE, NsToTSC(deadline));
+        return;
+    }
+
+    const uint64_t now = CurrentTime();
+    uint64_t delta = deadline > now ? deadline - now : 0;
+    if(delta > 1'000'000'000) { delta = 1'000'000'000; }
+
+    uint64_t count = delta * lapic_timer_freq / 1'000'000'000;
+    if(count == 0) { count = 1; }
+    if(count > kCountMax) { count = kCountMax; }
+    initial_count = count;
+}
 } // namespace
 
 void InitializeLAPICTimer() {
@@ -17,17 +82,42 @@ void InitializeLAPICTimer() {
     divide_config = 0b1011;  // divide 1:1
     lvt_timer = 0b001 << 16; // masked, one-shot
 
+    /*PMタイマーを基準に LAPIC タイマーと TSC の周波数を同時に測る*/
+    const uint64_t tsc_start = ReadTSC();
     StartLAPICTimer();
     acpi::WaitMilliseconds(100);
     const auto elapsed = LAPICTimerElapsed();
+    const uint64_t tsc_end = ReadTSC();
     StopLAPICTimer();
 
     lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+    tsc_freq = (tsc_end - tsc_start) * 10;
+
+    tsc_base = ReadTSC();
+    tsc_to_ns_mult = (1'000'000'000ul << 32) / tsc_freq;
+    ns_to_tsc_mult = (tsc_freq << 24) / 1'000'000'000;
+
+    unsigned int eax, ebx, ecx, edx;
+    if(__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && !(edx & (1u << 8))) {
+        Log(kInfo, "TSC is not invariant\n");
+    }
+    tsc_deadline_mode =
+        __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 24));
 
     divide_config = 0b1011; // divide 1:1
-    lvt_timer =
-        (0b010 << 16) | InterruptVector::kLAPICTimer; // not-masked, periodic
-    initial_count = lapic_timer_freq / kTimerFreq;
+    if(tsc_deadline_mode) {
+        lvt_timer = (0b100 << 16) |
+                    InterruptVector::kLAPICTimer; // not-masked, TSC-deadline
+    } else {
+        lvt_timer =
+            (0b000 << 16) | InterruptVector::kLAPICTimer; // not-masked, one-shot
+    }
+    Log(kInfo, "TSC %lu Hz, LAPIC timer %lu Hz (%s)\n", tsc_freq,
+        lapic_timer_freq, tsc_deadline_mode ? "TSC-deadline" : "one-shot");
+
+    InitializeTimePage();
+
+    timer_manager->ProgramNextEvent();
 }
 
 void StartLAPICTimer() { initial_count = kCountMax; }
@@ -36,46 +126,405 @@ uint32_t LAPICTimerElapsed() { return kCountMax - current_count; }
 
 void StopLAPICTimer() { initial_count = 0; }
 
+void InitializeTimePage() {
+    auto frame = memory_manager->Allocate(1);
+    if(frame.error) {
+        Log(kError, "failed to allocate the time page: %s\n",
+            frame.error.Name());
+        return;
+    }
+
+    time_page = reinterpret_cast<TimePage *>(frame.value.Frame());
+    memset(time_page, 0, kBytesPerFrame);
+    time_page->tick_freq = kTimerFreq;
+    time_page->tsc_base = tsc_base;
+    time_page->tsc_to_ns_mult = tsc_to_ns_mult;
+    time_page->wall_offset_ns = WallClockOffset();
+}
+
+Error MapTimePage() {
+    if(time_page == nullptr) { return MAKE_ERROR(Error::kNoEnoughMemory); }
+    return MapSharedPage(LinearAddress4Level{TIME_PAGE_ADDR},
+                         reinterpret_cast<uintptr_t>(time_page), false);
+}
+
+uint64_t CurrentTime() {
+    const uint64_t tsc = ReadTSC();
+    return (static_cast<unsigned __int128>(tsc - tsc_base) * tsc_to_ns_mult) >>
+           32;
+}
+
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
     : timeout_{timeout}, value_{value}, task_id_{task_id} {}
 
 TimerManager::TimerManager() {
-    timers_.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+    heads_.fill(kNil);
+    for(int32_t i = kMaxTimers - 1; i >= 0; --i) {
+        nodes_[i].next = free_head_;
+        free_head_ = i;
+    }
 }
 
-void TimerManager::AddTimer(const Timer &timer) { timers_.push(timer); }
+TimerID TimerManager::AddTimer(const Timer &timer) {
+    const int32_t index = AllocateNode();
+    if(index == kNil) { return kInvalidTimerID; }
+
+    nodes_[index].timer = timer;
+    Link(index);
+    return MakeID(index);
+}
 
-bool TimerManager::Tick() {
-    ++tick_;
+TimerID TimerManager::AddHRTimer(const Timer &timer) {
+    const int32_t index = AllocateNode();
+    if(index == kNil) { return kInvalidTimerID; }
 
-    bool task_timer_timeout = false;
-    while(true) {
-        const auto &t = timers_.top();
-        if(t.Timeout() > tick_) { break; }
-
-        if(t.Value() == kTaskTimerValue) {
-            task_timer_timeout = true;
-            timers_.pop();
-            timers_.push(Timer{tick_ + kTaskTimerPeriod, kTaskTimerValue, 1});
-            continue;
+    nodes_[index].timer = timer;
+    HeapPush(index);
+
+    // 設定済みの割り込みより早く満了するなら設定し直す
+    if(timer.Timeout() < programmed_deadline_) { ProgramNextEvent(); }
+    return MakeID(index);
+}
+
+bool TimerManager::CancelTimer(TimerID id) {
+    const int32_t index = FindNode(id);
+    if(index == kNil) { return false; }
+
+    Remove(index);
+    return true;
+}
+
+bool TimerManager::CancelTimer(TimerID id, uint64_t task_id) {
+    const int32_t index = FindNode(id);
+    if(index == kNil || nodes_[index].timer.TaskID() != task_id) {
+        return false;
+    }
+
+    Remove(index);
+    return true;
+}
+
+void TimerManager::CancelAppTimers(uint64_t task_id) {
+    for(int32_t i = 0; i < kMaxTimers; ++i) {
+        auto &node = nodes_[i];
+        if(node.list != kNoList && node.timer.TaskID() == task_id &&
+           node.timer.Value() < 0) {
+            Remove(i);
         }
+    }
+}
+
+void TimerManager::Tick() {
+    const unsigned long t = tick_ + 1;
 
-        Message m{Message::kTimerTimeout};
-        m.arg.timer.timeout = t.Timeout();
-        m.arg.timer.value = t.Value();
-        task_manager->SendMessage(t.TaskID(), m);
+    /*下位の段が一周したら上位の段のスロットを下へ振り分け直す*/
+    if((t & kWheelMask) == 0) {
+        int level = 1;
+        for(; level < kWheelLevels; ++level) {
+            const int index = (t >> (kWheelBits * level)) & kWheelMask;
+            Cascade(kWheelSize * level + index);
+            if(index != 0) { break; }
+        }
+        if(level == kWheelLevels) { Cascade(kOverflowList); }
+    }
 
-        timers_.pop();
+    tick_ = t;
+    if(time_page) {
+        // 奇数の間は読み手がやり直す. x86 ではストアの順序は保たれる
+        ++time_page->seq;
+        __asm__ volatile("" ::: "memory");
+        time_page->tick = t;
+        __asm__ volatile("" ::: "memory");
+        ++time_page->seq;
     }
 
-    return task_timer_timeout;
+    int32_t i = DetachList(t & kWheelMask);
+    while(i != kNil) {
+        const int32_t next = nodes_[i].next;
+        SendTimeout(nodes_[i].timer, false);
+        ReleaseNode(i);
+        i = next;
+    }
+}
+
+bool TimerManager::Update(uint64_t now) {
+    while((tick_ + 1) * kTickNs <= now) { Tick(); }
+
+    while(heap_size_ > 0 && HeapDeadline(0) <= now) {
+        const int32_t index = heap_[0];
+        HeapRemove(index);
+        SendTimeout(nodes_[index].timer, true);
+        ReleaseNode(index);
+    }
+
+    if(task_timer_deadline_ <= now) {
+        task_timer_deadline_ = now + kTaskTimerPeriodNs;
+        return true;
+    }
+    return false;
+}
+
+void TimerManager::ProgramNextEvent() {
+    uint64_t deadline;
+    if(idle_) {
+        // ティックは進めず, ホイール上で次にタイマーが満了する(または振り分け直す)時刻まで眠る
+        deadline = idle_start_ + kMaxIdleNs;
+        const unsigned long next_tick = NextExpiryTick();
+        if(next_tick < deadline / kTickNs) { deadline = next_tick * kTickNs; }
+    } else {
+        deadline = (tick_ + 1) * kTickNs;
+    }
+    if(heap_size_ > 0 && HeapDeadline(0) < deadline) {
+        deadline = HeapDeadline(0);
+    }
+    if(task_timer_deadline_ < deadline) { deadline = task_timer_deadline_; }
+
+    programmed_deadline_ = deadline;
+    ArmLAPICTimer(deadline);
+}
+
+void TimerManager::SetTaskTimer(uint64_t deadline) {
+    task_timer_deadline_ = deadline;
+    if(!idle_ && deadline < programmed_deadline_) { ProgramNextEvent(); }
+}
+
+void TimerManager::EnterIdle() {
+    const uint64_t now = CurrentTime();
+    if(idle_) {
+        ++idle_wakeups_;
+        idle_ns_ += now - idle_start_;
+    }
+    idle_ = true;
+    idle_start_ = now;
+    task_timer_deadline_ = std::numeric_limits<uint64_t>::max();
+    ProgramNextEvent();
+}
+
+void TimerManager::ExitIdle() {
+    if(!idle_) { return; }
+
+    const uint64_t now = CurrentTime();
+    ++idle_wakeups_;
+    idle_ns_ += now - idle_start_;
+    idle_ = false;
+
+    Update(now);
+    task_timer_deadline_ = now + kTaskTimerPeriodNs;
+    ProgramNextEvent();
+}
+
+TimerManager::IdleStat TimerManager::GetIdleStat() const {
+    return {idle_ns_, idle_wakeups_, timer_interrupts_};
+}
+
+/*
+ * ホイール上で次に処理が必要なティックを求める.
+ * 上位の段は振り分け直す時刻を返すので, 実際の満了より早いことがある.
+ */
+unsigned long TimerManager::NextExpiryTick() const {
+    const unsigned long base = tick_ + 1;
+    unsigned long next = std::numeric_limits<unsigned long>::max();
+
+    for(int k = 0; k < kWheelSize; ++k) {
+        if(heads_[(base + k) & kWheelMask] != kNil) {
+            next = base + k;
+            break;
+        }
+    }
+
+    for(int level = 1; level < kWheelLevels; ++level) {
+        const int shift = kWheelBits * level;
+        const unsigned long start = base >> shift;
+        for(int k = 0; k <= kWheelSize; ++k) {
+            const unsigned long cascade_tick = (start + k) << shift;
+            if(cascade_tick < base) { continue; }
+            if(heads_[kWheelSize * level + ((start + k) & kWheelMask)] != kNil) {
+                next = std::min(next, cascade_tick);
+                break;
+            }
+        }
+    }
+
+    if(heads_[kOverflowList] != kNil) {
+        const int shift = kWheelBits * kWheelLevels;
+        next = std::min(next, ((base + (1ul << shift) - 1) >> shift) << shift);
+    }
+    return next;
+}
+
+int32_t TimerManager::FindNode(TimerID id) const {
+    const int64_t index = static_cast<int64_t>(id & 0xffffffffu) - 1;
+    if(index < 0 || index >= kMaxTimers) { return kNil; }
+
+    const auto &node = nodes_[index];
+    if(node.generation != (id >> 32) || node.list == kNoList) { return kNil; }
+    return index;
+}
+
+TimerID TimerManager::MakeID(int32_t index) const {
+    return (static_cast<uint64_t>(nodes_[index].generation) << 32) |
+           static_cast<uint64_t>(index + 1);
+}
+
+int32_t TimerManager::AllocateNode() {
+    const int32_t index = free_head_;
+    if(index == kNil) { return kNil; }
+
+    free_head_ = nodes_[index].next;
+    ++active_;
+    return index;
+}
+
+void TimerManager::ReleaseNode(int32_t index) {
+    auto &node = nodes_[index];
+    node.list = kNoList;
+    ++node.generation;
+    node.prev = kNil;
+    node.next = free_head_;
+    free_head_ = index;
+    --active_;
+}
+
+void TimerManager::Remove(int32_t index) {
+    if(nodes_[index].list == kHRTimerList) {
+        HeapRemove(index);
+    } else {
+        Unlink(index);
+    }
+    ReleaseNode(index);
+}
+
+/*次に処理するティックを基準にして, 満了時刻に対応するスロットへつなぐ*/
+void TimerManager::Link(int32_t index) {
+    auto &node = nodes_[index];
+    const unsigned long base = tick_ + 1;
+    const unsigned long expires =
+        node.timer.Timeout() < base ? base : node.timer.Timeout();
+    const unsigned long delta = expires - base;
+
+    int list = kOverflowList;
+    for(int level = 0; level < kWheelLevels; ++level) {
+        if(delta < (1ul << (kWheelBits * (level + 1)))) {
+            list = kWheelSize * level +
+                   ((expires >> (kWheelBits * level)) & kWheelMask);
+            break;
+        }
+    }
+
+    node.list = list;
+    node.prev = kNil;
+    node.next = heads_[list];
+    if(node.next != kNil) { nodes_[node.next].prev = index; }
+    heads_[list] = index;
+}
+
+void TimerManager::Unlink(int32_t index) {
+    auto &node = nodes_[index];
+    if(node.prev != kNil) {
+        nodes_[node.prev].next = node.next;
+    } else {
+        heads_[node.list] = node.next;
+    }
+    if(node.next != kNil) { nodes_[node.next].prev = node.prev; }
+
+    node.prev = node.next = kNil;
+    node.list = kNoList;
+}
+
+int32_t TimerManager::DetachList(int list) {
+    const int32_t head = heads_[list];
+    heads_[list] = kNil;
+    for(int32_t i = head; i != kNil; i = nodes_[i].next) {
+        nodes_[i].list = kNoList;
+    }
+    return head;
+}
+
+void TimerManager::Cascade(int list) {
+    int32_t i = DetachList(list);
+    while(i != kNil) {
+        const int32_t next = nodes_[i].next;
+        Link(i);
+        i = next;
+    }
+}
+
+void TimerManager::SendTimeout(const Timer &timer, bool hr) {
+    if(timer.Value() == kWakeupTimerValue) {
+        task_manager->Wakeup(timer.TaskID());
+        return;
+    }
+
+    Message m{Message::kTimerTimeout};
+    m.arg.timer.timeout = timer.Timeout();
+    // アプリのタイマーはホイールに置いたものも期限をナノ秒で知らせる
+    if(!hr && timer.Value() < 0) { m.arg.timer.timeout *= kTickNs; }
+    m.arg.timer.value = timer.Value();
+    task_manager->SendMessage(timer.TaskID(), m);
+}
+
+uint64_t TimerManager::HeapDeadline(size_t i) const {
+    return nodes_[heap_[i]].timer.Timeout();
+}
+
+void TimerManager::HeapSwap(size_t i, size_t j) {
+    std::swap(heap_[i], heap_[j]);
+    nodes_[heap_[i]].heap_index = i;
+    nodes_[heap_[j]].heap_index = j;
+}
+
+void TimerManager::HeapUp(size_t i) {
+    while(i > 0) {
+        const size_t parent = (i - 1) / 2;
+        if(HeapDeadline(parent) <= HeapDeadline(i)) { break; }
+        HeapSwap(i, parent);
+        i = parent;
+    }
+}
+
+void TimerManager::HeapDown(size_t i) {
+    while(true) {
+        const size_t left = 2 * i + 1, right = left + 1;
+        size_t min = i;
+        if(left < heap_size_ && HeapDeadline(left) < HeapDeadline(min)) {
+            min = left;
+        }
+        if(right < heap_size_ && HeapDeadline(right) < HeapDeadline(min)) {
+            min = right;
+        }
+        if(min == i) { break; }
+        HeapSwap(i, min);
+        i = min;
+    }
+}
+
+void TimerManager::HeapPush(int32_t index) {
+    nodes_[index].list = kHRTimerList;
+    nodes_[index].heap_index = heap_size_;
+    heap_[heap_size_] = index;
+    HeapUp(heap_size_++);
+}
+
+void TimerManager::HeapRemove(int32_t index) {
+    const size_t i = nodes_[index].heap_index;
+    --heap_size_;
+    if(i != heap_size_) {
+        HeapSwap(i, heap_size_);
+        HeapDown(i);
+        HeapUp(i);
+    }
+    nodes_[index].heap_index = kNil;
+    nodes_[index].list = kNoList;
 }
 
 TimerManager *timer_manager;
 unsigned long lapic_timer_freq;
+unsigned long tsc_freq;
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext &ctx_stack) {
-    const bool task_timer_timeout = timer_manager->Tick();
+    timer_manager->CountTimerInterrupt();
+    const bool task_timer_timeout = timer_manager->Update(CurrentTime());
+    timer_manager->ProgramNextEvent();
     NotifyEndOfInterrupt();
 
     if(task_timer_timeout) { task_manager->SwitchTask(ctx_stack); }
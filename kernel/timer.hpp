@@ -1,15 +1,27 @@
 #pragma once
+#include "error.hpp"
 #include "message.hpp"
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <limits>
-#include <queue>
-#include <vector>
 
 void InitializeLAPICTimer();
 void StartLAPICTimer();
 uint32_t LAPICTimerElapsed();
 void StopLAPICTimer();
 
+/** LAPICタイマー初期化時からの経過時間(ナノ秒). TSCを換算して求める */
+uint64_t CurrentTime();
+
+/**
+ * 時刻ページ(time_page.hpp)を確保して初期化する.
+ * InitializeLAPICTimer から TSC の較正後に呼ばれる.
+ */
+void InitializeTimePage();
+/** 現在のアドレス空間の TIME_PAGE_ADDR に時刻ページを読み取り専用で写像する */
+Error MapTimePage();
+
 class Timer {
   public:
     Timer(unsigned long timeout, int value, uint64_t task_id);
@@ -23,26 +35,133 @@ class Timer {
     uint64_t task_id_;
 };
 
-//タイマー優先度を比較する.タイムアウトが遠いほど優先度が低い
-inline bool operator<(const Timer &lhs, const Timer &rhs) {
-    return lhs.Timeout() > rhs.Timeout();
-}
+/** 登録したタイマーを取り消すためのハンドル. 0は無効なハンドル */
+using TimerID = uint64_t;
+const TimerID kInvalidTimerID = 0;
 
+/** この値のタイマーは満了時にメッセージを送らず, タスクを直接起こす */
+const int kWakeupTimerValue = std::numeric_limits<int>::min();
+
+/**
+ * 階層型タイマーホイール.
+ * 64スロット x 4段で 2^24 ティック先までを O(1) で登録・取り消し・満了できる.
+ * それより遠いタイマーはオーバーフローリストに置き, 最上段が一周したときに振り分け直す.
+ * タイマーのノードは固定長のプールから取るので割り込みハンドラ内でも確保しない.
+ *
+ * ティックより細かい期限が必要なタイマー(HRTimer)は期限(ナノ秒)順の二分ヒープに置く.
+ * LAPICタイマーは周期モードではなく, 次のティック・HRTimer・タスク切り替えの
+ * うち最も近い期限に合わせて毎回設定し直す.
+ */
 class TimerManager {
   public:
+    static constexpr int kMaxTimers = 8192;
+
     TimerManager();
-    void AddTimer(const Timer &timer);
-    bool Tick();
+    TimerID AddTimer(const Timer &timer);
+    /** timeout をナノ秒の期限として扱うタイマーを登録する */
+    TimerID AddHRTimer(const Timer &timer);
+    /** deadline(ナノ秒)に task_id のタスクを起こす */
+    TimerID AddWakeupTimer(uint64_t deadline, uint64_t task_id) {
+        return AddHRTimer(Timer{deadline, kWakeupTimerValue, task_id});
+    }
+    bool CancelTimer(TimerID id);
+    /** task_id のタスクが所有するタイマーのときだけ取り消す */
+    bool CancelTimer(TimerID id, uint64_t task_id);
+    /** アプリが作成したタイマー(値が負)をすべて取り消す */
+    void CancelAppTimers(uint64_t task_id);
+    void Tick();
+    /** now までに満了したタイマーを処理する. タスク切り替えが必要なら true */
+    bool Update(uint64_t now);
+    /** 次に割り込みが必要な時刻(ナノ秒)に LAPIC タイマーを設定する */
+    void ProgramNextEvent();
+    /**
+     * スケジューラの時間切れ(タスク切り替え)の期限を設定する.
+     * 設定済みの割り込みより早ければ LAPIC タイマーも設定し直す.
+     */
+    void SetTaskTimer(uint64_t deadline);
     unsigned long CurrentTick() const { return tick_; }
+    size_t ActiveTimers() const { return active_; }
+
+    /**
+     * アイドルタスク以外に実行可能なタスクがないときに呼ぶ.
+     * 周期ティックとタスク切り替えを止め, 次に満了するタイマーまで割り込みを止める.
+     */
+    void EnterIdle();
+    /** 実行可能なタスクが現れたときに呼ぶ. 遅れたティックを処理して周期ティックに戻す */
+    void ExitIdle();
+
+    struct IdleStat {
+        uint64_t idle_ns;          // アイドル状態にいた時間の合計
+        uint64_t wakeups;          // アイドル中に hlt から起きた回数
+        uint64_t timer_interrupts; // LAPIC タイマー割り込みの回数
+    };
+    IdleStat GetIdleStat() const;
+    void CountTimerInterrupt() { ++timer_interrupts_; }
 
   private:
+    static constexpr int kWheelBits = 6;
+    static constexpr int kWheelSize = 1 << kWheelBits;
+    static constexpr unsigned long kWheelMask = kWheelSize - 1;
+    static constexpr int kWheelLevels = 4;
+    static constexpr int kOverflowList = kWheelSize * kWheelLevels;
+    static constexpr int kNumLists = kOverflowList + 1;
+    static constexpr uint16_t kHRTimerList = kNumLists;
+    static constexpr int32_t kNil = -1;
+    static constexpr uint16_t kNoList = 0xffff;
+
+    struct Node {
+        Timer timer{0, 0, 0};
+        int32_t prev{kNil}, next{kNil};
+        int32_t heap_index{kNil};
+        uint32_t generation{0};
+        uint16_t list{kNoList};
+    };
+
+    static constexpr uint64_t kMaxIdleNs = 1'000'000'000;
+
+    unsigned long NextExpiryTick() const;
+    int32_t FindNode(TimerID id) const;
+    TimerID MakeID(int32_t index) const;
+    int32_t AllocateNode();
+    void ReleaseNode(int32_t index);
+    void Remove(int32_t index);
+    void Link(int32_t index);
+    void Unlink(int32_t index);
+    int32_t DetachList(int list);
+    void Cascade(int list);
+    /** hr が false ならホイールのタイマー(timeout がティック) */
+    void SendTimeout(const Timer &timer, bool hr);
+
+    uint64_t HeapDeadline(size_t i) const;
+    void HeapSwap(size_t i, size_t j);
+    void HeapUp(size_t i);
+    void HeapDown(size_t i);
+    void HeapPush(int32_t index);
+    void HeapRemove(int32_t index);
+
     volatile unsigned long tick_{0};
-    std::priority_queue<Timer> timers_{};
+    std::array<Node, kMaxTimers> nodes_{};
+    std::array<int32_t, kNumLists> heads_{};
+    int32_t free_head_{kNil};
+    size_t active_{0};
+
+    std::array<int32_t, kMaxTimers> heap_{};
+    size_t heap_size_{0};
+
+    uint64_t task_timer_deadline_{std::numeric_limits<uint64_t>::max()};
+    uint64_t programmed_deadline_{0};
+
+    bool idle_{false};
+    uint64_t idle_start_{0};
+    uint64_t idle_ns_{0};
+    uint64_t idle_wakeups_{0};
+    uint64_t timer_interrupts_{0};
 };
 
 extern TimerManager *timer_manager;
 extern unsigned long lapic_timer_freq;
+extern unsigned long tsc_freq;
 const int kTimerFreq = 100;
+const uint64_t kTickNs = 1'000'000'000 / kTimerFreq;
 
-const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
-const int kTaskTimerValue = std::numeric_limits<int>::max();
+const uint64_t kTaskTimerPeriodNs = 20'000'000;
@@ -1,6 +1,7 @@
 #include "window.hpp"
 #include "font.hpp"
 #include "logger.hpp"
+#include "memory_manager.hpp"
 
 namespace {
 void DrawTextbox(PixelWriter &writer, Vector2D<int> pos, Vector2D<int> size,
@@ -50,6 +51,14 @@ Window::Window(int width, int height, PixelFormat shadow_format)
     }
 }
 
+Window::~Window() {
+    if(shared_surface_) {
+        const FrameID frame{reinterpret_cast<uintptr_t>(shared_surface_) /
+                            kBytesPerFrame};
+        memory_manager->Free(frame, SharedSurfaceBytes() / kBytesPerFrame);
+    }
+}
+
 void Window::DrawTo(FrameBuffer &dst, Vector2D<int> pos,
                     const Rectangle<int> &area) {
     if(!transparent_color_) {
@@ -87,6 +96,55 @@ void Window::Write(Vector2D<int> pos, PixelColor c) {
     shadow_buffer_.Writer().Write(pos, c);
 }
 
+void Window::WriteMaskRow(Vector2D<int> pos, const uint8_t *mask, int width,
+                          const PixelColor &c) {
+    if(pos.y < 0 || pos.y >= height_) { return; }
+    if(pos.x < 0) {
+        mask -= pos.x;
+        width += pos.x;
+        pos.x = 0;
+    }
+    width = std::min(width, width_ - pos.x);
+    if(width <= 0) { return; }
+
+    auto &row = data_[pos.y];
+    for(int dx = 0; dx < width; ++dx) {
+        if(mask[dx]) { row[pos.x + dx] = c; }
+    }
+    shadow_buffer_.Writer().WriteMaskRow(pos, mask, width, c);
+}
+
+void Window::FillRect(Vector2D<int> pos, Vector2D<int> size,
+                      const PixelColor &c) {
+    const auto area =
+        Rectangle<int>{pos, size} & Rectangle<int>{{0, 0}, Size()};
+    if(area.size.x <= 0 || area.size.y <= 0) { return; }
+
+    for(int y = area.pos.y; y < area.pos.y + area.size.y; ++y) {
+        auto row = data_[y].begin() + area.pos.x;
+        std::fill(row, row + area.size.x, c);
+    }
+    shadow_buffer_.Writer().FillRect(area.pos, area.size, c);
+}
+
+void Window::BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                      const uint32_t *src, int src_stride) {
+    const auto area =
+        Rectangle<int>{pos, size} & Rectangle<int>{{0, 0}, Size()};
+    if(area.size.x <= 0 || area.size.y <= 0) { return; }
+    const auto skip = area.pos - pos;
+    src += static_cast<size_t>(src_stride) * skip.y + skip.x;
+
+    for(int dy = 0; dy < area.size.y; ++dy) {
+        const uint32_t *src_row = src + static_cast<size_t>(src_stride) * dy;
+        auto &row = data_[area.pos.y + dy];
+        for(int dx = 0; dx < area.size.x; ++dx) {
+            row[area.pos.x + dx] = ToColor(src_row[dx]);
+        }
+    }
+    shadow_buffer_.Writer().BlitRect(area.pos, area.size, src, src_stride);
+}
+
 int Window::Width() const { return width_; }
 
 int Window::Height() const { return height_; }
@@ -97,6 +155,36 @@ void Window::Move(Vector2D<int> dst_pos, const Rectangle<int> &src) {
     shadow_buffer_.Move(dst_pos, src);
 }
 
+WithError<uint8_t *> Window::SharedSurface() {
+    if(shared_surface_) {
+        return {shared_surface_, MAKE_ERROR(Error::kSuccess)};
+    }
+
+    const auto num_frames = SharedSurfaceBytes() / kBytesPerFrame;
+    auto frame = memory_manager->Allocate(num_frames);
+    if(frame.error) { return {nullptr, frame.error}; }
+    auto surface = reinterpret_cast<uint8_t *>(frame.value.Frame());
+
+    // 今の内容を引き継ぎ, 影バッファの書き込み先を新しいフレームに切り替える
+    auto config = shadow_buffer_.Config();
+    memset(surface, 0, SharedSurfaceBytes());
+    memcpy(surface, config.frame_buffer,
+           4 * config.pixels_per_scan_line * config.vertical_resolution);
+    config.frame_buffer = surface;
+    if(auto err = shadow_buffer_.Initialize(config)) {
+        memory_manager->Free(frame.value, num_frames);
+        return {nullptr, err};
+    }
+
+    shared_surface_ = surface;
+    return {shared_surface_, MAKE_ERROR(Error::kSuccess)};
+}
+
+size_t Window::SharedSurfaceBytes() const {
+    const size_t bytes = 4 * static_cast<size_t>(width_) * height_;
+    return (bytes + kBytesPerFrame - 1) / kBytesPerFrame * kBytesPerFrame;
+}
+
 WindowRegion Window::GetWindowRegion(Vector2D<int> pos) {
     return WindowRegion::kOther;
 }
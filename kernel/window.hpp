@@ -22,6 +22,22 @@ class Window {
         }
         virtual int Width() const override { return window_.Width(); }
         virtual int Height() const override { return window_.Height(); }
+        virtual void WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                                  int width, const PixelColor &c) override {
+            window_.WriteMaskRow(pos, mask, width, c);
+        }
+        virtual void FillSpan(Vector2D<int> pos, int width,
+                              const PixelColor &c) override {
+            window_.FillRect(pos, {width, 1}, c);
+        }
+        virtual void FillRect(Vector2D<int> pos, Vector2D<int> size,
+                              const PixelColor &c) override {
+            window_.FillRect(pos, size, c);
+        }
+        virtual void BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                              const uint32_t *src, int src_stride) override {
+            window_.BlitRect(pos, size, src, src_stride);
+        }
 
       private:
         Window &window_;
@@ -29,7 +45,7 @@ class Window {
 
     /**指定されたピクセル数の平面描画領域の作成*/
     Window(int width, int height, PixelFormat shadow_format);
-    virtual ~Window() = default;
+    virtual ~Window();
     Window(const Window &rhs) = delete;
     Window &operator=(const Window &rhs) = delete;
 
@@ -40,6 +56,14 @@ class Window {
 
     const PixelColor &At(Vector2D<int> pos) const;
     void Write(Vector2D<int> pos, PixelColor c);
+    /** PixelWriter::WriteMaskRow と同じ. ウィンドウの外にはみ出す部分は描かない */
+    void WriteMaskRow(Vector2D<int> pos, const uint8_t *mask, int width,
+                      const PixelColor &c);
+    /** PixelWriter::FillRect と同じ. ウィンドウの外にはみ出す部分は塗らない */
+    void FillRect(Vector2D<int> pos, Vector2D<int> size, const PixelColor &c);
+    /** PixelWriter::BlitRect と同じ. ウィンドウの外にはみ出す部分は写さない */
+    void BlitRect(Vector2D<int> pos, Vector2D<int> size, const uint32_t *src,
+                  int src_stride);
 
     int Width() const;
     int Height() const;
@@ -47,6 +71,26 @@ class Window {
 
     void Move(Vector2D<int> dst_pos, const Rectangle<int> &src);
 
+    /**
+     * 影バッファをページ単位で確保したフレームに移し, その先頭を返す.
+     * アプリに写像して直接書かせるために使う. 2回目以降は同じフレームを返す.
+     * 直接書かれた画素は At() に反映されないので, 透過色は使えなくなる.
+     */
+    WithError<uint8_t *> SharedSurface();
+    /** SharedSurface の大きさ(バイト). ページ単位に切り上げる */
+    size_t SharedSurfaceBytes() const;
+    const FrameBufferConfig &SurfaceConfig() const {
+        return shadow_buffer_.Config();
+    }
+
+    /** SharedSurface を写像したアドレス空間(CR3)とアドレス. なければ 0 */
+    uint64_t SurfaceMapCR3() const { return surface_map_cr3_; }
+    uint64_t SurfaceMapAddr() const { return surface_map_addr_; }
+    void SetSurfaceMap(uint64_t cr3, uint64_t addr) {
+        surface_map_cr3_ = cr3;
+        surface_map_addr_ = addr;
+    }
+
 	/**アクティブ化メソッドの増設*/
     virtual void Activate() {}
     virtual void Deactivate() {}
@@ -59,6 +103,8 @@ class Window {
     std::optional<PixelColor> transparent_color_{std::nullopt};
 
     FrameBuffer shadow_buffer_{};
+    uint8_t *shared_surface_{nullptr};
+    uint64_t surface_map_cr3_{0}, surface_map_addr_{0};
 };
 
 class ToplevelWindow : public Window {
@@ -74,6 +120,22 @@ class ToplevelWindow : public Window {
         virtual void Write(Vector2D<int> pos, const PixelColor &c) override {
             window_.Write(pos + kTopLeftMargin, c);
         }
+        virtual void WriteMaskRow(Vector2D<int> pos, const uint8_t *mask,
+                                  int width, const PixelColor &c) override {
+            window_.WriteMaskRow(pos + kTopLeftMargin, mask, width, c);
+        }
+        virtual void FillSpan(Vector2D<int> pos, int width,
+                              const PixelColor &c) override {
+            window_.FillRect(pos + kTopLeftMargin, {width, 1}, c);
+        }
+        virtual void FillRect(Vector2D<int> pos, Vector2D<int> size,
+                              const PixelColor &c) override {
+            window_.FillRect(pos + kTopLeftMargin, size, c);
+        }
+        virtual void BlitRect(Vector2D<int> pos, Vector2D<int> size,
+                              const uint32_t *src, int src_stride) override {
+            window_.BlitRect(pos + kTopLeftMargin, size, src, src_stride);
+        }
         virtual int Width() const override {
             return window_.Width() - kTopLeftMargin.x - kBottomRightMargin.x;
         }
@@ -0,0 +1,27 @@
+/**
+ * @file window_surface.hpp
+ *
+ * WinMapSurface でアプリに写像するウィンドウの画素領域の情報.
+ */
+#pragma once
+
+#include "frame_buffer_config.hpp"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * 画素は画面と同じ形式(1画素4バイト)で, ウィンドウ枠も含む.
+ * 書き込んだ後 WinCommit で画面に反映する.
+ */
+struct WinSurface {
+    uint8_t *pixels; // (0, 0) の画素
+    int width, height;
+    int bytes_per_scan_line;
+    enum PixelFormat pixel_format;
+};
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
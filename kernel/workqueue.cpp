@@ -0,0 +1,94 @@
+#include "workqueue.hpp"
+#include "message.hpp"
+#include "sync.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+#include "usb/xhci/xhci.hpp"
+
+#include "network/network.h"
+#include "network/nic/e1000.h"
+
+WorkQueue::WorkQueue(int level) {
+    __asm__("cli");
+    task_ = &task_manager->NewTask().InitContext(
+        TaskWorker, reinterpret_cast<int64_t>(this));
+    task_manager->Wakeup(task_, level);
+    __asm__("sti");
+}
+
+void WorkQueue::Queue(Work &work) {
+    const auto rflags = DisableInterrupts();
+    if(!work.pending) {
+        work.pending = true;
+        work.queued_at = CurrentTime();
+        Message msg{Message::kWork};
+        msg.arg.work.work = &work;
+        task_->SendMessage(msg);
+    }
+    RestoreInterrupts(rflags);
+}
+
+void WorkQueue::QueuePeriodic(Work &work, unsigned long period) {
+    __asm__("cli");
+    const int value = periodic_.size();
+    periodic_.push_back({&work, period});
+    timer_manager->AddTimer(
+        Timer{timer_manager->CurrentTick() + period, value, task_->ID()});
+    __asm__("sti");
+}
+
+uint64_t WorkQueue::TaskID() const { return task_->ID(); }
+
+void WorkQueue::TaskWorker(uint64_t task_id, int64_t data) {
+    auto wq = reinterpret_cast<WorkQueue *>(data);
+    Task &task = task_manager->CurrentTask();
+
+    while(true) {
+        __asm__("cli");
+        auto msg = task.ReceiveMessage();
+        if(!msg) {
+            task.Sleep();
+            __asm__("sti");
+            continue;
+        }
+
+        Work *work = nullptr;
+        if(msg->type == Message::kWork) {
+            work = msg->arg.work.work;
+            work->pending = false;
+            const uint64_t latency = CurrentTime() - work->queued_at;
+            ++work->latency.count;
+            work->latency.total_ns += latency;
+            if(latency > work->latency.max_ns) {
+                work->latency.max_ns = latency;
+            }
+        } else if(msg->type == Message::kTimerTimeout) {
+            const auto &p = wq->periodic_[msg->arg.timer.value];
+            timer_manager->AddTimer(Timer{msg->arg.timer.timeout + p.period,
+                                          msg->arg.timer.value, task_id});
+            work = p.work;
+        }
+        __asm__("sti");
+
+        if(work) { work->func(work->arg); }
+    }
+}
+
+WorkQueue *xhci_workqueue;
+WorkQueue *net_workqueue;
+
+Work xhci_event_work{[](void *) { usb::xhci::ProcessEvents(); }};
+Work e1000_intr_work{[](void *) { e1000_intr(); }};
+Work net_softirq_work{[](void *) {
+    __asm__("cli");
+    net_softirq_handler();
+    __asm__("sti");
+}};
+Work net_timer_work{[](void *) { net_timer_handler(); }};
+
+void InitializeWorkQueues() {
+    // 入力の処理がパケットの処理に待たされないよう, xHCI を高いレベルに置く
+    xhci_workqueue = new WorkQueue(3);
+    net_workqueue = new WorkQueue(2);
+    net_workqueue->QueuePeriodic(net_timer_work, kTimerFreq / 10);
+}
@@ -0,0 +1,57 @@
+/**
+ * @file workqueue.hpp
+ *
+ * 割り込みの後処理などをカーネルのワーカータスクで実行する仕組み
+ */
+#pragma once
+#include <cstdint>
+#include <vector>
+
+class Task;
+
+/** ワーカータスクで実行する仕事. 実行が始まるまでは何度積んでも1回だけ実行される */
+struct Work {
+    void (*func)(void *arg);
+    void *arg{nullptr};
+
+    bool pending{false};
+    uint64_t queued_at{0}; // 積まれた時刻(ナノ秒)
+
+    /** 積まれてから実行が始まるまでの時間 */
+    struct Latency {
+        uint64_t count, total_ns, max_ns;
+    } latency{};
+};
+
+class WorkQueue {
+  public:
+    /** level で動くワーカータスクを作る. 割り込み許可で呼ぶ */
+    explicit WorkQueue(int level);
+    /** work を積んでワーカーを起こす. 割り込みハンドラからも呼べる */
+    void Queue(Work &work);
+    /** period ティックごとに work を実行する */
+    void QueuePeriodic(Work &work, unsigned long period);
+    uint64_t TaskID() const;
+
+  private:
+    struct Periodic {
+        Work *work;
+        unsigned long period;
+    };
+
+    Task *task_;
+    std::vector<Periodic> periodic_{};
+
+    static void TaskWorker(uint64_t task_id, int64_t data);
+};
+
+extern WorkQueue *xhci_workqueue; // xHCI のイベント処理
+extern WorkQueue *net_workqueue;  // e1000 の割り込み処理とプロトコル処理
+
+extern Work xhci_event_work;
+extern Work e1000_intr_work;
+extern Work net_softirq_work;
+extern Work net_timer_work;
+
+/** タスク管理の初期化後, xHCI とネットワークの初期化前に呼ぶ */
+void InitializeWorkQueues();